@@ -0,0 +1,2 @@
+#cmakedefine HAVE_ZSTD 1
+#cmakedefine HAVE_LZ4 1
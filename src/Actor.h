@@ -1,38 +1,98 @@
 #ifndef sw_x0_Actor_h
 #define sw_x0_Actor_h (1)
 
-#include <deque>
+#include <atomic>
 #include <vector>
-#include <pthread.h>
 #include <thread>
 #include <future>
-#include <mutex>
-#include <condition_variable>
 #include <memory>
+#include <chrono>
 #include <functional>
+#include <cstdint>
+#include <cstddef>
+#include <climits>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 namespace x0 {
 
+/**
+ * Snapshot of an actor's runtime metrics, as returned by Actor::stats().
+ */
+struct ActorStats
+{
+	size_t depth;             // number of messages currently queued
+	size_t enqueued;          // total number of messages sent
+	size_t batches;           // total number of processBatch() invocations
+	size_t wakeups;           // number of times send() had to wake up a parked consumer
+	size_t stalls;            // number of times send() had to wait for the queue to drain
+	uint64_t enqueueNanos;    // total time spent inside send()
+	uint64_t maxEnqueueNanos; // longest time spent inside a single send(), since the last stats()
+};
+
+/**
+ * Message queue, processed by a fixed number of consumer threads.
+ *
+ * Messages are passed through a lock-free bounded ring (Dmitry Vyukov's
+ * sequence-numbered cells), which any number of threads may send() to
+ * concurrently. Consumers drain up to MaxBatchSize messages at a time and
+ * hand them to processBatch(), and park on a futex once the ring stayed empty
+ * for a brief spin. Producers only issue a wakeup if a consumer is actually
+ * parked, and likewise park themselves while the ring is full.
+ */
 template<typename Message>
 class Actor
 {
 private:
-	bool shutdown_;
-	std::deque<Message> messages_;
+	enum { CacheLineSize = 64 };
+	enum { MaxBatchSize = 64 };
+	enum { SpinCount = 1024 }; // number of polls on an empty queue before a consumer parks
+
+	struct Cell {
+		std::atomic<size_t> sequence;
+		Message message;
+	};
+
+	size_t capacity_;
+	size_t mask_;
+	std::unique_ptr<Cell[]> cells_;
+
+	// producer and consumer positions, each on its own cache line(s)
+	char padding0_[CacheLineSize];
+	std::atomic<size_t> enqueuePos_;
+	char padding1_[CacheLineSize];
+	std::atomic<size_t> dequeuePos_;
+	char padding2_[CacheLineSize];
+
+	// parking
+	std::atomic<uint32_t> notEmpty_; // futex word, bumped to wake up parked consumers
+	std::atomic<uint32_t> notFull_;  // futex word, bumped to wake up parked producers
+	std::atomic<int> idleConsumers_;
+	std::atomic<int> blockedProducers_;
+	std::atomic<bool> shutdown_;
+
+	// metrics
+	std::atomic<size_t> enqueued_;
+	std::atomic<size_t> batches_;
+	std::atomic<size_t> wakeups_;
+	std::atomic<size_t> stalls_;
+	std::atomic<uint64_t> enqueueNanos_;
+	std::atomic<uint64_t> maxEnqueueNanos_;
+
 	std::vector<std::future<void>> threads_;
-	std::mutex mutex_;
-	std::unique_lock<std::mutex> lock_;
-	std::condition_variable cond_;
 
 public:
-	explicit Actor(size_t scalability = 1);
+	explicit Actor(size_t scalability = 1, size_t capacity = 4096);
 	virtual ~Actor();
 
 	bool empty() const;
 	size_t size() const;
+	size_t capacity() const { return capacity_; }
 	int scalability() const { return threads_.size(); }
 
 	void send(const Message& message);
+	bool trySend(const Message& message);
 
 	void push_back(const Message& message) { send(message); }
 	Actor<Message>& operator<<(const Message& message) { send(message); return *this; }
@@ -40,24 +100,59 @@ public:
 	void start();
 	void stop();
 	void join();
+	bool join(const std::chrono::steady_clock::time_point& deadline);
+
+	ActorStats stats();
 
 protected:
 	virtual void process(Message message) = 0;
+	virtual void processBatch(Message* messages, size_t count);
 
 private:
+	bool tryEnqueue(const Message& message);
+	size_t tryDequeue(Message* messages, size_t limit);
+	void wakeConsumer();
+	void wakeProducers();
 	void main();
+
+	static void cpuRelax();
+	static void futexWait(std::atomic<uint32_t>* word, uint32_t value);
+	static void futexWake(std::atomic<uint32_t>* word, int count);
 };
 
 // {{{ impl
+/**
+ * @param scalability number of consumer threads.
+ * @param capacity    maximum number of queued messages, rounded up to a power of 2.
+ */
 template<typename Message>
-inline Actor<Message>::Actor(size_t scalability) :
+inline Actor<Message>::Actor(size_t scalability, size_t capacity) :
+	capacity_(2),
+	mask_(0),
+	cells_(),
+	enqueuePos_(0),
+	dequeuePos_(0),
+	notEmpty_(0),
+	notFull_(0),
+	idleConsumers_(0),
+	blockedProducers_(0),
 	shutdown_(false),
-	messages_(),
-	threads_(scalability),
-	mutex_(),
-	lock_(mutex_),
-	cond_()
+	enqueued_(0),
+	batches_(0),
+	wakeups_(0),
+	stalls_(0),
+	enqueueNanos_(0),
+	maxEnqueueNanos_(0),
+	threads_(scalability)
 {
+	while (capacity_ < capacity)
+		capacity_ <<= 1;
+
+	mask_ = capacity_ - 1;
+	cells_.reset(new Cell[capacity_]);
+
+	for (size_t i = 0; i < capacity_; ++i)
+		cells_[i].sequence.store(i, std::memory_order_relaxed);
 }
 
 template<typename Message>
@@ -74,17 +169,63 @@ bool Actor<Message>::empty() const
 template<typename Message>
 size_t Actor<Message>::size() const
 {
-	std::lock_guard<decltype(mutex_)> l(mutex_);
-	size_t result = messages_.size();
-	return result;
+	size_t head = dequeuePos_.load(std::memory_order_acquire);
+	size_t tail = enqueuePos_.load(std::memory_order_acquire);
+	return tail > head ? tail - head : 0;
 }
 
+/**
+ * Enqueues the message, waiting for the consumers to make room if the queue is full.
+ */
 template<typename Message>
 inline void Actor<Message>::send(const Message& message)
 {
-	std::lock_guard<decltype(mutex_)> l(mutex_);
-	messages_.push_back(message);
-	cond_.notify_one();
+	auto start = std::chrono::steady_clock::now();
+
+	if (!tryEnqueue(message)) {
+		stalls_.fetch_add(1, std::memory_order_relaxed);
+
+		for (;;) {
+			uint32_t epoch = notFull_.load(std::memory_order_acquire);
+			blockedProducers_.fetch_add(1);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+
+			bool sent = tryEnqueue(message);
+			if (!sent)
+				futexWait(&notFull_, epoch);
+
+			blockedProducers_.fetch_sub(1);
+
+			if (sent || tryEnqueue(message))
+				break;
+		}
+	}
+
+	wakeConsumer();
+
+	uint64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - start).count();
+
+	enqueued_.fetch_add(1, std::memory_order_relaxed);
+	enqueueNanos_.fetch_add(nanos, std::memory_order_relaxed);
+
+	uint64_t max = maxEnqueueNanos_.load(std::memory_order_relaxed);
+	while (nanos > max && !maxEnqueueNanos_.compare_exchange_weak(max, nanos, std::memory_order_relaxed))
+		;
+}
+
+/**
+ * Enqueues the message unless the queue is full.
+ */
+template<typename Message>
+inline bool Actor<Message>::trySend(const Message& message)
+{
+	if (!tryEnqueue(message))
+		return false;
+
+	wakeConsumer();
+	enqueued_.fetch_add(1, std::memory_order_relaxed);
+	return true;
 }
 
 template<typename Message>
@@ -93,49 +234,211 @@ void Actor<Message>::start()
 	shutdown_ = false;
 
 	for (auto& thread: threads_) {
-		thread = std::move(std::async(std::bind(&Actor<Message>::main, this)));
+		thread = std::move(std::async(std::launch::async, std::bind(&Actor<Message>::main, this)));
 	}
 }
 
+/**
+ * Makes the consumer threads exit, once all messages sent so far have been processed.
+ */
 template<typename Message>
 inline void Actor<Message>::stop()
 {
-	shutdown_ = true;
-	cond_.notify_all();
+	shutdown_.store(true, std::memory_order_release);
+	notEmpty_.fetch_add(1, std::memory_order_release);
+	futexWake(&notEmpty_, INT_MAX);
 }
 
 template<typename Message>
 inline void Actor<Message>::join()
 {
 	for (auto& thread: threads_) {
-		thread.wait();
+		if (thread.valid()) {
+			thread.wait();
+		}
+	}
+}
+
+/**
+ * Waits for the consumer threads to exit, but no longer than until the deadline.
+ *
+ * @retval false the deadline passed, with consumer threads still running.
+ */
+template<typename Message>
+inline bool Actor<Message>::join(const std::chrono::steady_clock::time_point& deadline)
+{
+	for (auto& thread: threads_) {
+		if (thread.valid() && thread.wait_until(deadline) == std::future_status::timeout) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Retrieves the actor's metrics, and resets the maximum enqueue latency.
+ */
+template<typename Message>
+ActorStats Actor<Message>::stats()
+{
+	ActorStats result;
+	result.depth = size();
+	result.enqueued = enqueued_.load(std::memory_order_relaxed);
+	result.batches = batches_.load(std::memory_order_relaxed);
+	result.wakeups = wakeups_.load(std::memory_order_relaxed);
+	result.stalls = stalls_.load(std::memory_order_relaxed);
+	result.enqueueNanos = enqueueNanos_.load(std::memory_order_relaxed);
+	result.maxEnqueueNanos = maxEnqueueNanos_.exchange(0, std::memory_order_relaxed);
+	return result;
+}
+
+/**
+ * Processes a batch of messages, in the order they have been sent.
+ *
+ * The default implementation invokes process() for each of them.
+ */
+template<typename Message>
+void Actor<Message>::processBatch(Message* messages, size_t count)
+{
+	for (size_t i = 0; i < count; ++i) {
+		process(messages[i]);
+	}
+}
+
+template<typename Message>
+inline bool Actor<Message>::tryEnqueue(const Message& message)
+{
+	size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+
+	for (;;) {
+		Cell& cell = cells_[pos & mask_];
+		size_t sequence = cell.sequence.load(std::memory_order_acquire);
+		intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+
+		if (diff == 0) {
+			if (enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				cell.message = message;
+				cell.sequence.store(pos + 1, std::memory_order_release);
+				return true;
+			}
+		} else if (diff < 0) {
+			return false; // full
+		} else {
+			pos = enqueuePos_.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+// moves up to limit messages into the given array, returning how many
+template<typename Message>
+inline size_t Actor<Message>::tryDequeue(Message* messages, size_t limit)
+{
+	size_t count = 0;
+	size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+
+	while (count < limit) {
+		Cell& cell = cells_[pos & mask_];
+		size_t sequence = cell.sequence.load(std::memory_order_acquire);
+		intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+
+		if (diff == 0) {
+			if (dequeuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				messages[count++] = cell.message;
+				cell.sequence.store(pos + mask_ + 1, std::memory_order_release);
+				++pos;
+			}
+		} else if (diff < 0) {
+			break; // empty
+		} else {
+			pos = dequeuePos_.load(std::memory_order_relaxed);
+		}
+	}
+
+	return count;
+}
+
+template<typename Message>
+inline void Actor<Message>::wakeConsumer()
+{
+	// pairs with the fence in main(): either we see the parked consumer, or it sees our message
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if (idleConsumers_.load(std::memory_order_relaxed) > 0) {
+		notEmpty_.fetch_add(1, std::memory_order_release);
+		futexWake(&notEmpty_, 1);
+		wakeups_.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+template<typename Message>
+inline void Actor<Message>::wakeProducers()
+{
+	// pairs with the fence in send()
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if (blockedProducers_.load(std::memory_order_relaxed) > 0) {
+		notFull_.fetch_add(1, std::memory_order_release);
+		futexWake(&notFull_, INT_MAX);
 	}
 }
 
 template<typename Message>
 void Actor<Message>::main()
 {
-	std::lock_guard<decltype(mutex_)> l(mutex_);
+	std::unique_ptr<Message[]> batch(new Message[MaxBatchSize]);
 
 	for (;;) {
-		cond_.wait(lock_);
+		if (size_t count = tryDequeue(batch.get(), MaxBatchSize)) {
+			wakeProducers();
+			batches_.fetch_add(1, std::memory_order_relaxed);
+			processBatch(batch.get(), count);
+			continue;
+		}
 
-		if (shutdown_)
+		if (shutdown_.load(std::memory_order_acquire) && empty())
 			break;
 
-		Message message = messages_.front();
-		messages_.pop_front();
+		// saves the wakeup for messages that arrive in quick succession
+		for (int i = 0; i < SpinCount && empty() && !shutdown_.load(std::memory_order_relaxed); ++i)
+			cpuRelax();
 
-			process(message);
-		/*lock_.unlock();
-		try {
-		} catch (...) {
-			lock_.lock();
-			throw;
-		}
-		lock_.lock();*/
+		if (!empty())
+			continue;
+
+		uint32_t epoch = notEmpty_.load(std::memory_order_acquire);
+		idleConsumers_.fetch_add(1);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		if (empty() && !shutdown_.load(std::memory_order_acquire))
+			futexWait(&notEmpty_, epoch);
+
+		idleConsumers_.fetch_sub(1);
 	}
 }
+
+template<typename Message>
+inline void Actor<Message>::cpuRelax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#else
+	std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+}
+
+template<typename Message>
+inline void Actor<Message>::futexWait(std::atomic<uint32_t>* word, uint32_t value)
+{
+	// returns immediately if *word no longer equals value
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT_PRIVATE, value, nullptr, nullptr, 0);
+}
+
+template<typename Message>
+inline void Actor<Message>::futexWake(std::atomic<uint32_t>* word, int count)
+{
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+}
 // }}}
 
 } // namespace x0
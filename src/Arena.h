@@ -0,0 +1,155 @@
+#ifndef sw_x0_Arena_h
+#define sw_x0_Arena_h (1)
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+
+namespace x0 {
+
+/**
+ * A fixed size chunk of memory, carved from an Arena.
+ *
+ * Chunks are meant to be linked into singly linked chains via \c next,
+ * each holding up to capacity() bytes of payload.
+ */
+struct ArenaChunk
+{
+	ArenaChunk* next;
+	uint32_t size;     // number of payload bytes in use
+	uint32_t capacity; // number of payload bytes available
+	char data[1];
+};
+
+/**
+ * Thread-owned allocator of fixed size chunks.
+ *
+ * Chunks are allocated by the owning thread only, without any locking,
+ * but may be released back from any thread (e.g. the writer), which pushes
+ * them onto a lock-free stack the owner reclaims from once its local free
+ * list runs dry.
+ *
+ * Memory is allocated in slabs and is never given back to the system
+ * before the arena itself is destroyed.
+ */
+class Arena
+{
+private:
+	size_t chunkSize_;
+	size_t slabSize_;
+	std::vector<char*> slabs_;
+	ArenaChunk* free_;                   // owner thread only
+	std::atomic<ArenaChunk*> returned_;  // released by any thread
+	std::atomic<size_t> slabCount_;
+	std::atomic<size_t> chunksInUse_;
+
+public:
+	explicit Arena(size_t chunkSize = 512, size_t slabSize = 1024 * 1024);
+	~Arena();
+
+	size_t chunkSize() const { return chunkSize_; }
+	size_t bytesReserved() const { return slabCount_.load(std::memory_order_relaxed) * slabSize_; }
+	size_t bytesInUse() const { return chunksInUse_.load(std::memory_order_relaxed) * chunkSize_; }
+
+	ArenaChunk* allocate();
+	void release(ArenaChunk* chain);
+
+private:
+	bool grow();
+
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+};
+
+// {{{ impl
+inline Arena::Arena(size_t chunkSize, size_t slabSize) :
+	chunkSize_((chunkSize + 63) & ~size_t(63)),
+	slabSize_(slabSize < chunkSize_ ? chunkSize_ : slabSize),
+	slabs_(),
+	free_(nullptr),
+	returned_(nullptr),
+	slabCount_(0),
+	chunksInUse_(0)
+{
+}
+
+inline Arena::~Arena()
+{
+	for (auto slab: slabs_)
+		std::free(slab);
+}
+
+/**
+ * Allocates an empty chunk (owner thread only).
+ *
+ * @return the chunk, or NULL if no more memory could be allocated.
+ */
+inline ArenaChunk* Arena::allocate()
+{
+	if (!free_) {
+		free_ = returned_.exchange(nullptr, std::memory_order_acquire);
+
+		if (!free_ && !grow())
+			return nullptr;
+	}
+
+	ArenaChunk* chunk = free_;
+	free_ = chunk->next;
+
+	chunk->next = nullptr;
+	chunk->size = 0;
+
+	chunksInUse_.fetch_add(1, std::memory_order_relaxed);
+
+	return chunk;
+}
+
+/**
+ * Gives a whole chain of chunks back to the arena (any thread).
+ */
+inline void Arena::release(ArenaChunk* chain)
+{
+	if (!chain)
+		return;
+
+	size_t count = 1;
+	ArenaChunk* last = chain;
+	while (last->next) {
+		last = last->next;
+		++count;
+	}
+
+	last->next = returned_.load(std::memory_order_relaxed);
+	while (!returned_.compare_exchange_weak(last->next, chain, std::memory_order_release, std::memory_order_relaxed))
+		;
+
+	chunksInUse_.fetch_sub(count, std::memory_order_relaxed);
+}
+
+inline bool Arena::grow()
+{
+	char* slab = static_cast<char*>(std::malloc(slabSize_));
+	if (!slab)
+		return false;
+
+	slabs_.push_back(slab);
+	slabCount_.fetch_add(1, std::memory_order_relaxed);
+
+	const uint32_t capacity = chunkSize_ - offsetof(ArenaChunk, data);
+
+	for (size_t offset = 0; offset + chunkSize_ <= slabSize_; offset += chunkSize_) {
+		ArenaChunk* chunk = reinterpret_cast<ArenaChunk*>(slab + offset);
+		chunk->capacity = capacity;
+		chunk->next = free_;
+		free_ = chunk;
+	}
+
+	return true;
+}
+// }}}
+
+} // namespace x0
+
+#endif
@@ -0,0 +1,572 @@
+#ifndef sw_x0_ChunkCompaction_h
+#define sw_x0_ChunkCompaction_h (1)
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cstddef>
+#include <unistd.h>
+
+namespace x0 {
+
+/**
+ * Rewrites a CSV chunk file with all records of a key merged into one.
+ *
+ * A chunk file is a "first_seen;key;values" header line, followed by records
+ * of the form "\n<first_seen>;<key>(;<value>)*". A key usually ends up in many
+ * records, one per bucket. The compacted file holds one record per key,
+ * sorted by key, with the earliest first_seen and all values in first_seen
+ * order.
+ *
+ * Records are sorted externally, with bounded memory: the file is read into
+ * runs of up to memoryLimit bytes, each sorted and written to a temporary run
+ * file, which are then merged into the result (in several passes if there are
+ * more than MaxFanIn runs). Run files keep the records as they are, so that
+ * only the final pass merges each key's records, and interleaves their values
+ * by first_seen across runs. Temporary files live next to the chunk file. The
+ * result replaces the chunk file by rename(), once synced; on failure, the
+ * chunk file is left as is.
+ *
+ * A compaction may be aborted from another thread, through the flag passed
+ * in, which it checks for every record read or merged. It then fails, leaving
+ * the chunk file as is, and removes its temporary files.
+ */
+class ChunkCompaction
+{
+public:
+	enum { MaxFanIn = 64 };         // max. number of runs merged at once
+	enum { ReadSize = 256 * 1024 }; // bytes read from a file at a time
+
+	ChunkCompaction(const std::string& path, size_t memoryLimit, const std::atomic<bool>* abort = nullptr);
+	~ChunkCompaction();
+
+	bool run();
+
+	bool aborted() const { return abort_ && abort_->load(std::memory_order_relaxed); }
+	const std::string& error() const { return error_; }
+	size_t recordsIn() const { return recordsIn_; }
+	size_t recordsOut() const { return recordsOut_; }
+	size_t bytesIn() const { return bytesIn_; }
+	size_t bytesOut() const { return bytesOut_; }
+	size_t runCount() const { return runCount_; }
+
+	static const char* header() { return "first_seen;key;values"; }
+	static bool isTemporary(const std::string& path, std::string* chunkPath);
+
+private:
+	// a single record, pointing into the line it got parsed from
+	struct Record {
+		const char* data;
+		size_t size;
+		size_t keyBegin;  // offset of the key
+		size_t keyEnd;    // offset of the ';' before the values, or size
+		double time;
+
+		const char* key() const { return data + keyBegin; }
+		size_t keySize() const { return keyEnd - keyBegin; }
+		bool before(const Record& other) const;
+	};
+
+	// buffered reader of a file's records
+	class Reader {
+	public:
+		explicit Reader(std::FILE* file) : file_(file), buffer_(), pos_(0), eof_(false) {}
+		~Reader() { if (file_) std::fclose(file_); }
+
+		bool next(Record* record, bool* malformed);
+		bool failed() const { return std::ferror(file_) != 0; }
+
+	private:
+		std::FILE* file_;
+		std::string buffer_;
+		size_t pos_;
+		bool eof_;
+	};
+
+	// merges consecutive records of the same key, as they are passed in order (unless told not to)
+	class Output {
+	public:
+		Output(std::FILE* file, bool merging) :
+			file_(file), merging_(merging), current_(), keyBegin_(0), keyEnd_(0), count_(0), bytes_(0), failed_(false) {}
+
+		void write(const char* data, size_t size);
+		void add(const Record& record);
+		bool finish();
+		size_t count() const { return count_; }
+		size_t bytes() const { return bytes_; }
+
+	private:
+		std::FILE* file_;
+		bool merging_;
+		std::string current_;     // the record being merged, starting with its '\n'
+		size_t keyBegin_;         // offset of its key within current_
+		size_t keyEnd_;
+		size_t count_;
+		size_t bytes_;
+		bool failed_;
+	};
+
+	std::string path_;
+	size_t memoryLimit_;
+	const std::atomic<bool>* abort_;
+	std::string data_;             // the run being read, in memory
+	std::vector<Record> records_;  // its records, pointing into data_
+	std::vector<std::string> runs_;
+	unsigned nextRun_;
+	std::string error_;
+
+	size_t recordsIn_;
+	size_t recordsOut_;
+	size_t bytesIn_;
+	size_t bytesOut_;
+	size_t runCount_;
+
+	static bool parse(const char* line, size_t size, Record* record);
+
+	bool split();
+	bool writeRun(std::FILE* file, bool final, size_t* count);
+	bool spill();
+	bool merge(const std::vector<std::string>& runs, std::FILE* file, bool final, size_t* count);
+	std::FILE* create(std::string* path);
+	bool fail(const char* what, const std::string& path);
+	bool checkAborted();
+	void cleanup();
+
+	ChunkCompaction(const ChunkCompaction&) = delete;
+	ChunkCompaction& operator=(const ChunkCompaction&) = delete;
+};
+
+// {{{ impl
+inline bool ChunkCompaction::Record::before(const Record& other) const
+{
+	size_t n = std::min(keySize(), other.keySize());
+	int rv = std::memcmp(key(), other.key(), n);
+	if (rv != 0)
+		return rv < 0;
+	if (keySize() != other.keySize())
+		return keySize() < other.keySize();
+	return time < other.time;
+}
+
+/**
+ * Parses "<first_seen>;<key>(;<value>)*", a line without its '\n'.
+ *
+ * A header line glued to its end (as appended by a restarted writer) is cut
+ * off. Returns false for a malformed line; an empty one yields a record of
+ * size 0.
+ */
+inline bool ChunkCompaction::parse(const char* line, size_t size, Record* record)
+{
+	const size_t headerSize = std::strlen(header());
+
+	if (size >= headerSize && std::memcmp(line + size - headerSize, header(), headerSize) == 0)
+		size -= headerSize;
+
+	record->data = line;
+	record->size = size;
+
+	if (size == 0)
+		return true;
+
+	const char* end = line + size;
+	const char* timeEnd = static_cast<const char*>(std::memchr(line, ';', size));
+	if (!timeEnd)
+		return false;
+
+	char* parsed = nullptr;
+	record->time = std::strtod(line, &parsed);
+	if (parsed != timeEnd)
+		return false;
+
+	const char* keyEnd = static_cast<const char*>(std::memchr(timeEnd + 1, ';', end - timeEnd - 1));
+	record->keyBegin = timeEnd + 1 - line;
+	record->keyEnd = keyEnd ? keyEnd - line : size;
+	return true;
+}
+
+/**
+ * Retrieves the next non-empty record, valid until the next call.
+ *
+ * @return false at the end of the file, or if a line is malformed.
+ */
+inline bool ChunkCompaction::Reader::next(Record* record, bool* malformed)
+{
+	for (;;) {
+		const char* begin = buffer_.data() + pos_;
+		const char* nl = static_cast<const char*>(std::memchr(begin, '\n', buffer_.size() - pos_));
+
+		if (!nl && !eof_) {
+			buffer_.erase(0, pos_);
+			pos_ = 0;
+
+			size_t offset = buffer_.size();
+			buffer_.resize(offset + ReadSize);
+			size_t n = std::fread(&buffer_[offset], 1, ReadSize, file_);
+			buffer_.resize(offset + n);
+			if (n == 0)
+				eof_ = true;
+			continue;
+		}
+
+		if (!nl && pos_ == buffer_.size())
+			return false;
+
+		size_t size = nl ? nl - begin : buffer_.size() - pos_;
+		pos_ += nl ? size + 1 : size;
+
+		if (!parse(begin, size, record)) {
+			*malformed = true;
+			return false;
+		}
+
+		if (record->size != 0)
+			return true;
+	}
+}
+
+inline void ChunkCompaction::Output::add(const Record& record)
+{
+	if (merging_ && !current_.empty() && keyEnd_ - keyBegin_ == record.keySize() &&
+			std::memcmp(&current_[keyBegin_], record.key(), record.keySize()) == 0) {
+		// values only, including their leading ';'
+		current_.append(record.data + record.keyEnd, record.size - record.keyEnd);
+		return;
+	}
+
+	finish();
+
+	current_.push_back('\n');
+	current_.append(record.data, record.size);
+	keyBegin_ = 1 + record.keyBegin;
+	keyEnd_ = 1 + record.keyEnd;
+}
+
+// writes the record being merged, if any
+inline bool ChunkCompaction::Output::finish()
+{
+	if (!current_.empty()) {
+		write(current_.data(), current_.size());
+		++count_;
+		current_.clear();
+	}
+
+	return !failed_;
+}
+
+inline void ChunkCompaction::Output::write(const char* data, size_t size)
+{
+	if (std::fwrite(data, 1, size, file_) != size)
+		failed_ = true;
+
+	bytes_ += size;
+}
+
+inline ChunkCompaction::ChunkCompaction(const std::string& path, size_t memoryLimit, const std::atomic<bool>* abort) :
+	path_(path),
+	memoryLimit_(std::max(memoryLimit, size_t(1024 * 1024))),
+	abort_(abort),
+	data_(),
+	records_(),
+	runs_(),
+	nextRun_(0),
+	error_(),
+	recordsIn_(0),
+	recordsOut_(0),
+	bytesIn_(0),
+	bytesOut_(0),
+	runCount_(0)
+{
+}
+
+inline ChunkCompaction::~ChunkCompaction()
+{
+	cleanup();
+}
+
+/**
+ * Compacts the chunk file.
+ *
+ * @return false if it could not be compacted (see error()), or got aborted
+ *         (see aborted()), in which case it is left untouched.
+ */
+inline bool ChunkCompaction::run()
+{
+	if (!split())
+		return false;
+
+	std::string target = path_ + ".compacting";
+	std::FILE* file = std::fopen(target.c_str(), "w");
+	if (!file)
+		return fail("Could not create", target);
+
+	// reduce the number of runs to what can be merged at once
+	while (runs_.size() > MaxFanIn) {
+		std::vector<std::string> merged(runs_.begin(), runs_.begin() + MaxFanIn);
+		std::string path;
+		std::FILE* run = create(&path);
+		bool ok = run && merge(merged, run, false, nullptr);
+		if (!run || std::fclose(run) != 0 || !ok) {
+			std::fclose(file);
+			std::remove(target.c_str());
+			return run && error_.empty() ? fail("Could not write", path) : false;
+		}
+
+		for (const std::string& m: merged)
+			std::remove(m.c_str());
+
+		// in place of the runs it replaces, keeping the runs in file order
+		runs_.erase(runs_.begin(), runs_.begin() + MaxFanIn);
+		std::rotate(runs_.begin(), runs_.end() - 1, runs_.end());
+	}
+
+	// a file that fit into memory is written right away
+	bool ok = runs_.empty()
+		? writeRun(file, true, &recordsOut_)
+		: merge(runs_, file, true, &recordsOut_);
+	ok = ok && std::fflush(file) == 0 && ::fsync(fileno(file)) == 0;
+	if (ok)
+		bytesOut_ = std::ftell(file);
+	ok = std::fclose(file) == 0 && ok;
+
+	if (!ok || std::rename(target.c_str(), path_.c_str()) != 0) {
+		if (error_.empty())
+			fail("Could not write", target);
+		std::remove(target.c_str());
+		return false;
+	}
+
+	cleanup();
+	return true;
+}
+
+/**
+ * Reads the chunk file into sorted runs, each written to a run file, except
+ * for the last one if it is the only one.
+ */
+inline bool ChunkCompaction::split()
+{
+	std::FILE* input = std::fopen(path_.c_str(), "r");
+	if (!input)
+		return fail("Could not open", path_);
+
+	Reader reader(input);
+	data_.reserve(memoryLimit_);
+
+	Record record;
+	bool malformed = false;
+	while (reader.next(&record, &malformed)) {
+		if (checkAborted())
+			return false;
+
+		++recordsIn_;
+		bytesIn_ += record.size + 1;
+
+		// keeps data_ within its capacity, so that the records' pointers stay valid
+		if (!records_.empty() && data_.size() + record.size + (records_.size() + 1) * sizeof(Record) > memoryLimit_) {
+			if (!spill())
+				return false;
+		}
+
+		size_t offset = data_.size();
+		data_.append(record.data, record.size);
+		record.data = data_.data() + offset;
+		records_.push_back(record);
+	}
+
+	if (malformed) {
+		error_ = "Malformed record in " + path_ + " (record " + std::to_string(recordsIn_ + 1) + ")";
+		return false;
+	}
+
+	if (reader.failed())
+		return fail("Could not read", path_);
+
+	if (!runs_.empty() && !records_.empty())
+		return spill();
+
+	return true;
+}
+
+// writes the run in memory to the next run file
+inline bool ChunkCompaction::spill()
+{
+	std::string path;
+	std::FILE* file = create(&path);
+	if (!file)
+		return false;
+
+	bool ok = writeRun(file, false, nullptr);
+	if (std::fclose(file) != 0 || !ok)
+		return fail("Could not write", path);
+
+	return true;
+}
+
+/**
+ * Sorts the run in memory, and writes it: as the result (with header, and
+ * merged per key) if @p final is set, or as a run file (record by record).
+ */
+inline bool ChunkCompaction::writeRun(std::FILE* file, bool final, size_t* count)
+{
+	// stable, so that values of equal first_seen stay in file order
+	std::stable_sort(records_.begin(), records_.end(),
+		[](const Record& a, const Record& b) { return a.before(b); });
+
+	Output output(file, final);
+	if (final)
+		output.write(header(), std::strlen(header()));
+
+	for (const Record& record: records_)
+		output.add(record);
+
+	data_.clear();
+	records_.clear();
+	++runCount_;
+
+	bool ok = output.finish();
+	if (count)
+		*count = output.count();
+
+	return ok;
+}
+
+/**
+ * Merges the sorted runs (in file order) into the file: as the result (with
+ * header, and merged per key) if @p final is set, or as a run file.
+ */
+inline bool ChunkCompaction::merge(const std::vector<std::string>& runs, std::FILE* file, bool final, size_t* count)
+{
+	std::vector<Reader*> readers;
+	std::vector<Record> heads(runs.size());
+	std::vector<size_t> heap;
+	bool malformed = false;
+	bool ok = true;
+
+	for (size_t i = 0; i < runs.size() && ok; ++i) {
+		std::FILE* run = std::fopen(runs[i].c_str(), "r");
+		if (!run) {
+			ok = fail("Could not open", runs[i]);
+			break;
+		}
+
+		readers.push_back(new Reader(run));
+		if (readers.back()->next(&heads[i], &malformed))
+			heap.push_back(i);
+	}
+
+	// a min-heap of the runs, by their current record, and by run for equal ones
+	auto later = [&](size_t a, size_t b) {
+		return heads[b].before(heads[a]) || (!heads[a].before(heads[b]) && b < a);
+	};
+	std::make_heap(heap.begin(), heap.end(), later);
+
+	Output output(file, final);
+	if (final)
+		output.write(header(), std::strlen(header()));
+
+	while (ok && !heap.empty()) {
+		if (checkAborted()) {
+			ok = false;
+			break;
+		}
+
+		std::pop_heap(heap.begin(), heap.end(), later);
+		size_t i = heap.back();
+
+		output.add(heads[i]);
+
+		if (readers[i]->next(&heads[i], &malformed))
+			std::push_heap(heap.begin(), heap.end(), later);
+		else
+			heap.pop_back();
+	}
+
+	ok = output.finish() && ok;
+
+	for (Reader* reader: readers) {
+		if (reader->failed())
+			ok = false;
+		delete reader;
+	}
+
+	if (malformed && error_.empty())
+		error_ = "Malformed record in a run file of " + path_;
+
+	if (count)
+		*count = output.count();
+
+	return ok && !malformed;
+}
+
+// creates the next run file
+inline std::FILE* ChunkCompaction::create(std::string* path)
+{
+	*path = path_ + ".run" + std::to_string(nextRun_++);
+
+	std::FILE* file = std::fopen(path->c_str(), "w");
+	if (!file) {
+		fail("Could not create", *path);
+		return nullptr;
+	}
+
+	runs_.push_back(*path);
+	return file;
+}
+
+inline bool ChunkCompaction::fail(const char* what, const std::string& path)
+{
+	error_ = std::string(what) + " " + path + ": " + std::strerror(errno);
+	return false;
+}
+
+inline bool ChunkCompaction::checkAborted()
+{
+	if (!aborted())
+		return false;
+
+	error_ = "Aborted";
+	return true;
+}
+
+/**
+ * Tells whether the given path is one of the temporary files of a
+ * compaction, i.e. "<chunk file>.compacting" or "<chunk file>.run<N>", and
+ * if so, of which chunk file.
+ */
+inline bool ChunkCompaction::isTemporary(const std::string& path, std::string* chunkPath)
+{
+	static const char compacting[] = ".compacting";
+	const size_t compactingSize = sizeof(compacting) - 1;
+
+	if (path.size() > compactingSize && path.compare(path.size() - compactingSize, compactingSize, compacting) == 0) {
+		chunkPath->assign(path, 0, path.size() - compactingSize);
+		return true;
+	}
+
+	size_t run = path.rfind(".run");
+	if (run == std::string::npos || run == 0 || run + 4 == path.size() ||
+			path.find_first_not_of("0123456789", run + 4) != std::string::npos)
+		return false;
+
+	chunkPath->assign(path, 0, run);
+	return true;
+}
+
+// removes all run files left
+inline void ChunkCompaction::cleanup()
+{
+	for (const std::string& run: runs_)
+		std::remove(run.c_str());
+
+	runs_.clear();
+}
+// }}}
+
+} // namespace x0
+
+#endif
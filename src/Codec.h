@@ -0,0 +1,180 @@
+#ifndef sw_x0_Codec_h
+#define sw_x0_Codec_h (1)
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cstddef>
+
+#ifdef HAVE_ZSTD
+#	include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#	include <lz4frame.h>
+#endif
+
+namespace x0 {
+
+/**
+ * One-shot compression into self-contained frames.
+ *
+ * Each frame can be decoded on its own, and files made of concatenated
+ * frames can be decoded by the codecs' standard tools (zstdcat, lz4cat).
+ * Codecs are optional at build time; see available().
+ */
+class Codec
+{
+public:
+	enum Type {
+		None,
+		Zstd,
+		Lz4,
+	};
+
+	static bool available(Type type);
+	static const char* name(Type type);
+	static const char* extension(Type type);
+	static int defaultLevel(Type type);
+	static bool parse(const char* value, Type* type, int* level);
+
+	static bool compress(Type type, int level, const char* data, size_t size, std::string* output);
+};
+
+// {{{ impl
+inline bool Codec::available(Type type)
+{
+	switch (type) {
+	case None:
+		return true;
+	case Zstd:
+#ifdef HAVE_ZSTD
+		return true;
+#else
+		return false;
+#endif
+	case Lz4:
+#ifdef HAVE_LZ4
+		return true;
+#else
+		return false;
+#endif
+	}
+	return false;
+}
+
+inline const char* Codec::name(Type type)
+{
+	switch (type) {
+	case Zstd: return "zstd";
+	case Lz4: return "lz4";
+	default: return "none";
+	}
+}
+
+inline const char* Codec::extension(Type type)
+{
+	switch (type) {
+	case Zstd: return ".zst";
+	case Lz4: return ".lz4";
+	default: return "";
+	}
+}
+
+inline int Codec::defaultLevel(Type type)
+{
+	switch (type) {
+	case Zstd: return 3;
+	default: return 0;
+	}
+}
+
+/**
+ * Parses "NAME" or "NAME:LEVEL", where NAME is one of none, zstd, or lz4.
+ */
+inline bool Codec::parse(const char* value, Type* type, int* level)
+{
+	const char* colon = std::strchr(value, ':');
+	size_t length = colon ? static_cast<size_t>(colon - value) : std::strlen(value);
+
+	if (length == 4 && std::strncmp(value, "none", 4) == 0)
+		*type = None;
+	else if (length == 4 && std::strncmp(value, "zstd", 4) == 0)
+		*type = Zstd;
+	else if (length == 3 && std::strncmp(value, "lz4", 3) == 0)
+		*type = Lz4;
+	else
+		return false;
+
+	*level = colon ? std::atoi(colon + 1) : defaultLevel(*type);
+	return true;
+}
+
+/**
+ * Compresses the data into a single frame (with a content checksum),
+ * replacing the output's contents.
+ */
+inline bool Codec::compress(Type type, int level, const char* data, size_t size, std::string* output)
+{
+	switch (type) {
+	case None:
+		output->assign(data, size);
+		return true;
+	case Zstd: {
+#ifdef HAVE_ZSTD
+		// one context per thread, reused across frames
+		struct Context {
+			ZSTD_CCtx* cctx;
+			Context() : cctx(ZSTD_createCCtx()) {}
+			~Context() { ZSTD_freeCCtx(cctx); }
+		};
+		static thread_local Context context;
+
+		ZSTD_CCtx_reset(context.cctx, ZSTD_reset_session_and_parameters);
+		ZSTD_CCtx_setParameter(context.cctx, ZSTD_c_compressionLevel, level);
+		ZSTD_CCtx_setParameter(context.cctx, ZSTD_c_checksumFlag, 1);
+
+		output->resize(ZSTD_compressBound(size));
+		size_t rv = ZSTD_compress2(context.cctx, &(*output)[0], output->size(), data, size);
+		if (ZSTD_isError(rv)) {
+			output->clear();
+			return false;
+		}
+		output->resize(rv);
+		return true;
+#else
+		return false;
+#endif
+	}
+	case Lz4: {
+#ifdef HAVE_LZ4
+		LZ4F_preferences_t prefs;
+		std::memset(&prefs, 0, sizeof(prefs));
+		prefs.frameInfo.contentSize = size;
+		prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+		prefs.compressionLevel = level;
+
+		output->resize(LZ4F_compressFrameBound(size, &prefs));
+		size_t rv = LZ4F_compressFrame(&(*output)[0], output->size(), data, size, &prefs);
+		if (LZ4F_isError(rv)) {
+			output->clear();
+			return false;
+		}
+		output->resize(rv);
+		return true;
+#else
+		return false;
+#endif
+	}
+	}
+	return false;
+}
+// }}}
+
+} // namespace x0
+
+#endif
@@ -0,0 +1,605 @@
+#ifndef sw_x0_ColumnarChunk_h
+#define sw_x0_ColumnarChunk_h (1)
+
+#include "KeyCodec.h"
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#	error "The columnar chunk format is little-endian, and written in host byte order."
+#endif
+
+namespace x0 {
+
+/**
+ * Binary, columnar chunk file format.
+ *
+ *   file    := ColumnarFileHeader block* footer trailer
+ *   block   := ColumnarBlockHeader timestamps keys counts lengths values padding
+ *   footer  := ColumnarFooterMagic
+ *              u32 blockCount, ColumnarBlockEntry[blockCount]
+ *              u32 binaryKeyCount, ColumnarBinaryKey[binaryKeyCount]
+ *              u32 textKeyCount, ColumnarTextKey[textKeyCount], key bytes
+ *   trailer := ColumnarTrailer
+ *
+ * Within a block (one row per bucket):
+ *   timestamps  double[rowCount], each row's first_seen
+ *   keys        KeyBinary: 16 bytes per row (Key128),
+ *               KeyText: u32 offsets[rowCount + 1] into the key bytes that follow,
+ *               padded up to the next multiple of 8 bytes
+ *   counts      u32[rowCount], number of values per row
+ *   lengths     u32[valueCount], length of each value
+ *   values      the value bytes, back to back
+ *   padding     up to the next multiple of 8 bytes
+ *
+ * A block uses binary keys if all of its keys are 32 lower case hex digits,
+ * and text keys otherwise. The footer's key index holds each key once per
+ * block it occurs in, sorted by key and block, so that readers can binary
+ * search it: 32 hex digit keys in binary form, all others as text. The block
+ * entries hold each block's offset and time range. Files without a trailer
+ * (e.g. after a crash) can still be read block by block, from the start.
+ *
+ * Blocks start at multiples of 8 bytes, and each column starts at a multiple
+ * of its element size (relative to the block), so that the columns can be
+ * accessed in place when the file is mapped into memory.
+ */
+enum : uint32_t {
+	ColumnarFileMagic = 0x4c4f434b,   // "KCOL"
+	ColumnarBlockMagic = 0x4b4c424b,  // "KBLK"
+	ColumnarFooterMagic = 0x5854464b, // "KFTX"
+	ColumnarTrailerMagic = 0x444e454b // "KEND"
+};
+
+struct ColumnarFileHeader
+{
+	enum : uint32_t { CurrentVersion = 1 };
+
+	uint32_t magic;
+	uint32_t version;
+};
+
+struct ColumnarBlockHeader
+{
+	enum : uint32_t { KeyBinary = 0, KeyText = 1 };
+
+	uint32_t magic;
+	uint32_t rowCount;
+	uint32_t keyEncoding;
+	uint32_t valueCount;
+	uint64_t size;        // of the whole block, including this header and padding
+	double minTime;
+	double maxTime;
+};
+
+struct ColumnarBlockEntry
+{
+	uint64_t offset;
+	uint64_t size;
+	uint32_t rowCount;
+	uint32_t reserved;
+	double minTime;
+	double maxTime;
+};
+
+struct ColumnarBinaryKey
+{
+	uint8_t key[16];
+	uint32_t block;       // index into the block entries
+};
+
+struct ColumnarTextKey
+{
+	uint32_t offset;      // into the footer's key bytes
+	uint32_t length;
+	uint32_t block;
+};
+
+struct ColumnarTrailer
+{
+	uint64_t footerOffset;
+	uint32_t footerSize;
+	uint32_t magic;
+};
+
+/**
+ * Accumulates rows, and serializes them into a block.
+ */
+class ColumnarBlockBuilder
+{
+private:
+	std::vector<double> times_;
+	std::vector<Key128> binaryKeys_;   // per row, valid if the row's text key is empty
+	std::vector<std::string> textKeys_;
+	std::vector<uint32_t> counts_;
+	std::vector<uint32_t> lengths_;
+	std::string values_;
+	bool allBinary_;
+
+public:
+	ColumnarBlockBuilder();
+
+	size_t rowCount() const { return times_.size(); }
+	size_t byteSize() const { return values_.size() + lengths_.size() * 4 + times_.size() * 28; }
+	bool empty() const { return times_.empty(); }
+
+	void add(double time, const Key128* binaryKey, const char* key, size_t keySize);
+	void addValue(const char* value, size_t size);
+
+	void build(std::string* output, ColumnarBlockHeader* header) const;
+	template<typename Callback> void forEachKey(Callback callback) const;
+	void clear();
+};
+
+/**
+ * Block entries and key index of a chunk file, i.e. its footer.
+ */
+class ColumnarIndex
+{
+private:
+	std::vector<ColumnarBlockEntry> blocks_;
+	std::vector<ColumnarBinaryKey> binaryKeys_;
+	std::vector<std::pair<std::string, uint32_t>> textKeys_;
+
+public:
+	ColumnarIndex() : blocks_(), binaryKeys_(), textKeys_() {}
+
+	const std::vector<ColumnarBlockEntry>& blocks() const { return blocks_; }
+	size_t keyCount() const { return binaryKeys_.size() + textKeys_.size(); }
+
+	void addBlock(uint64_t offset, const ColumnarBlockHeader& header, const ColumnarBlockBuilder& rows);
+	bool addBlock(uint64_t offset, const char* block, size_t size);
+	void serialize(std::string* output);
+	bool parse(const char* data, size_t size, uint64_t footerOffset);
+	void clear();
+
+	std::vector<uint32_t> findBlocks(const std::string& key, bool prefix) const;
+};
+
+/**
+ * Read access to a serialized block.
+ */
+class ColumnarBlockReader
+{
+private:
+	const ColumnarBlockHeader* header_;
+	const double* times_;
+	const uint8_t* binaryKeys_;
+	const uint32_t* keyOffsets_;
+	const char* keyBytes_;
+	const uint32_t* counts_;
+	const uint32_t* lengths_;
+	const char* values_;
+
+public:
+	ColumnarBlockReader() : header_(nullptr) {}
+
+	bool parse(const char* data, size_t size);
+
+	const ColumnarBlockHeader& header() const { return *header_; }
+	size_t rowCount() const { return header_->rowCount; }
+	bool binaryKeys() const { return header_->keyEncoding == ColumnarBlockHeader::KeyBinary; }
+
+	double time(size_t row) const { return times_[row]; }
+	std::string key(size_t row) const;
+	const uint32_t* counts() const { return counts_; }
+	const uint32_t* lengths() const { return lengths_; }
+	const char* values() const { return values_; }
+};
+
+// {{{ impl
+inline ColumnarBlockBuilder::ColumnarBlockBuilder() :
+	times_(),
+	binaryKeys_(),
+	textKeys_(),
+	counts_(),
+	lengths_(),
+	values_(),
+	allBinary_(true)
+{
+}
+
+/**
+ * Starts a new row, with either a binary or a text key.
+ */
+inline void ColumnarBlockBuilder::add(double time, const Key128* binaryKey, const char* key, size_t keySize)
+{
+	times_.push_back(time);
+	counts_.push_back(0);
+
+	if (binaryKey) {
+		binaryKeys_.push_back(*binaryKey);
+		textKeys_.push_back(std::string());
+	} else {
+		binaryKeys_.push_back(Key128());
+		textKeys_.push_back(std::string(key, keySize));
+		allBinary_ = false;
+	}
+}
+
+// appends a value to the current row
+inline void ColumnarBlockBuilder::addValue(const char* value, size_t size)
+{
+	++counts_.back();
+	lengths_.push_back(size);
+	values_.append(value, size);
+}
+
+inline void ColumnarBlockBuilder::build(std::string* output, ColumnarBlockHeader* header) const
+{
+	const size_t rows = times_.size();
+
+	header->magic = ColumnarBlockMagic;
+	header->rowCount = rows;
+	header->keyEncoding = allBinary_ ? ColumnarBlockHeader::KeyBinary : ColumnarBlockHeader::KeyText;
+	header->valueCount = lengths_.size();
+	header->size = 0;
+	header->minTime = rows ? *std::min_element(times_.begin(), times_.end()) : 0;
+	header->maxTime = rows ? *std::max_element(times_.begin(), times_.end()) : 0;
+
+	output->clear();
+	output->append(reinterpret_cast<const char*>(header), sizeof(*header));
+	output->append(reinterpret_cast<const char*>(times_.data()), rows * sizeof(double));
+
+	if (allBinary_) {
+		output->append(reinterpret_cast<const char*>(binaryKeys_.data()), rows * sizeof(Key128));
+	} else {
+		std::vector<uint32_t> offsets(rows + 1);
+		std::string bytes;
+
+		for (size_t i = 0; i < rows; ++i) {
+			offsets[i] = bytes.size();
+			bytes += textKeys_[i].empty() ? KeyCodec<Key128>::encode(binaryKeys_[i]) : textKeys_[i];
+		}
+		offsets[rows] = bytes.size();
+
+		output->append(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint32_t));
+		output->append(bytes);
+		output->append((8 - output->size() % 8) % 8, '\0'); // realigns the u32 columns that follow
+	}
+
+	output->append(reinterpret_cast<const char*>(counts_.data()), rows * sizeof(uint32_t));
+	output->append(reinterpret_cast<const char*>(lengths_.data()), lengths_.size() * sizeof(uint32_t));
+	output->append(values_);
+	output->append((8 - output->size() % 8) % 8, '\0');
+
+	header->size = output->size();
+	std::memcpy(&(*output)[0], header, sizeof(*header));
+}
+
+/**
+ * Invokes callback(const Key128* binaryKey, const std::string& textKey) for
+ * each row, in the form its key will be indexed by.
+ */
+template<typename Callback>
+inline void ColumnarBlockBuilder::forEachKey(Callback callback) const
+{
+	for (size_t i = 0; i < times_.size(); ++i) {
+		if (textKeys_[i].empty())
+			callback(&binaryKeys_[i], textKeys_[i]);
+		else
+			callback(nullptr, textKeys_[i]);
+	}
+}
+
+inline void ColumnarBlockBuilder::clear()
+{
+	times_.clear();
+	binaryKeys_.clear();
+	textKeys_.clear();
+	counts_.clear();
+	lengths_.clear();
+	values_.clear();
+	allBinary_ = true;
+}
+
+/**
+ * Adds a block just written at the given file offset, along with its keys.
+ */
+inline void ColumnarIndex::addBlock(uint64_t offset, const ColumnarBlockHeader& header, const ColumnarBlockBuilder& rows)
+{
+	const uint32_t block = blocks_.size();
+
+	ColumnarBlockEntry entry;
+	entry.offset = offset;
+	entry.size = header.size;
+	entry.rowCount = header.rowCount;
+	entry.reserved = 0;
+	entry.minTime = header.minTime;
+	entry.maxTime = header.maxTime;
+	blocks_.push_back(entry);
+
+	rows.forEachKey([&](const Key128* binaryKey, const std::string& textKey) {
+		if (binaryKey) {
+			ColumnarBinaryKey key;
+			std::memcpy(key.key, binaryKey->bytes, sizeof(key.key));
+			key.block = block;
+			binaryKeys_.push_back(key);
+		} else {
+			textKeys_.push_back(std::make_pair(textKey, block));
+		}
+	});
+}
+
+/**
+ * Adds a block read back from a file, e.g. one without footer.
+ */
+inline bool ColumnarIndex::addBlock(uint64_t offset, const char* data, size_t size)
+{
+	ColumnarBlockReader reader;
+	if (!reader.parse(data, size))
+		return false;
+
+	const uint32_t block = blocks_.size();
+	const ColumnarBlockHeader& header = reader.header();
+
+	ColumnarBlockEntry entry;
+	entry.offset = offset;
+	entry.size = header.size;
+	entry.rowCount = header.rowCount;
+	entry.reserved = 0;
+	entry.minTime = header.minTime;
+	entry.maxTime = header.maxTime;
+	blocks_.push_back(entry);
+
+	for (size_t i = 0; i < reader.rowCount(); ++i) {
+		std::string text = reader.key(i);
+		Key128 binary;
+
+		if (KeyCodec<Key128>::decode(text.data(), text.size(), &binary)) {
+			ColumnarBinaryKey key;
+			std::memcpy(key.key, binary.bytes, sizeof(key.key));
+			key.block = block;
+			binaryKeys_.push_back(key);
+		} else {
+			textKeys_.push_back(std::make_pair(text, block));
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Serializes the footer, including the trailer (whose footerOffset is left
+ * for the caller to fill in, at the end of the output), sorting the key index.
+ */
+inline void ColumnarIndex::serialize(std::string* output)
+{
+	std::sort(binaryKeys_.begin(), binaryKeys_.end(), [](const ColumnarBinaryKey& a, const ColumnarBinaryKey& b) {
+		int rv = std::memcmp(a.key, b.key, sizeof(a.key));
+		return rv < 0 || (rv == 0 && a.block < b.block);
+	});
+	binaryKeys_.erase(std::unique(binaryKeys_.begin(), binaryKeys_.end(), [](const ColumnarBinaryKey& a, const ColumnarBinaryKey& b) {
+		return a.block == b.block && std::memcmp(a.key, b.key, sizeof(a.key)) == 0;
+	}), binaryKeys_.end());
+
+	std::sort(textKeys_.begin(), textKeys_.end());
+	textKeys_.erase(std::unique(textKeys_.begin(), textKeys_.end()), textKeys_.end());
+
+	auto append32 = [output](uint32_t value) {
+		output->append(reinterpret_cast<const char*>(&value), sizeof(value));
+	};
+
+	output->clear();
+	append32(ColumnarFooterMagic);
+
+	append32(blocks_.size());
+	output->append(reinterpret_cast<const char*>(blocks_.data()), blocks_.size() * sizeof(ColumnarBlockEntry));
+
+	append32(binaryKeys_.size());
+	output->append(reinterpret_cast<const char*>(binaryKeys_.data()), binaryKeys_.size() * sizeof(ColumnarBinaryKey));
+
+	append32(textKeys_.size());
+	uint32_t offset = 0;
+	for (const auto& i: textKeys_) {
+		ColumnarTextKey key;
+		key.offset = offset;
+		key.length = i.first.size();
+		key.block = i.second;
+		output->append(reinterpret_cast<const char*>(&key), sizeof(key));
+		offset += key.length;
+	}
+	for (const auto& i: textKeys_)
+		output->append(i.first);
+
+	ColumnarTrailer trailer;
+	trailer.footerOffset = 0;
+	trailer.footerSize = output->size();
+	trailer.magic = ColumnarTrailerMagic;
+	output->append(reinterpret_cast<const char*>(&trailer), sizeof(trailer));
+}
+
+/**
+ * Loads a footer (without trailer), as serialized by serialize(), which
+ * starts at @p footerOffset of its file.
+ *
+ * Fails unless all blocks lie in between the file header and the footer,
+ * and all keys refer to one of them.
+ */
+inline bool ColumnarIndex::parse(const char* data, size_t size, uint64_t footerOffset)
+{
+	const char* end = data + size;
+	uint32_t count;
+
+	clear();
+
+	auto read = [&](void* value, size_t n) {
+		if (static_cast<size_t>(end - data) < n)
+			return false;
+		std::memcpy(value, data, n);
+		data += n;
+		return true;
+	};
+
+	if (!read(&count, sizeof(count)) || count != ColumnarFooterMagic)
+		return false;
+
+	if (!read(&count, sizeof(count)) || count > size / sizeof(ColumnarBlockEntry))
+		return false;
+	blocks_.resize(count);
+	if (!read(blocks_.data(), count * sizeof(ColumnarBlockEntry)))
+		return false;
+
+	for (const auto& block: blocks_) {
+		if (block.offset < sizeof(ColumnarFileHeader) || block.offset % 8 || block.offset > footerOffset
+				|| block.size < sizeof(ColumnarBlockHeader) || block.size > footerOffset - block.offset)
+			return false;
+	}
+
+	if (!read(&count, sizeof(count)) || count > size / sizeof(ColumnarBinaryKey))
+		return false;
+	binaryKeys_.resize(count);
+	if (!read(binaryKeys_.data(), count * sizeof(ColumnarBinaryKey)))
+		return false;
+
+	for (const auto& key: binaryKeys_)
+		if (key.block >= blocks_.size())
+			return false;
+
+	if (!read(&count, sizeof(count)) || count > size / sizeof(ColumnarTextKey))
+		return false;
+	std::vector<ColumnarTextKey> keys(count);
+	if (!read(keys.data(), count * sizeof(ColumnarTextKey)))
+		return false;
+
+	for (const auto& key: keys) {
+		if (key.offset > static_cast<size_t>(end - data) || key.length > static_cast<size_t>(end - data) - key.offset
+				|| key.block >= blocks_.size())
+			return false;
+		textKeys_.push_back(std::make_pair(std::string(data + key.offset, key.length), key.block));
+	}
+
+	return true;
+}
+
+inline void ColumnarIndex::clear()
+{
+	blocks_.clear();
+	binaryKeys_.clear();
+	textKeys_.clear();
+}
+
+/**
+ * Retrieves the sorted indices of the blocks holding the given key, or, if
+ * @p prefix is set, any key starting with it.
+ *
+ * Requires a sorted index, i.e. one loaded by parse() or after serialize().
+ */
+inline std::vector<uint32_t> ColumnarIndex::findBlocks(const std::string& key, bool prefix) const
+{
+	std::vector<uint32_t> result;
+
+	auto less = [](const ColumnarBinaryKey& a, const Key128& b) {
+		return std::memcmp(a.key, b.bytes, sizeof(a.key)) < 0;
+	};
+
+	// binary keys, within [key000..., keyfff...] for a prefix
+	Key128 first, last;
+	std::string low = key, high = key;
+	if (prefix && key.size() < KeyCodec<Key128>::TextSize) {
+		low.append(KeyCodec<Key128>::TextSize - key.size(), '0');
+		high.append(KeyCodec<Key128>::TextSize - key.size(), 'f');
+	}
+
+	if (KeyCodec<Key128>::decode(low.data(), low.size(), &first) && KeyCodec<Key128>::decode(high.data(), high.size(), &last)) {
+		auto i = std::lower_bound(binaryKeys_.begin(), binaryKeys_.end(), first, less);
+		for (; i != binaryKeys_.end() && std::memcmp(i->key, last.bytes, sizeof(i->key)) <= 0; ++i)
+			result.push_back(i->block);
+	}
+
+	// text keys
+	auto i = std::lower_bound(textKeys_.begin(), textKeys_.end(), std::make_pair(key, uint32_t(0)));
+	for (; i != textKeys_.end(); ++i) {
+		if (prefix ? i->first.compare(0, key.size(), key) != 0 : i->first != key)
+			break;
+		result.push_back(i->second);
+	}
+
+	std::sort(result.begin(), result.end());
+	result.erase(std::unique(result.begin(), result.end()), result.end());
+
+	return result;
+}
+
+/**
+ * Validates the block at @p data, of at most @p size bytes.
+ */
+inline bool ColumnarBlockReader::parse(const char* data, size_t size)
+{
+	if (size < sizeof(ColumnarBlockHeader) || reinterpret_cast<uintptr_t>(data) % 8)
+		return false;
+
+	const ColumnarBlockHeader* header = reinterpret_cast<const ColumnarBlockHeader*>(data);
+	if (header->magic != ColumnarBlockMagic || header->size > size || header->size < sizeof(*header))
+		return false;
+
+	const char* p = data + sizeof(*header);
+	const char* end = data + header->size;
+	const size_t rows = header->rowCount;
+
+	auto take = [&](size_t n) -> const char* {
+		if (static_cast<size_t>(end - p) < n)
+			return nullptr;
+		const char* result = p;
+		p += n;
+		return result;
+	};
+
+	if (rows > header->size || !(times_ = reinterpret_cast<const double*>(take(rows * sizeof(double)))))
+		return false;
+
+	if (header->keyEncoding == ColumnarBlockHeader::KeyBinary) {
+		if (!(binaryKeys_ = reinterpret_cast<const uint8_t*>(take(rows * sizeof(Key128)))))
+			return false;
+	} else if (header->keyEncoding == ColumnarBlockHeader::KeyText) {
+		if (!(keyOffsets_ = reinterpret_cast<const uint32_t*>(take((rows + 1) * sizeof(uint32_t)))))
+			return false;
+		for (size_t i = 0; i < rows; ++i)
+			if (keyOffsets_[i] > keyOffsets_[i + 1])
+				return false;
+		if (!(keyBytes_ = take(keyOffsets_[rows])) || !take((8 - (p - data) % 8) % 8))
+			return false;
+	} else {
+		return false;
+	}
+
+	if (!(counts_ = reinterpret_cast<const uint32_t*>(take(rows * sizeof(uint32_t)))))
+		return false;
+
+	if (header->valueCount > header->size || !(lengths_ = reinterpret_cast<const uint32_t*>(take(header->valueCount * sizeof(uint32_t)))))
+		return false;
+
+	uint64_t valueCount = 0;
+	for (size_t i = 0; i < rows; ++i)
+		valueCount += counts_[i];
+
+	uint64_t valueBytes = 0;
+	for (size_t i = 0; i < header->valueCount; ++i)
+		valueBytes += lengths_[i];
+
+	if (valueCount != header->valueCount || valueBytes > static_cast<size_t>(end - p))
+		return false;
+
+	values_ = p;
+	header_ = header;
+	return true;
+}
+
+inline std::string ColumnarBlockReader::key(size_t row) const
+{
+	if (binaryKeys()) {
+		Key128 key;
+		std::memcpy(key.bytes, binaryKeys_ + row * sizeof(Key128), sizeof(key.bytes));
+		return KeyCodec<Key128>::encode(key);
+	}
+
+	return std::string(keyBytes_ + keyOffsets_[row], keyOffsets_[row + 1] - keyOffsets_[row]);
+}
+// }}}
+
+} // namespace x0
+
+#endif
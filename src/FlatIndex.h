@@ -0,0 +1,282 @@
+#ifndef sw_x0_FlatIndex_h
+#define sw_x0_FlatIndex_h (1)
+
+#include "KeyCodec.h"
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#if defined(__SSE2__)
+#	include <emmintrin.h>
+#endif
+
+namespace x0 {
+
+/**
+ * Open-addressing hash index from keys to objects, SwissTable-style.
+ *
+ * Slots are organized in groups of 16, each slot having a control byte
+ * that is either Empty, Deleted, or holds the lower 7 bits of the key's hash.
+ * A lookup compares a whole group of control bytes at once (SSE2), and only
+ * touches the slots whose control byte matches.
+ *
+ * Keys are stored inline in their slot, and hashed and compared by
+ * KeyCodec<Key>. For StringKey that is a pointer to the key's bytes, which
+ * are NOT copied and thus must outlive the entry (e.g. by pointing into the
+ * indexed object itself). Lookups never allocate.
+ */
+template<typename Key, typename T>
+class FlatIndex
+{
+public:
+	typedef KeyCodec<Key> Codec;
+
+private:
+	enum { GroupSize = 16 };
+	enum : int8_t { Empty = -128, Deleted = -2 };
+
+	struct Slot {
+		Key key;
+		T* value;
+	};
+
+	std::unique_ptr<int8_t[]> ctrl_;
+	std::unique_ptr<Slot[]> slots_;
+	size_t capacity_;  // number of slots, a power of 2 (and a multiple of GroupSize)
+	size_t size_;      // number of live entries
+	size_t deleted_;   // number of tombstones
+
+public:
+	FlatIndex();
+
+	size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+	size_t capacity() const { return capacity_; }
+
+	static uint64_t hash(const Key& key) { return Codec::hash(key); }
+
+	T* find(const Key& key) const { return find(key, hash(key)); }
+	T* find(const Key& key, uint64_t hash) const;
+
+	void insert(const Key& key, T* value) { insert(key, hash(key), value); }
+	void insert(const Key& key, uint64_t hash, T* value);
+
+	T* erase(const Key& key) { return erase(key, hash(key)); }
+	T* erase(const Key& key, uint64_t hash);
+
+	void reserve(size_t count);
+	void clear();
+
+	template<typename Callback> void each(Callback callback) const;
+
+private:
+	static int8_t h2(uint64_t hash) { return static_cast<int8_t>(hash & 0x7f); }
+	size_t groupMask() const { return capacity_ / GroupSize - 1; }
+
+	static uint32_t match(const int8_t* group, int8_t value);
+	static uint32_t matchEmpty(const int8_t* group) { return match(group, Empty); }
+	static uint32_t matchFree(const int8_t* group);
+
+	size_t findSlot(const Key& key, uint64_t hash) const;
+	size_t findFree(uint64_t hash) const;
+	void rehash(size_t capacity);
+
+	FlatIndex(const FlatIndex&) = delete;
+	FlatIndex& operator=(const FlatIndex&) = delete;
+};
+
+// {{{ impl
+template<typename Key, typename T>
+inline FlatIndex<Key, T>::FlatIndex() :
+	ctrl_(),
+	slots_(),
+	capacity_(0),
+	size_(0),
+	deleted_(0)
+{
+	rehash(GroupSize);
+}
+
+// bitmask of the group's slots whose control byte equals value
+template<typename Key, typename T>
+inline uint32_t FlatIndex<Key, T>::match(const int8_t* group, int8_t value)
+{
+#if defined(__SSE2__)
+	__m128i ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(value)));
+#else
+	uint32_t mask = 0;
+	for (unsigned i = 0; i < GroupSize; ++i)
+		if (group[i] == value)
+			mask |= 1u << i;
+	return mask;
+#endif
+}
+
+// bitmask of the group's slots being either empty or deleted
+template<typename Key, typename T>
+inline uint32_t FlatIndex<Key, T>::matchFree(const int8_t* group)
+{
+#if defined(__SSE2__)
+	// both Empty and Deleted have the sign bit set, full slots don't
+	__m128i ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+	return _mm_movemask_epi8(ctrl);
+#else
+	uint32_t mask = 0;
+	for (unsigned i = 0; i < GroupSize; ++i)
+		if (group[i] < 0)
+			mask |= 1u << i;
+	return mask;
+#endif
+}
+
+// index of the slot holding the given key, or capacity_ if not found
+template<typename Key, typename T>
+inline size_t FlatIndex<Key, T>::findSlot(const Key& key, uint64_t hash) const
+{
+	const size_t mask = groupMask();
+	size_t group = (hash >> 7) & mask;
+
+	for (size_t probe = 1; ; ++probe) {
+		const int8_t* ctrl = &ctrl_[group * GroupSize];
+
+		for (uint32_t bits = match(ctrl, h2(hash)); bits; bits &= bits - 1) {
+			size_t i = group * GroupSize + __builtin_ctz(bits);
+			if (Codec::equals(slots_[i].key, key))
+				return i;
+		}
+
+		if (matchEmpty(ctrl) || probe > mask)
+			return capacity_;
+
+		group = (group + probe) & mask; // triangular probing visits every group once
+	}
+}
+
+// index of the first empty or deleted slot along the key's probe sequence
+template<typename Key, typename T>
+inline size_t FlatIndex<Key, T>::findFree(uint64_t hash) const
+{
+	const size_t mask = groupMask();
+	size_t group = (hash >> 7) & mask;
+
+	for (size_t probe = 1; ; ++probe) {
+		if (uint32_t bits = matchFree(&ctrl_[group * GroupSize]))
+			return group * GroupSize + __builtin_ctz(bits);
+
+		group = (group + probe) & mask;
+	}
+}
+
+template<typename Key, typename T>
+inline T* FlatIndex<Key, T>::find(const Key& key, uint64_t hash) const
+{
+	size_t i = findSlot(key, hash);
+	return i != capacity_ ? slots_[i].value : nullptr;
+}
+
+/**
+ * Adds a new entry; the key must not be indexed yet.
+ */
+template<typename Key, typename T>
+inline void FlatIndex<Key, T>::insert(const Key& key, uint64_t hash, T* value)
+{
+	// keep the load factor (including tombstones) at or below 7/8
+	if ((size_ + deleted_ + 1) * 8 > capacity_ * 7)
+		rehash(size_ * 2 + 2 > capacity_ ? capacity_ * 2 : capacity_);
+
+	size_t i = findFree(hash);
+	if (ctrl_[i] == Deleted)
+		--deleted_;
+
+	ctrl_[i] = h2(hash);
+	slots_[i].key = key;
+	slots_[i].value = value;
+	++size_;
+}
+
+/**
+ * Removes the entry of the given key.
+ *
+ * @return the value that has been indexed by the key, or NULL if not found.
+ */
+template<typename Key, typename T>
+inline T* FlatIndex<Key, T>::erase(const Key& key, uint64_t hash)
+{
+	size_t i = findSlot(key, hash);
+	if (i == capacity_)
+		return nullptr;
+
+	// If the group still has an empty slot, no probe sequence has ever
+	// continued past it, so the slot can be made empty rather than a tombstone.
+	const int8_t* group = &ctrl_[i & ~size_t(GroupSize - 1)];
+	if (matchEmpty(group)) {
+		ctrl_[i] = Empty;
+	} else {
+		ctrl_[i] = Deleted;
+		++deleted_;
+	}
+
+	--size_;
+	return slots_[i].value;
+}
+
+template<typename Key, typename T>
+inline void FlatIndex<Key, T>::reserve(size_t count)
+{
+	size_t capacity = capacity_;
+	while (count * 8 > capacity * 7)
+		capacity *= 2;
+
+	if (capacity != capacity_)
+		rehash(capacity);
+}
+
+template<typename Key, typename T>
+inline void FlatIndex<Key, T>::clear()
+{
+	std::memset(ctrl_.get(), Empty, capacity_);
+	size_ = 0;
+	deleted_ = 0;
+}
+
+/**
+ * Invokes callback(T*) for every indexed value.
+ *
+ * The index must not be modified while iterating.
+ */
+template<typename Key, typename T>
+template<typename Callback>
+inline void FlatIndex<Key, T>::each(Callback callback) const
+{
+	for (size_t i = 0; i < capacity_; ++i)
+		if (ctrl_[i] >= 0)
+			callback(slots_[i].value);
+}
+
+template<typename Key, typename T>
+inline void FlatIndex<Key, T>::rehash(size_t capacity)
+{
+	std::unique_ptr<int8_t[]> ctrl(std::move(ctrl_));
+	std::unique_ptr<Slot[]> slots(std::move(slots_));
+	size_t oldCapacity = capacity_;
+
+	ctrl_.reset(new int8_t[capacity]);
+	slots_.reset(new Slot[capacity]);
+	capacity_ = capacity;
+	clear();
+
+	for (size_t i = 0; i < oldCapacity; ++i) {
+		if (ctrl[i] >= 0) {
+			size_t k = findFree(hash(slots[i].key));
+			ctrl_[k] = ctrl[i];
+			slots_[k] = slots[i];
+			++size_;
+		}
+	}
+}
+// }}}
+
+} // namespace x0
+
+#endif
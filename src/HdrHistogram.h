@@ -0,0 +1,153 @@
+#ifndef sw_x0_HdrHistogram_h
+#define sw_x0_HdrHistogram_h (1)
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+namespace x0 {
+
+/**
+ * High dynamic range histogram of unsigned integer samples.
+ *
+ * Values below 2^(SubBits+1) get a bin each. Above, each power of 2 is split
+ * into 2^SubBits linear bins, so every value is counted within 1/2^SubBits
+ * (about 3%) of its actual value, across the whole 64-bit range.
+ *
+ * Samples are recorded by a single thread (the owner), without any atomic
+ * read-modify-write operations. Any other thread may read the histogram,
+ * or merge it into a histogram of its own, without locking, e.g. to combine
+ * the histograms of several threads for stats output.
+ */
+class HdrHistogram
+{
+private:
+	enum { SubBits = 5 };
+	enum { SubCount = 1 << SubBits };
+	enum { BinCount = (64 - SubBits + 1) * SubCount };
+
+	std::atomic<uint64_t> bins_[BinCount];
+	std::atomic<uint64_t> count_;
+	std::atomic<uint64_t> sum_;
+	std::atomic<uint64_t> max_;
+
+public:
+	HdrHistogram();
+
+	void record(uint64_t value);
+	void merge(const HdrHistogram& other);
+
+	uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+	uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+	uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+	double mean() const { return count() ? static_cast<double>(sum()) / count() : 0.0; }
+
+	uint64_t percentile(double p) const;
+
+private:
+	static unsigned binOf(uint64_t value);
+	static uint64_t upperBound(unsigned bin);
+
+	// single writer, so a plain load and store does
+	static void add(std::atomic<uint64_t>& counter, uint64_t n) {
+		counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	HdrHistogram(const HdrHistogram&) = delete;
+	HdrHistogram& operator=(const HdrHistogram&) = delete;
+};
+
+// {{{ impl
+inline HdrHistogram::HdrHistogram() :
+	count_(0),
+	sum_(0),
+	max_(0)
+{
+	for (auto& bin: bins_)
+		bin.store(0, std::memory_order_relaxed);
+}
+
+inline unsigned HdrHistogram::binOf(uint64_t value)
+{
+	if (value < 2 * SubCount)
+		return value;
+
+	unsigned shift = 63 - __builtin_clzll(value) - SubBits; // >= 1
+	return shift * SubCount + (value >> shift);             // (value >> shift) is within [SubCount, 2 * SubCount)
+}
+
+// the largest value counted in the given bin
+inline uint64_t HdrHistogram::upperBound(unsigned bin)
+{
+	if (bin < 2 * SubCount)
+		return bin;
+
+	unsigned shift = bin / SubCount - 1;
+	uint64_t sub = bin % SubCount + SubCount;
+	return ((sub + 1) << shift) - 1;
+}
+
+/**
+ * Records a sample (owner thread only).
+ */
+inline void HdrHistogram::record(uint64_t value)
+{
+	add(bins_[binOf(value)], 1);
+	add(sum_, value);
+
+	if (value > max_.load(std::memory_order_relaxed))
+		max_.store(value, std::memory_order_relaxed);
+
+	// last, so that readers see no more samples than are binned
+	count_.store(count_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+/**
+ * Adds the samples of another histogram, which may be recorded to
+ * concurrently, to this one (which must not).
+ */
+inline void HdrHistogram::merge(const HdrHistogram& other)
+{
+	uint64_t count = other.count_.load(std::memory_order_acquire);
+
+	for (unsigned i = 0; i < BinCount; ++i)
+		if (uint64_t n = other.bins_[i].load(std::memory_order_relaxed))
+			add(bins_[i], n);
+
+	add(sum_, other.sum());
+	add(count_, count);
+
+	if (other.max() > max())
+		max_.store(other.max(), std::memory_order_relaxed);
+}
+
+/**
+ * Retrieves the upper bound of the bin holding the p-th percentile (0..100)
+ * of all samples, capped at the largest sample.
+ */
+inline uint64_t HdrHistogram::percentile(double p) const
+{
+	uint64_t total = count();
+	if (!total)
+		return 0;
+
+	uint64_t rank = static_cast<uint64_t>(total * p / 100.0);
+	if (rank >= total)
+		rank = total - 1;
+
+	uint64_t seen = 0;
+	for (unsigned i = 0; i < BinCount; ++i) {
+		seen += bins_[i].load(std::memory_order_relaxed);
+		if (seen > rank) {
+			uint64_t upper = upperBound(i);
+			return upper < max() ? upper : max();
+		}
+	}
+
+	return max();
+}
+// }}}
+
+} // namespace x0
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef sw_x0_Histogram_h
+#define sw_x0_Histogram_h (1)
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+namespace x0 {
+
+/**
+ * Histogram of unsigned integer samples, in power-of-2 bins.
+ *
+ * Bin 0 counts zeros, and bin i the values in [2^(i-1), 2^i). Samples may be
+ * recorded from any thread, and read concurrently (e.g. for stats output),
+ * without locking. Percentiles are thus accurate to a factor of 2.
+ */
+class Histogram
+{
+private:
+	enum { BinCount = 65 };
+
+	std::atomic<uint64_t> bins_[BinCount];
+	std::atomic<uint64_t> count_;
+	std::atomic<uint64_t> sum_;
+	std::atomic<uint64_t> max_;
+
+public:
+	Histogram();
+
+	void record(uint64_t value);
+
+	uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+	uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+	uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+	double mean() const { return count() ? static_cast<double>(sum()) / count() : 0.0; }
+
+	uint64_t percentile(double p) const;
+
+private:
+	static unsigned binOf(uint64_t value) { return value ? 64 - __builtin_clzll(value) : 0; }
+};
+
+// {{{ impl
+inline Histogram::Histogram() :
+	count_(0),
+	sum_(0),
+	max_(0)
+{
+	for (auto& bin: bins_)
+		bin.store(0, std::memory_order_relaxed);
+}
+
+inline void Histogram::record(uint64_t value)
+{
+	bins_[binOf(value)].fetch_add(1, std::memory_order_relaxed);
+	count_.fetch_add(1, std::memory_order_relaxed);
+	sum_.fetch_add(value, std::memory_order_relaxed);
+
+	uint64_t max = max_.load(std::memory_order_relaxed);
+	while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed))
+		;
+}
+
+/**
+ * Retrieves the upper bound of the bin holding the p-th percentile (0..100)
+ * of all samples, capped at the largest sample.
+ */
+inline uint64_t Histogram::percentile(double p) const
+{
+	uint64_t total = count();
+	if (!total)
+		return 0;
+
+	uint64_t rank = static_cast<uint64_t>(total * p / 100.0);
+	if (rank >= total)
+		rank = total - 1;
+
+	uint64_t seen = 0;
+	for (unsigned i = 0; i < BinCount; ++i) {
+		seen += bins_[i].load(std::memory_order_relaxed);
+		if (seen > rank) {
+			uint64_t upper = i == 0 ? 0 : i == 64 ? ~uint64_t(0) : (uint64_t(1) << i) - 1;
+			return upper < max() ? upper : max();
+		}
+	}
+
+	return max();
+}
+// }}}
+
+} // namespace x0
+
+#endif
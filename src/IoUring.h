@@ -0,0 +1,260 @@
+#ifndef sw_x0_IoUring_h
+#define sw_x0_IoUring_h (1)
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
+
+namespace x0 {
+
+/**
+ * Minimal io_uring instance, on top of the raw system calls.
+ *
+ * SQEs obtained by prepare() are queued up locally and handed to the kernel
+ * with the next submit(). Completions are consumed via reap().
+ *
+ * Not thread safe; meant to be owned by a single thread.
+ */
+class IoUring
+{
+private:
+	int fd_;
+	int error_; // errno of a failed setup
+
+	unsigned entries_;
+	void* sqRing_;
+	size_t sqRingSize_;
+	void* cqRing_;
+	size_t cqRingSize_;
+	io_uring_sqe* sqes_;
+	size_t sqesSize_;
+
+	unsigned* sqHead_;
+	unsigned* sqTail_;
+	unsigned* sqMask_;
+	unsigned* sqArray_;
+	unsigned sqLocalTail_; // including prepared, not yet submitted SQEs
+	unsigned pending_;     // number of prepared, not yet submitted SQEs
+
+	unsigned* cqHead_;
+	unsigned* cqTail_;
+	unsigned* cqMask_;
+	io_uring_cqe* cqes_;
+
+public:
+	explicit IoUring(unsigned entries);
+	~IoUring();
+
+	bool ready() const { return fd_ >= 0; }
+	int error() const { return error_; }
+	unsigned entries() const { return entries_; }
+	unsigned pending() const { return pending_; }
+
+	io_uring_sqe* prepare();
+	int submit(unsigned waitFor = 0);
+	template<typename Callback> unsigned reap(Callback completed);
+
+	int registerFiles(const int* fds, unsigned count);
+	int registerBuffers(const iovec* buffers, unsigned count);
+
+private:
+	void close();
+
+	IoUring(const IoUring&) = delete;
+	IoUring& operator=(const IoUring&) = delete;
+};
+
+// {{{ impl
+inline IoUring::IoUring(unsigned entries) :
+	fd_(-1),
+	error_(0),
+	entries_(0),
+	sqRing_(MAP_FAILED),
+	sqRingSize_(0),
+	cqRing_(MAP_FAILED),
+	cqRingSize_(0),
+	sqes_(static_cast<io_uring_sqe*>(MAP_FAILED)),
+	sqesSize_(0),
+	sqHead_(nullptr),
+	sqTail_(nullptr),
+	sqMask_(nullptr),
+	sqArray_(nullptr),
+	sqLocalTail_(0),
+	pending_(0),
+	cqHead_(nullptr),
+	cqTail_(nullptr),
+	cqMask_(nullptr),
+	cqes_(nullptr)
+{
+	io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+
+	fd_ = syscall(__NR_io_uring_setup, entries, &params);
+	if (fd_ < 0) {
+		error_ = errno;
+		return;
+	}
+
+	entries_ = params.sq_entries;
+	sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cqRingSize_ > sqRingSize_)
+			sqRingSize_ = cqRingSize_;
+		cqRingSize_ = 0;
+	}
+
+	sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+	if (sqRing_ == MAP_FAILED) {
+		error_ = errno;
+		close();
+		return;
+	}
+
+	if (cqRingSize_) {
+		cqRing_ = mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+		if (cqRing_ == MAP_FAILED) {
+			error_ = errno;
+			close();
+			return;
+		}
+	}
+
+	sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+	sqes_ = static_cast<io_uring_sqe*>(mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES));
+	if (sqes_ == MAP_FAILED) {
+		error_ = errno;
+		close();
+		return;
+	}
+
+	char* sq = static_cast<char*>(sqRing_);
+	sqHead_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+	sqTail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+	sqMask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+	sqArray_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+	sqLocalTail_ = *sqTail_;
+
+	char* cq = cqRingSize_ ? static_cast<char*>(cqRing_) : sq;
+	cqHead_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+	cqTail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+	cqMask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+	cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+}
+
+inline IoUring::~IoUring()
+{
+	close();
+}
+
+inline void IoUring::close()
+{
+	if (sqes_ != MAP_FAILED)
+		munmap(sqes_, sqesSize_);
+
+	if (cqRing_ != MAP_FAILED)
+		munmap(cqRing_, cqRingSize_);
+
+	if (sqRing_ != MAP_FAILED)
+		munmap(sqRing_, sqRingSize_);
+
+	sqes_ = static_cast<io_uring_sqe*>(MAP_FAILED);
+	cqRing_ = sqRing_ = MAP_FAILED;
+
+	if (fd_ >= 0) {
+		::close(fd_);
+		fd_ = -1;
+	}
+}
+
+/**
+ * Retrieves the next free SQE, cleared, or NULL if the submission queue is full.
+ */
+inline io_uring_sqe* IoUring::prepare()
+{
+	unsigned head = __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+	if (sqLocalTail_ - head >= entries_)
+		return nullptr;
+
+	unsigned index = sqLocalTail_ & *sqMask_;
+	io_uring_sqe* sqe = &sqes_[index];
+	std::memset(sqe, 0, sizeof(*sqe));
+	sqArray_[index] = index;
+
+	++sqLocalTail_;
+	++pending_;
+
+	return sqe;
+}
+
+/**
+ * Submits all prepared SQEs, and waits for at least @p waitFor completions.
+ *
+ * @return number of SQEs submitted, or -errno on failure.
+ */
+inline int IoUring::submit(unsigned waitFor)
+{
+	__atomic_store_n(sqTail_, sqLocalTail_, __ATOMIC_RELEASE);
+
+	for (;;) {
+		int rv = syscall(__NR_io_uring_enter, fd_, pending_, waitFor,
+			waitFor ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+
+		if (rv >= 0) {
+			pending_ -= rv;
+			return rv;
+		}
+
+		if (errno != EINTR)
+			return -errno;
+	}
+}
+
+/**
+ * Invokes completed(const io_uring_cqe&) for every available completion.
+ *
+ * @return number of completions consumed.
+ */
+template<typename Callback>
+inline unsigned IoUring::reap(Callback completed)
+{
+	unsigned head = *cqHead_;
+	unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+	unsigned count = tail - head;
+
+	for (; head != tail; ++head) {
+		io_uring_cqe cqe = cqes_[head & *cqMask_];
+		__atomic_store_n(cqHead_, head + 1, __ATOMIC_RELEASE);
+		completed(cqe);
+	}
+
+	return count;
+}
+
+/**
+ * Registers a fixed file table; entries of -1 are left empty for
+ * IORING_OP_OPENAT to install direct descriptors into.
+ */
+inline int IoUring::registerFiles(const int* fds, unsigned count)
+{
+	int rv = syscall(__NR_io_uring_register, fd_, IORING_REGISTER_FILES, fds, count);
+	return rv < 0 ? -errno : rv;
+}
+
+inline int IoUring::registerBuffers(const iovec* buffers, unsigned count)
+{
+	int rv = syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS, buffers, count);
+	return rv < 0 ? -errno : rv;
+}
+// }}}
+
+} // namespace x0
+
+#endif
@@ -0,0 +1,215 @@
+#ifndef sw_x0_KeyCodec_h
+#define sw_x0_KeyCodec_h (1)
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#if defined(__SSE2__)
+#	include <emmintrin.h>
+#endif
+
+namespace x0 {
+
+/**
+ * Variable length key, referring to (not owning) its bytes.
+ */
+struct StringKey
+{
+	const char* data;
+	size_t size;
+
+	StringKey() : data(nullptr), size(0) {}
+	StringKey(const char* _data, size_t _size) : data(_data), size(_size) {}
+};
+
+/**
+ * Fixed-width 128-bit key, the binary form of 32 hex digits.
+ *
+ * bytes[0] holds the first two hex digits, and so on.
+ */
+struct Key128
+{
+	uint8_t bytes[16];
+};
+
+/**
+ * Maps the textual form of keys onto a key type, and provides hashing and
+ * comparison of that key type, as required by FlatIndex.
+ *
+ * Specializations must provide:
+ * - static bool decode(const char* text, size_t size, Key* key)
+ * - static std::string encode(const Key& key)
+ * - static uint64_t hash(const Key& key)
+ * - static bool equals(const Key& a, const Key& b)
+ */
+template<typename Key> struct KeyCodec;
+
+// {{{ KeyCodec<StringKey>
+/**
+ * Generic codec for any key, taken as is.
+ */
+template<>
+struct KeyCodec<StringKey>
+{
+	static bool decode(const char* text, size_t size, StringKey* key)
+	{
+		key->data = text;
+		key->size = size;
+		return true;
+	}
+
+	static std::string encode(const StringKey& key)
+	{
+		return std::string(key.data, key.size);
+	}
+
+	// 64-bit hash, consuming the key 8 bytes at a time
+	static uint64_t hash(const StringKey& key)
+	{
+		const uint64_t m = 0x9e3779b97f4a7c15ull;
+		const char* p = key.data;
+		size_t size = key.size;
+		uint64_t h = size * m;
+
+		for (; size >= 8; p += 8, size -= 8) {
+			uint64_t k;
+			std::memcpy(&k, p, 8);
+			h = (h ^ k) * m;
+			h ^= h >> 32;
+		}
+
+		if (size) {
+			uint64_t k = 0;
+			std::memcpy(&k, p, size);
+			h = (h ^ k) * m;
+			h ^= h >> 32;
+		}
+
+		h *= m;
+		return h ^ (h >> 29);
+	}
+
+	static bool equals(const StringKey& a, const StringKey& b)
+	{
+		return a.size == b.size && std::memcmp(a.data, b.data, a.size) == 0;
+	}
+};
+// }}}
+
+// {{{ KeyCodec<Key128>
+/**
+ * Codec for keys of exactly 32 lower-case hex digits.
+ *
+ * Anything else (including upper-case digits, so that the textual form
+ * can always be restored) is rejected by decode().
+ */
+template<>
+struct KeyCodec<Key128>
+{
+	enum { TextSize = 32 };
+
+	static bool decode(const char* text, size_t size, Key128* key)
+	{
+		if (size != TextSize)
+			return false;
+
+#if defined(__SSE2__)
+		__m128i a = decode16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(text)));
+		__m128i b = decode16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(text + 16)));
+
+		// any lane with the sign bit set marks an invalid digit
+		if (_mm_movemask_epi8(_mm_or_si128(a, b)) != 0)
+			return false;
+
+		// (hi << 4) | lo per pair of digits, packed from 16-bit lanes into bytes
+		__m128i packed = _mm_packus_epi16(pair(a), pair(b));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(key->bytes), packed);
+		return true;
+#else
+		for (size_t i = 0; i < 16; ++i) {
+			int hi = nibble(text[i * 2]);
+			int lo = nibble(text[i * 2 + 1]);
+			if (hi < 0 || lo < 0)
+				return false;
+			key->bytes[i] = (hi << 4) | lo;
+		}
+		return true;
+#endif
+	}
+
+	static std::string encode(const Key128& key)
+	{
+		static const char digits[] = "0123456789abcdef";
+		std::string text(TextSize, '\0');
+
+		for (size_t i = 0; i < 16; ++i) {
+			text[i * 2] = digits[key.bytes[i] >> 4];
+			text[i * 2 + 1] = digits[key.bytes[i] & 0x0f];
+		}
+
+		return text;
+	}
+
+	static uint64_t hash(const Key128& key)
+	{
+		const uint64_t m = 0x9e3779b97f4a7c15ull;
+		uint64_t lo, hi;
+		std::memcpy(&lo, key.bytes, 8);
+		std::memcpy(&hi, key.bytes + 8, 8);
+
+		uint64_t h = (lo ^ (hi * m)) * m;
+		return h ^ (h >> 29);
+	}
+
+	static bool equals(const Key128& a, const Key128& b)
+	{
+		uint64_t a0, a1, b0, b1;
+		std::memcpy(&a0, a.bytes, 8);
+		std::memcpy(&a1, a.bytes + 8, 8);
+		std::memcpy(&b0, b.bytes, 8);
+		std::memcpy(&b1, b.bytes + 8, 8);
+		return ((a0 ^ b0) | (a1 ^ b1)) == 0;
+	}
+
+private:
+#if defined(__SSE2__)
+	// maps 16 hex digits to their values 0..15, or 0xff for invalid digits
+	static __m128i decode16(__m128i c)
+	{
+		__m128i digit = _mm_and_si128(
+			_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+			_mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+		__m128i alpha = _mm_and_si128(
+			_mm_cmpgt_epi8(c, _mm_set1_epi8('a' - 1)),
+			_mm_cmplt_epi8(c, _mm_set1_epi8('f' + 1)));
+
+		// c - '0' for digits, c - 'a' + 10 for letters
+		__m128i value = _mm_sub_epi8(
+			_mm_sub_epi8(c, _mm_set1_epi8('0')),
+			_mm_and_si128(alpha, _mm_set1_epi8('a' - '0' - 10)));
+
+		return _mm_or_si128(value, _mm_andnot_si128(_mm_or_si128(digit, alpha), _mm_set1_epi8(-1)));
+	}
+
+	// combines each 16-bit lane (lo byte: high nibble, hi byte: low nibble) into (high << 4) | low
+	static __m128i pair(__m128i v)
+	{
+		__m128i high = _mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0x00ff)), 4);
+		__m128i low = _mm_srli_epi16(v, 8);
+		return _mm_or_si128(high, low);
+	}
+#else
+	static int nibble(char c)
+	{
+		if (c >= '0' && c <= '9') return c - '0';
+		if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+		return -1;
+	}
+#endif
+};
+// }}}
+
+} // namespace x0
+
+#endif
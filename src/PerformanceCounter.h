@@ -1,112 +1,323 @@
 #ifndef sw_x0_PerformanceCounter_h
 #define sw_x0_PerformanceCounter_h
 
-#include <ctime>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <cstddef>
 
 namespace x0 {
 
-template<const unsigned PERIOD = 60, typename T = double>
+/**
+ * Counts events over a sliding window of PERIOD slots of RESOLUTION
+ * milliseconds each, e.g. 60 one-second slots by default.
+ *
+ * Only completed slots are taken into account, the current one is not.
+ * The sum of all of them is kept up to date as slots complete, so reading
+ * the average is O(1), and updating it is O(1) amortized (a gap of idle
+ * slots is at most PERIOD slots to clear).
+ *
+ * Not thread-safe: a single thread updates and reads it. The average only
+ * moves on with update(), so readers update(now, 0) first.
+ */
+template<const unsigned PERIOD = 60, typename T = double, const unsigned RESOLUTION = 1000>
 class PerformanceCounter
 {
 public:
 	typedef T value_type;
 
 private:
-	unsigned long long counter_[PERIOD];
-	time_t last_;
+	unsigned long long counter_[PERIOD]; // completed slots, as a ring
+	unsigned head_;                      // the oldest one, to be replaced next
+	unsigned long long sum_;             // of all completed slots
+	unsigned long long pending_;         // the current slot
+	long long slot_;                     // the current slot's number, since the epoch
 
 public:
 	PerformanceCounter();
 
 	void clear();
-	void update(time_t now, unsigned value = 1);
+	void update(double now, unsigned long long value = 1);
 
 	unsigned long long current() const;
-	value_type average(unsigned n = PERIOD) const;
+	unsigned long long sum() const { return sum_; }
+	value_type average() const;
+
+	// the window length, in seconds
+	static double period() { return PERIOD * RESOLUTION / 1000.0; }
+
+private:
+	void advance(long long slot);
+	void push(unsigned long long value);
+};
+
+/**
+ * Counts events over several sliding windows at once: the last second
+ * (in 100 ms slots), 10 seconds, minute (in one-second slots), and 15
+ * minutes (in 10-second slots).
+ *
+ * Same threading rules as PerformanceCounter.
+ */
+template<typename T = double>
+class MultiWindowCounter
+{
+public:
+	typedef T value_type;
+
+	enum Window { OneSecond, TenSeconds, OneMinute, FifteenMinutes };
+
+private:
+	PerformanceCounter<10, T, 100> oneSecond_;
+	PerformanceCounter<10, T, 1000> tenSeconds_;
+	PerformanceCounter<60, T, 1000> oneMinute_;
+	PerformanceCounter<90, T, 10000> fifteenMinutes_;
+
+public:
+	void clear();
+	void update(double now, unsigned long long value = 1);
+
+	value_type average(Window window = TenSeconds) const;
+};
+
+/**
+ * Running total, sharded by thread: each thread adds to a shard of its own,
+ * on a cache line of its own, with a plain (relaxed) load and store rather
+ * than a read-modify-write. Any thread may read the total, which sums up all
+ * shards.
+ */
+template<typename T = size_t>
+class ShardedCounter
+{
+private:
+	enum { CacheLineSize = 64 };
+
+	struct Shard {
+		std::atomic<T> value;
+		char padding[CacheLineSize - sizeof(std::atomic<T>)];
+	};
+
+	std::unique_ptr<Shard[]> shards_;
+	size_t count_;
+
+public:
+	explicit ShardedCounter(size_t shards = 0);
+
+	void resize(size_t shards);
+	size_t shards() const { return count_; }
+
+	// by the shard's owner only
+	void add(size_t shard, T value) {
+		std::atomic<T>& v = shards_[shard].value;
+		v.store(v.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+	}
+
+	T value(size_t shard) const { return shards_[shard].value.load(std::memory_order_relaxed); }
+	T total() const;
+};
+
+/**
+ * Sharded running total, with its rates over several windows.
+ *
+ * Threads add to their shards, while one thread (the sampler) periodically
+ * feeds what has been added since into the windows, by sample(), and reads
+ * the averages. The more often it samples, the more accurate the one-second
+ * window gets.
+ */
+template<typename T = size_t>
+class ShardedPerformanceCounter
+{
+public:
+	typedef typename MultiWindowCounter<T>::Window Window;
+
+private:
+	ShardedCounter<T> total_;
+	MultiWindowCounter<T> rates_;
+	T last_; // total as of the last sample
+
+public:
+	explicit ShardedPerformanceCounter(size_t shards = 0);
+
+	void resize(size_t shards) { total_.resize(shards); last_ = 0; }
+	size_t shards() const { return total_.shards(); }
+
+	void add(size_t shard, T value) { total_.add(shard, value); }
+	void carry(size_t shard, T value);
+
+	T value(size_t shard) const { return total_.value(shard); }
+	T total() const { return total_.total(); }
+
+	void sample(double now);
+	T average(Window window = MultiWindowCounter<T>::TenSeconds) const { return rates_.average(window); }
 };
 
-// {{{ inlines
-template<const unsigned PERIOD, typename T>
-inline PerformanceCounter<PERIOD, T>::PerformanceCounter()
+// {{{ PerformanceCounter impl
+template<const unsigned PERIOD, typename T, const unsigned RESOLUTION>
+inline PerformanceCounter<PERIOD, T, RESOLUTION>::PerformanceCounter()
 {
 	clear();
 }
 
-template<const unsigned PERIOD, typename T>
-inline void PerformanceCounter<PERIOD, T>::clear()
+template<const unsigned PERIOD, typename T, const unsigned RESOLUTION>
+inline void PerformanceCounter<PERIOD, T, RESOLUTION>::clear()
 {
 	for (auto& i: counter_)
 		i = 0;
 
-	last_ = 0;
-}
-
-template<const unsigned PERIOD, typename T>
-inline void PerformanceCounter<PERIOD, T>::update(time_t now, unsigned value)
-{
-	const size_t i = now % PERIOD;   // offset into counter, for now
-	const size_t diff = now - last_; // seconds difference between now and last
-
-	if (diff == 0) {
-		// same second
-		counter_[i] += value;
-	} else {
-		if (diff < PERIOD) {
-			size_t i0 = last_ % PERIOD; // last offset into counter
-
-			if (i0 < i) {
-				for (size_t k = i0 + 1; k < i; ++k) {
-					counter_[k] = 0;
-				}
-			} else {
-				while (++i0 < PERIOD) {
-					counter_[i0] = 0;
-				}
-
-				for (i0 = 0; i0 < i; ++i0) {
-					counter_[i0] = 0;
-				}
-			}
-		} else {
-			for (auto& k: counter_) {
-				k = 0;
-			}
-		}
-
-		counter_[i] = value;
-		last_ = now;
+	head_ = 0;
+	sum_ = 0;
+	pending_ = 0;
+	slot_ = 0;
+}
+
+template<const unsigned PERIOD, typename T, const unsigned RESOLUTION>
+inline void PerformanceCounter<PERIOD, T, RESOLUTION>::update(double now, unsigned long long value)
+{
+	advance(static_cast<long long>(now * 1000 / RESOLUTION));
+	pending_ += value;
+}
+
+// completes the current slot, and the idle ones up to the given one
+template<const unsigned PERIOD, typename T, const unsigned RESOLUTION>
+inline void PerformanceCounter<PERIOD, T, RESOLUTION>::advance(long long slot)
+{
+	// same slot (or the clock went back), keep counting into it
+	if (slot <= slot_)
+		return;
+
+	push(pending_);
+
+	for (long long idle = std::min<long long>(slot - slot_ - 1, PERIOD); idle > 0; --idle)
+		push(0);
+
+	pending_ = 0;
+	slot_ = slot;
+}
+
+template<const unsigned PERIOD, typename T, const unsigned RESOLUTION>
+inline void PerformanceCounter<PERIOD, T, RESOLUTION>::push(unsigned long long value)
+{
+	sum_ = sum_ - counter_[head_] + value;
+	counter_[head_] = value;
+
+	if (++head_ == PERIOD)
+		head_ = 0;
+}
+
+// the most recently completed slot
+template<const unsigned PERIOD, typename T, const unsigned RESOLUTION>
+inline unsigned long long PerformanceCounter<PERIOD, T, RESOLUTION>::current() const
+{
+	return counter_[head_ ? head_ - 1 : PERIOD - 1];
+}
+
+// per second, over the whole window
+template<const unsigned PERIOD, typename T, const unsigned RESOLUTION>
+inline T PerformanceCounter<PERIOD, T, RESOLUTION>::average() const
+{
+	return static_cast<value_type>(sum_ / period());
+}
+// }}}
+
+// {{{ MultiWindowCounter impl
+template<typename T>
+inline void MultiWindowCounter<T>::clear()
+{
+	oneSecond_.clear();
+	tenSeconds_.clear();
+	oneMinute_.clear();
+	fifteenMinutes_.clear();
+}
+
+template<typename T>
+inline void MultiWindowCounter<T>::update(double now, unsigned long long value)
+{
+	oneSecond_.update(now, value);
+	tenSeconds_.update(now, value);
+	oneMinute_.update(now, value);
+	fifteenMinutes_.update(now, value);
+}
+
+// per second, over the given window
+template<typename T>
+inline T MultiWindowCounter<T>::average(Window window) const
+{
+	switch (window) {
+	case OneSecond:
+		return oneSecond_.average();
+	case TenSeconds:
+		return tenSeconds_.average();
+	case OneMinute:
+		return oneMinute_.average();
+	case FifteenMinutes:
+	default:
+		return fifteenMinutes_.average();
 	}
 }
+// }}}
 
-template<const unsigned PERIOD, typename T>
-inline unsigned long long PerformanceCounter<PERIOD, T>::current() const
+// {{{ ShardedCounter impl
+template<typename T>
+inline ShardedCounter<T>::ShardedCounter(size_t shards) :
+	shards_(),
+	count_(0)
 {
-	size_t prev = (last_ - 1) % PERIOD;
-	if (prev == 0)
-		prev = PERIOD - 1;
+	resize(shards);
+}
 
-	return counter_[prev];
+/**
+ * Starts over with the given number of shards, all zero, which must not be
+ * added to concurrently.
+ */
+template<typename T>
+inline void ShardedCounter<T>::resize(size_t shards)
+{
+	shards_.reset(shards ? new Shard[shards] : nullptr);
+	count_ = shards;
+
+	for (size_t i = 0; i < count_; ++i)
+		shards_[i].value.store(0, std::memory_order_relaxed);
 }
 
-template<const unsigned PERIOD, typename T>
-inline T PerformanceCounter<PERIOD, T>::average(unsigned n) const
+template<typename T>
+inline T ShardedCounter<T>::total() const
 {
-	value_type result = 0;
-	unsigned k = n - 1;
+	T total = 0;
 
-	size_t prev = (last_ - 1) % PERIOD;
-	if (prev == 0)
-		prev = PERIOD - 1;
+	for (size_t i = 0; i < count_; ++i)
+		total += shards_[i].value.load(std::memory_order_relaxed);
 
-	for (size_t i = prev; i > 0 && k > 0; --i, --k)
-		result += counter_[i];
+	return total;
+}
+// }}}
 
-	for (size_t i = PERIOD - 1; k > 0; --k)
-		result += counter_[i];
+// {{{ ShardedPerformanceCounter impl
+template<typename T>
+inline ShardedPerformanceCounter<T>::ShardedPerformanceCounter(size_t shards) :
+	total_(shards),
+	rates_(),
+	last_(0)
+{
+}
 
-	result /= n;
+/**
+ * Adds to the total without it showing in the rates, e.g. a total carried
+ * over from a previous process (from the sampler, while nothing else adds
+ * to the shard).
+ */
+template<typename T>
+inline void ShardedPerformanceCounter<T>::carry(size_t shard, T value)
+{
+	total_.add(shard, value);
+	last_ += value;
+}
 
-	return result;
+// feeds what has been added since the last sample into the rates (sampler only)
+template<typename T>
+inline void ShardedPerformanceCounter<T>::sample(double now)
+{
+	T total = total_.total();
+	rates_.update(now, total - last_);
+	last_ = total;
 }
 // }}}
 
@@ -0,0 +1,270 @@
+#ifndef sw_x0_SpillFile_h
+#define sw_x0_SpillFile_h (1)
+
+#include <atomic>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstdint>
+#include <cstddef>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+namespace x0 {
+
+/**
+ * Append-only scratch file, holding data that does not fit into memory.
+ *
+ * One thread appends to it, any thread may read back what has been appended
+ * and release it once done. The disk space of released extents is given back
+ * (punched out) right away, and once nothing is held any longer, the file
+ * starts over from the beginning.
+ *
+ * The file is unlinked from the start, so it never outlives the process.
+ */
+class SpillFile
+{
+public:
+	struct Extent
+	{
+		uint64_t offset;
+		size_t size;
+	};
+
+private:
+	int fd_;
+	int error_;                 // of the last failed operation
+	uint64_t end_;              // where the next extent gets appended (appending thread only)
+	std::atomic<size_t> held_;  // bytes appended, not released yet
+	std::atomic<size_t> total_; // bytes ever appended
+
+public:
+	SpillFile();
+	~SpillFile();
+
+	bool open(const std::string& directory);
+	bool isOpen() const { return fd_ >= 0; }
+	int error() const { return error_; }
+
+	size_t bytesHeld() const { return held_.load(std::memory_order_relaxed); }
+	size_t bytesSpilled() const { return total_.load(std::memory_order_relaxed); }
+
+	bool append(const iovec* vec, int count, Extent* extent);
+	bool splice(int pipe, size_t size, Extent* extent);
+
+	bool read(const Extent& extent, char* buf) const;
+	ssize_t send(const Extent& extent, int fd) const;
+	void release(const Extent& extent);
+
+private:
+	void rewind();
+
+	SpillFile(const SpillFile&) = delete;
+	SpillFile& operator=(const SpillFile&) = delete;
+};
+
+// {{{ impl
+inline SpillFile::SpillFile() :
+	fd_(-1),
+	error_(0),
+	end_(0),
+	held_(0),
+	total_(0)
+{
+}
+
+inline SpillFile::~SpillFile()
+{
+	if (fd_ >= 0)
+		::close(fd_);
+}
+
+/**
+ * Creates the (anonymous) file within the given directory.
+ */
+inline bool SpillFile::open(const std::string& directory)
+{
+#ifdef O_TMPFILE
+	fd_ = ::open(directory.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd_ >= 0)
+		return true;
+#endif
+
+	// no O_TMPFILE support by the kernel or the file system
+	std::string path = directory + "/.spill.XXXXXX";
+	std::vector<char> name(path.begin(), path.end());
+	name.push_back('\0');
+
+	fd_ = ::mkostemp(name.data(), O_CLOEXEC);
+	if (fd_ < 0) {
+		error_ = errno;
+		return false;
+	}
+
+	::unlink(name.data());
+	return true;
+}
+
+/**
+ * Appends the data of all vectors as a single extent (appending thread only).
+ *
+ * Either all of the data is appended, or none of it.
+ */
+inline bool SpillFile::append(const iovec* vec, int count, Extent* extent)
+{
+	rewind();
+
+	std::vector<iovec> pending(vec, vec + count);
+	size_t i = 0;
+
+	extent->offset = end_;
+	extent->size = 0;
+
+	while (i < pending.size()) {
+		ssize_t rv = ::pwritev(fd_, &pending[i], std::min<size_t>(pending.size() - i, IOV_MAX), end_ + extent->size);
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
+
+			error_ = errno;
+			extent->size = 0;
+			return false;
+		}
+
+		extent->size += rv;
+
+		// skip what has been written
+		size_t n = rv;
+		while (i < pending.size() && n >= pending[i].iov_len) {
+			n -= pending[i].iov_len;
+			++i;
+		}
+
+		if (n) {
+			pending[i].iov_base = static_cast<char*>(pending[i].iov_base) + n;
+			pending[i].iov_len -= n;
+		}
+	}
+
+	end_ += extent->size;
+	held_.fetch_add(extent->size, std::memory_order_relaxed);
+	total_.fetch_add(extent->size, std::memory_order_relaxed);
+	return true;
+}
+
+/**
+ * Moves @p size bytes out of the pipe into a single extent (appending thread only).
+ *
+ * What has been moved before a failure is still appended, and reflected
+ * by the extent's size.
+ */
+inline bool SpillFile::splice(int pipe, size_t size, Extent* extent)
+{
+	rewind();
+
+	extent->offset = end_;
+	extent->size = 0;
+
+	bool complete = true;
+	while (extent->size < size) {
+		loff_t offset = end_ + extent->size;
+		ssize_t rv = ::splice(pipe, nullptr, fd_, &offset, size - extent->size, SPLICE_F_MOVE);
+		if (rv <= 0) {
+			if (rv < 0 && errno == EINTR)
+				continue;
+
+			error_ = rv < 0 ? errno : EIO;
+			complete = false;
+			break;
+		}
+
+		extent->size += rv;
+	}
+
+	end_ += extent->size;
+	held_.fetch_add(extent->size, std::memory_order_relaxed);
+	total_.fetch_add(extent->size, std::memory_order_relaxed);
+	return complete;
+}
+
+/**
+ * Reads the extent's data back into @p buf (any thread).
+ */
+inline bool SpillFile::read(const Extent& extent, char* buf) const
+{
+	size_t done = 0;
+
+	while (done < extent.size) {
+		ssize_t rv = ::pread(fd_, buf + done, extent.size - done, extent.offset + done);
+		if (rv <= 0) {
+			if (rv < 0 && errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		done += rv;
+	}
+
+	return true;
+}
+
+/**
+ * Writes the extent's data to @p fd, at its current file position, without
+ * copying it through userspace (any thread).
+ *
+ * @return the number of bytes written, which falls short of the extent's
+ *         size only on failure.
+ */
+inline ssize_t SpillFile::send(const Extent& extent, int fd) const
+{
+	off_t offset = extent.offset;
+	size_t done = 0;
+
+	while (done < extent.size) {
+		ssize_t rv = ::sendfile(fd, fd_, &offset, extent.size - done);
+		if (rv <= 0) {
+			if (rv < 0 && errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		done += rv;
+	}
+
+	return done;
+}
+
+/**
+ * Gives the extent's disk space back, once its data is not needed anymore (any thread).
+ */
+inline void SpillFile::release(const Extent& extent)
+{
+	if (!extent.size)
+		return;
+
+	// not every file system supports punching holes, the space is reclaimed by rewind() then
+	::fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, extent.offset, extent.size);
+
+	held_.fetch_sub(extent.size, std::memory_order_release);
+}
+
+// starts over from the beginning of the file, if nothing is held any longer
+inline void SpillFile::rewind()
+{
+	if (end_ == 0 || held_.load(std::memory_order_acquire) != 0)
+		return;
+
+	if (::ftruncate(fd_, 0) == 0)
+		end_ = 0;
+}
+// }}}
+
+} // namespace x0
+
+#endif
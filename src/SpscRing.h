@@ -0,0 +1,163 @@
+#ifndef sw_x0_SpscRing_h
+#define sw_x0_SpscRing_h (1)
+
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+namespace x0 {
+
+/**
+ * Lock-free single-producer/single-consumer ring of variable sized records.
+ *
+ * Every record is stored as a 32-bit length prefix followed by its payload
+ * and a terminating NUL byte, padded to 8 bytes. A record that does not fit
+ * into the remaining space up to the end of the ring is preceded by a wrap
+ * marker and stored at offset 0 instead.
+ *
+ * Exactly one thread may call push(), and exactly one (other) thread may call
+ * front() and pop().
+ */
+class SpscRing
+{
+private:
+	enum { Align = 8 };
+	enum { CacheLineSize = 64 };
+	static const uint32_t WrapMarker = ~uint32_t(0);
+
+	size_t capacity_;
+	size_t mask_;
+	std::unique_ptr<char[]> buffer_;
+
+	// consumer side, kept on its own cache line(s)
+	char padding0_[CacheLineSize];
+	std::atomic<size_t> head_;
+	size_t cachedTail_;
+	size_t frontSize_;
+
+	// producer side
+	char padding1_[CacheLineSize];
+	std::atomic<size_t> tail_;
+	size_t cachedHead_;
+	char padding2_[CacheLineSize];
+
+public:
+	explicit SpscRing(size_t capacity);
+
+	size_t capacity() const { return capacity_; }
+	size_t size() const { return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire); }
+	bool empty() const { return size() == 0; }
+
+	// producer
+	bool push(const char* data, size_t size) { return push(nullptr, 0, data, size); }
+	bool push(const char* prefix, size_t prefixSize, const char* data, size_t size);
+
+	// consumer
+	char* front(size_t* size);
+	void pop();
+
+private:
+	static size_t recordSize(size_t payload) { return (sizeof(uint32_t) + payload + 1 + Align - 1) & ~size_t(Align - 1); }
+};
+
+// {{{ impl
+inline SpscRing::SpscRing(size_t capacity) :
+	capacity_(Align * 2),
+	mask_(0),
+	buffer_(),
+	head_(0),
+	cachedTail_(0),
+	frontSize_(0),
+	tail_(0),
+	cachedHead_(0)
+{
+	while (capacity_ < capacity)
+		capacity_ <<= 1;
+
+	mask_ = capacity_ - 1;
+	buffer_.reset(new char[capacity_]);
+}
+
+/**
+ * Appends a copy of the given prefix, followed by the given data, as a new record.
+ *
+ * @retval true  the record has been enqueued.
+ * @retval false the ring is full (or the record is too large to ever fit).
+ */
+inline bool SpscRing::push(const char* prefix, size_t prefixSize, const char* data, size_t size)
+{
+	const size_t need = recordSize(prefixSize + size);
+	if (need > capacity_ / 2)
+		return false;
+
+	size_t tail = tail_.load(std::memory_order_relaxed);
+	size_t offset = tail & mask_;
+	size_t skip = capacity_ - offset < need ? capacity_ - offset : 0;
+
+	if (tail + skip + need - cachedHead_ > capacity_) {
+		cachedHead_ = head_.load(std::memory_order_acquire);
+		if (tail + skip + need - cachedHead_ > capacity_)
+			return false;
+	}
+
+	if (skip) {
+		const uint32_t marker = WrapMarker;
+		std::memcpy(&buffer_[offset], &marker, sizeof(marker));
+		tail += skip;
+		offset = 0;
+	}
+
+	uint32_t length = static_cast<uint32_t>(prefixSize + size);
+	std::memcpy(&buffer_[offset], &length, sizeof(length));
+	if (prefixSize)
+		std::memcpy(&buffer_[offset + sizeof(length)], prefix, prefixSize);
+	std::memcpy(&buffer_[offset + sizeof(length) + prefixSize], data, size);
+	buffer_[offset + sizeof(length) + length] = '\0';
+
+	tail_.store(tail + need, std::memory_order_release);
+	return true;
+}
+
+/**
+ * Retrieves the oldest record, or NULL if the ring is empty.
+ *
+ * The returned payload is NUL-terminated and may be modified in place
+ * by the consumer until pop() is invoked.
+ */
+inline char* SpscRing::front(size_t* size)
+{
+	size_t head = head_.load(std::memory_order_relaxed);
+
+	if (head == cachedTail_) {
+		cachedTail_ = tail_.load(std::memory_order_acquire);
+		if (head == cachedTail_)
+			return nullptr;
+	}
+
+	size_t offset = head & mask_;
+	uint32_t length;
+	std::memcpy(&length, &buffer_[offset], sizeof(length));
+
+	if (length == WrapMarker) {
+		head += capacity_ - offset;
+		head_.store(head, std::memory_order_relaxed);
+		offset = 0;
+		std::memcpy(&length, &buffer_[offset], sizeof(length));
+	}
+
+	frontSize_ = length;
+	*size = length;
+	return &buffer_[offset + sizeof(length)];
+}
+
+inline void SpscRing::pop()
+{
+	head_.store(head_.load(std::memory_order_relaxed) + recordSize(frontSize_), std::memory_order_release);
+}
+// }}}
+
+} // namespace x0
+
+#endif
@@ -0,0 +1,182 @@
+#ifndef sw_x0_TimingWheel_h
+#define sw_x0_TimingWheel_h (1)
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+
+namespace x0 {
+
+/**
+ * Hashed timing wheel, driven by periodic calls to advance().
+ *
+ * Deadlines are quantized into ticks of resolution() seconds, and each
+ * scheduled node lives in the intrusive list of slot (tick % slotCount).
+ * Scheduling and cancelling are O(1). The slot count is chosen so that the
+ * wheel spans the longest expected timeout, which makes every node visited
+ * exactly once, at its deadline's tick; longer deadlines still work, but
+ * their nodes get skipped over once per revolution.
+ *
+ * Users are expected to refresh deadlines lazily: rather than rescheduling
+ * on every activity, check the real deadline when the node expires and
+ * schedule it again if it lies in the future.
+ */
+class TimingWheel
+{
+public:
+	struct Node
+	{
+		Node* prev;
+		Node* next;
+		uint64_t tick;
+
+		Node() : prev(nullptr), next(nullptr), tick(0) {}
+
+		bool scheduled() const { return prev != nullptr; }
+	};
+
+private:
+	double resolution_;
+	uint64_t mask_;
+	uint64_t currentTick_;
+	size_t size_;
+	std::vector<Node> slots_; // list heads
+
+public:
+	TimingWheel(double resolution, double span, double now);
+
+	double resolution() const { return resolution_; }
+	size_t slotCount() const { return slots_.size(); }
+	size_t size() const { return size_; }
+
+	void schedule(Node* node, double deadline);
+	void cancel(Node* node);
+
+	template<typename Callback> void advance(double now, Callback expired);
+
+private:
+	uint64_t tickOf(double time) const { return static_cast<uint64_t>(std::ceil(time / resolution_)); }
+	void link(Node* node);
+	void unlink(Node* node);
+
+	TimingWheel(const TimingWheel&) = delete;
+	TimingWheel& operator=(const TimingWheel&) = delete;
+};
+
+// {{{ impl
+/**
+ * @param resolution tick length in seconds.
+ * @param span       longest timeout (in seconds) expected to be scheduled.
+ * @param now        current time in seconds.
+ */
+inline TimingWheel::TimingWheel(double resolution, double span, double now) :
+	resolution_(resolution),
+	mask_(0),
+	currentTick_(static_cast<uint64_t>(now / resolution)),
+	size_(0),
+	slots_()
+{
+	size_t count = 16;
+	while (count * resolution_ <= span)
+		count <<= 1;
+
+	mask_ = count - 1;
+	slots_.resize(count);
+
+	for (auto& head: slots_)
+		head.prev = head.next = &head;
+}
+
+/**
+ * Schedules the node to expire at the given time, or reschedules it if it
+ * has been scheduled already.
+ *
+ * Deadlines at or before the current tick expire on the next tick.
+ */
+inline void TimingWheel::schedule(Node* node, double deadline)
+{
+	if (node->scheduled())
+		unlink(node);
+
+	uint64_t tick = tickOf(deadline);
+	node->tick = tick > currentTick_ ? tick : currentTick_ + 1;
+	link(node);
+}
+
+inline void TimingWheel::cancel(Node* node)
+{
+	if (node->scheduled())
+		unlink(node);
+}
+
+/**
+ * Moves the wheel forward to the given time, invoking expired(Node*) for
+ * every node whose deadline has been reached.
+ *
+ * The node is unscheduled before the callback is invoked, which may
+ * schedule or cancel any node (including this one) at will.
+ */
+template<typename Callback>
+inline void TimingWheel::advance(double now, Callback expired)
+{
+	const uint64_t target = static_cast<uint64_t>(now / resolution_);
+
+	// no need to spin through more than one revolution
+	if (target > currentTick_ + slots_.size())
+		currentTick_ = target - slots_.size();
+
+	while (currentTick_ < target) {
+		++currentTick_;
+		Node& head = slots_[currentTick_ & mask_];
+
+		// detach the slot's list, as callbacks may schedule into it again
+		Node pending;
+		if (head.next == &head)
+			continue;
+
+		pending.next = head.next;
+		pending.prev = head.prev;
+		pending.next->prev = &pending;
+		pending.prev->next = &pending;
+		head.prev = head.next = &head;
+
+		while (pending.next != &pending) {
+			Node* node = pending.next;
+			pending.next = node->next;
+			node->next->prev = &pending;
+			node->prev = node->next = nullptr;
+
+			if (node->tick > currentTick_) {
+				// due in a later revolution
+				link(node);
+			} else {
+				--size_;
+				expired(node);
+			}
+		}
+	}
+}
+
+inline void TimingWheel::link(Node* node)
+{
+	Node& head = slots_[node->tick & mask_];
+	node->prev = &head;
+	node->next = head.next;
+	head.next->prev = node;
+	head.next = node;
+	++size_;
+}
+
+inline void TimingWheel::unlink(Node* node)
+{
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+	node->prev = node->next = nullptr;
+	--size_;
+}
+// }}}
+
+} // namespace x0
+
+#endif
@@ -0,0 +1,382 @@
+#include "KeyCodec.h"
+#include "FlatIndex.h"
+#include "TimingWheel.h"
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+#include <deque>
+#include <string>
+#include <chrono>
+#include <functional>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <unistd.h>
+#include <ev++.h>
+
+// micro benchmarks of kollektd's building blocks
+
+struct Entry // {{{
+{
+	std::string id;
+	x0::Key128 binaryId;
+
+	explicit Entry(const std::string& _id) : id(_id), binaryId() {
+		x0::KeyCodec<x0::Key128>::decode(id.data(), id.size(), &binaryId);
+	}
+}; // }}}
+
+// a bucket's timers, the way kollektd used to keep them
+struct EvBucket // {{{
+{
+	ev::timer idleTimer;
+	ev::timer ttlTimer;
+	size_t* expired;
+
+	EvBucket(ev::loop_ref loop, size_t* _expired) : idleTimer(loop), ttlTimer(loop), expired(_expired) {
+		idleTimer.set<EvBucket, &EvBucket::timeout>(this);
+		ttlTimer.set<EvBucket, &EvBucket::timeout>(this);
+	}
+
+	void timeout(ev::timer&, int) {
+		idleTimer.stop();
+		ttlTimer.stop();
+		++*expired;
+	}
+}; // }}}
+
+// a bucket's deadlines, as tracked by x0::TimingWheel
+struct WheelBucket : public x0::TimingWheel::Node // {{{
+{
+	double createdAt;
+	double touchedAt;
+}; // }}}
+
+// an entry's key, as put into the index
+static x0::StringKey entryKey(const Entry* entry, x0::StringKey*) { return x0::StringKey(entry->id.data(), entry->id.size()); }
+static x0::Key128 entryKey(const Entry* entry, x0::Key128*) { return entry->binaryId; }
+
+static std::string genkey() // {{{
+{
+	static const char keymap[] = { "1234567890abcdef" };
+	char buf[33];
+
+	for (size_t i = 0; i < sizeof(buf) - 1; ++i)
+		buf[i] = keymap[rand() % 16];
+
+	buf[sizeof(buf) - 1] = '\0';
+	return buf;
+} // }}}
+
+// runs fn() and returns its throughput in million operations per second
+static double measure(size_t operations, const std::function<void()>& fn) // {{{
+{
+	auto start = std::chrono::steady_clock::now();
+	fn();
+	auto end = std::chrono::steady_clock::now();
+
+	double seconds = std::chrono::duration<double>(end - start).count();
+	return operations / seconds / 1e6;
+} // }}}
+
+/**
+ * Measures x0::FlatIndex with the given key type, decoding each datagram's
+ * key with KeyCodec<Key> just like the worker does.
+ */
+template<typename Key>
+static void benchFlatIndex(const char* name, size_t live, const std::vector<Entry*>& entries,
+	const std::vector<std::string>& datagrams, const std::vector<size_t>& victims, size_t* found) // {{{
+{
+	typedef x0::KeyCodec<Key> Codec;
+	const size_t keysize = 32;
+
+	x0::FlatIndex<Key, Entry> index;
+	for (size_t i = 0; i < live; ++i)
+		index.insert(entryKey(entries[i], (Key*) nullptr), entries[i]);
+
+	double lookup = measure(datagrams.size(), [&]() {
+		for (auto& datagram: datagrams) {
+			Key key;
+			if (Codec::decode(datagram.data(), keysize, &key) && index.find(key))
+				++*found;
+		}
+	});
+
+	std::vector<Entry*> slots(entries.begin(), entries.begin() + live);
+	std::deque<Entry*> spare(entries.begin() + live, entries.end());
+	double churn = measure(victims.size(), [&]() {
+		for (size_t victim: victims) {
+			index.erase(entryKey(slots[victim], (Key*) nullptr));
+			spare.push_back(slots[victim]);
+			slots[victim] = spare.front();
+			spare.pop_front();
+			index.insert(entryKey(slots[victim], (Key*) nullptr), slots[victim]);
+		}
+	});
+
+	if (index.size() != live)
+		std::fprintf(stderr, "churn mismatch: %zu of %zu entries indexed\n", index.size(), live);
+
+	std::printf("%10zu  %-14s %12.2f %12.2f\n", live, name, lookup, churn);
+} // }}}
+
+/**
+ * Compares x0::FlatIndex against std::unordered_map<std::string, T*> the way
+ * kollektd's worker uses them: lookups by a raw (not NUL-terminated) key
+ * inside a datagram, and churn (erase + insert) at a constant number of live
+ * entries.
+ */
+static void benchIndex(size_t iterations) // {{{
+{
+	static const size_t sizes[] = { 10000, 100000, 1000000 };
+
+	std::printf("%10s  %-14s %12s %12s\n", "live", "index", "lookup M/s", "churn M/s");
+
+	for (size_t live: sizes) {
+		// twice as many entries as live ones, the others queued up as spare keys for the churn:
+		// each one replacing a live one, which gets queued up in turn, so no key is indexed twice
+		std::vector<Entry*> entries;
+		for (size_t i = 0; i < live * 2; ++i)
+			entries.push_back(new Entry(genkey()));
+
+		// datagrams to look up, "KEY;VALUE", of live keys only
+		std::vector<std::string> datagrams;
+		for (size_t i = 0; i < iterations; ++i)
+			datagrams.push_back(entries[rand() % live]->id + ";value");
+
+		// churn order: which live entry to replace with which fresh one
+		std::vector<size_t> victims;
+		for (size_t i = 0; i < iterations; ++i)
+			victims.push_back(rand() % live);
+
+		const size_t keysize = 32;
+		size_t found = 0;
+
+		{ // std::unordered_map
+			std::unordered_map<std::string, Entry*> index;
+			for (size_t i = 0; i < live; ++i)
+				index[entries[i]->id] = entries[i];
+
+			double lookup = measure(iterations, [&]() {
+				for (auto& datagram: datagrams) {
+					auto i = index.find(std::string(datagram.data(), keysize));
+					if (i != index.end())
+						++found;
+				}
+			});
+
+			std::vector<Entry*> slots(entries.begin(), entries.begin() + live);
+			std::deque<Entry*> spare(entries.begin() + live, entries.end());
+			double churn = measure(iterations, [&]() {
+				for (size_t victim: victims) {
+					index.erase(slots[victim]->id);
+					spare.push_back(slots[victim]);
+					slots[victim] = spare.front();
+					spare.pop_front();
+					index[slots[victim]->id] = slots[victim];
+				}
+			});
+
+			if (index.size() != live)
+				std::fprintf(stderr, "churn mismatch: %zu of %zu entries indexed\n", index.size(), live);
+
+			std::printf("%10zu  %-14s %12.2f %12.2f\n", live, "unordered_map", lookup, churn);
+		}
+
+		benchFlatIndex<x0::StringKey>("FlatIndex/str", live, entries, datagrams, victims, &found);
+		benchFlatIndex<x0::Key128>("FlatIndex/hex", live, entries, datagrams, victims, &found);
+
+		if (found != iterations * 3)
+			std::fprintf(stderr, "lookup mismatch: %zu of %zu keys found\n", found, iterations * 3);
+
+		for (auto entry: entries)
+			delete entry;
+	}
+} // }}}
+
+/**
+ * Compares per-bucket libev timers (an idle timer restarted on every value,
+ * and a TTL timer) against a single x0::TimingWheel per worker with lazily
+ * refreshed deadlines, measuring:
+ *
+ * - arm:    setting up a new bucket's deadlines
+ * - touch:  refreshing the idle deadline of a random bucket, once per value
+ * - cancel: removing a bucket's deadlines, as when flushed due to its size
+ * - expire: firing all buckets' deadlines
+ */
+static void benchTimers(size_t iterations) // {{{
+{
+	static const size_t sizes[] = { 100000, 1000000 };
+	const double idle = 10;
+	const double ttl = 60;
+
+	std::printf("%10s  %-14s %12s %12s %12s %12s\n", "buckets", "timers", "arm M/s", "touch M/s", "cancel M/s", "expire M/s");
+
+	for (size_t live: sizes) {
+		std::vector<size_t> touches;
+		for (size_t i = 0; i < iterations; ++i)
+			touches.push_back(rand() % live);
+
+		ev::dynamic_loop loop;
+		size_t expired = 0;
+
+		{ // libev
+			std::vector<EvBucket*> buckets;
+			for (size_t i = 0; i < live; ++i)
+				buckets.push_back(new EvBucket(loop, &expired));
+
+			double arm = measure(live, [&]() {
+				for (auto bucket: buckets) {
+					bucket->idleTimer.start(idle, 0.0);
+					bucket->ttlTimer.start(ttl, 0.0);
+				}
+			});
+
+			double touch = measure(iterations, [&]() {
+				for (size_t i: touches) {
+					EvBucket* bucket = buckets[i];
+					if (bucket->idleTimer.is_active())
+						bucket->idleTimer.stop();
+					bucket->idleTimer.start(idle, 0.0);
+				}
+			});
+
+			double cancel = measure(live, [&]() {
+				for (auto bucket: buckets) {
+					bucket->idleTimer.stop();
+					bucket->ttlTimer.stop();
+				}
+			});
+
+			// re-arm with deadlines that are all due by the next loop iteration
+			ev_now_update(loop);
+			for (size_t i = 0; i < live; ++i) {
+				buckets[i]->idleTimer.start(0.001 * (i % 10), 0.0);
+				buckets[i]->ttlTimer.start(ttl, 0.0);
+			}
+			usleep(20000);
+
+			double expire = measure(live, [&]() {
+				loop.run(ev::NOWAIT);
+			});
+
+			std::printf("%10zu  %-14s %12.2f %12.2f %12.2f %12.2f\n", live, "libev", arm, touch, cancel, expire);
+
+			for (auto bucket: buckets)
+				delete bucket;
+		}
+
+		{ // x0::TimingWheel
+			ev_now_update(loop);
+			x0::TimingWheel wheel(0.1, ttl, ev_now(loop));
+
+			std::vector<WheelBucket*> buckets;
+			for (size_t i = 0; i < live; ++i)
+				buckets.push_back(new WheelBucket());
+
+			double arm = measure(live, [&]() {
+				for (auto bucket: buckets) {
+					bucket->createdAt = bucket->touchedAt = ev_now(loop);
+					wheel.schedule(bucket, std::min(bucket->touchedAt + idle, bucket->createdAt + ttl));
+				}
+			});
+
+			double touch = measure(iterations, [&]() {
+				for (size_t i: touches)
+					buckets[i]->touchedAt = ev_now(loop);
+			});
+
+			double cancel = measure(live, [&]() {
+				for (auto bucket: buckets)
+					wheel.cancel(bucket);
+			});
+
+			for (auto bucket: buckets)
+				wheel.schedule(bucket, std::min(bucket->touchedAt + idle, bucket->createdAt + ttl));
+
+			// advance past all idle deadlines at once
+			double now = ev_now(loop) + idle + 1;
+			double expire = measure(live, [&]() {
+				wheel.advance(now, [&](x0::TimingWheel::Node* node) {
+					WheelBucket* bucket = static_cast<WheelBucket*>(node);
+					if (now >= bucket->touchedAt + idle || now >= bucket->createdAt + ttl)
+						++expired;
+					else
+						wheel.schedule(bucket, std::min(bucket->touchedAt + idle, bucket->createdAt + ttl));
+				});
+			});
+
+			std::printf("%10zu  %-14s %12.2f %12.2f %12.2f %12.2f\n", live, "TimingWheel", arm, touch, cancel, expire);
+
+			for (auto bucket: buckets)
+				delete bucket;
+		}
+
+		if (expired != live * 2)
+			std::fprintf(stderr, "expiry mismatch: %zu of %zu buckets expired\n", expired, live * 2);
+	}
+} // }}}
+
+int main(int argc, char* argv[])
+{
+	static const struct option long_options[] = {
+		{ "help", no_argument, NULL, 'h' },
+		{ "iterations", required_argument, NULL, 'n' },
+		{ 0, 0, 0, 0 }
+	};
+
+	size_t iterations = 2000000;
+
+	for (bool args_parsed = false; !args_parsed; ) {
+		int long_index = 0;
+		switch (getopt_long(argc, argv, "?hn:", long_options, &long_index)) {
+			case '?':
+			case 'h':
+				printf(
+					"%s [-n NUM] BENCHMARK | [-h]\n"
+					"\n"
+					"  -h, --help               print this help\n"
+					"  -n, --iterations=NUM     number of operations per measurement [%zu]\n"
+					"\n"
+					"  benchmarks:\n"
+					"    index                  bucket index lookup and churn at 10k, 100k and 1M live keys\n"
+					"    timers                 bucket idle/TTL timers, libev vs. timing wheel, at 100k and 1M buckets\n"
+					"\n",
+					argv[0], iterations);
+				return 0;
+			case 'n':
+				iterations = std::atoll(optarg);
+				break;
+			case 0:
+				// long option with (val != NULL && flag == 0)
+				break;
+			case -1:
+				// EOF - everything parsed
+				args_parsed = true;
+				break;
+			default:
+				return 1;
+		}
+	}
+
+	if (optind >= argc) {
+		std::fprintf(stderr, "No benchmark given. See --help.\n");
+		return 1;
+	}
+
+	srandom(time(nullptr));
+
+	for (int i = optind; i < argc; ++i) {
+		if (strcmp(argv[i], "index") == 0) {
+			benchIndex(iterations);
+		} else if (strcmp(argv[i], "timers") == 0) {
+			benchTimers(iterations);
+		} else {
+			std::fprintf(stderr, "Unknown benchmark: %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	return 0;
+}
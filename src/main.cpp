@@ -1,15 +1,36 @@
 #include "PerformanceCounter.h"
 #include "Actor.h"
+#include "SpscRing.h"
+#include "Arena.h"
+#include "KeyCodec.h"
+#include "FlatIndex.h"
+#include "TimingWheel.h"
+#include "Histogram.h"
+#include "HdrHistogram.h"
+#include "IoUring.h"
+#include "Codec.h"
+#include "ColumnarChunk.h"
+#include "ChunkCompaction.h"
+#include "SpillFile.h"
+#include "sd-daemon.h"
 #include <iostream>
-#include <unordered_map>
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <list>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <deque>
+#include <vector>
 #include <string>
 #include <sstream>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <cctype>
+#include <cstdint>
+#include <cerrno>
 #include <climits>
 #include <ctime>
 #include <getopt.h>
@@ -17,8 +38,14 @@
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <ev++.h>
@@ -30,216 +57,1082 @@
 #endif
 
 class Server;
+class Worker;
+class Listener;
+class CompressWriter;
+class Compactor;
 
-class Bucket // {{{
+class Bucket : private x0::TimingWheel::Node // {{{
 {
 private:
-	Server* server_;
-	ev::loop_ref loop_;
-	ev::timer idleTimer_;
-	ev::timer ttlTimer_;
-	std::string id_;
-	int stream_[2];
-	size_t streamSize_;
+	Worker* worker_;
+	ev_tstamp createdAt_;
+	ev_tstamp touchedAt_;   // time of the last push_back(), the idle timeout is relative to
+	bool binary_;           // whether the key is stored as binaryId_ rather than id_
+	x0::Key128 binaryId_;   // 32-hex-digit key, decoded
+	std::string id_;        // any other key, as is
+	uint64_t hash_;         // the key's hash in the worker's bucket index
+	int stream_[2];         // pipe storage
+	x0::ArenaChunk* head_;  // arena storage
+	x0::ArenaChunk* tail_;
+	size_t streamSize_;     // bytes in the pipe or the arena chunks
+	std::vector<x0::SpillFile::Extent> spilled_; // contents moved to the worker's spill file, ahead of the above
+	size_t spilledSize_;
 	size_t itemCount_;
+	size_t queuedSize_;     // bytes handed over to a writer, counted in Server::queuedBytes_ until deleted
+	std::chrono::steady_clock::time_point flushedAt_; // time it has been handed over to a writer
+	Bucket* lruPrev_;       // more recently touched bucket of the same worker
+	Bucket* lruNext_;       // less recently touched bucket of the same worker
 
 	friend class Writer;
+	friend class UringWriter;
+	friend class DirectWriter;
+	friend class CompressWriter;
+	friend class ColumnarWriter;
+	friend class Worker;
+	friend class Server;
 
 public:
-	Bucket(Server* server, const char* id, size_t idsize);
+	Bucket(Worker* worker, const char* id, size_t idsize, const x0::Key128* binaryId = nullptr, ev_tstamp createdAt = 0);
 	~Bucket();
 
-	bool healthy() const { return stream_[0] >= 0; }
+	bool healthy() const { return stream_[0] >= 0 || head_ != nullptr; }
+	size_t size() const { return spilledSize_ + streamSize_; }
 
-	const std::string& id() const { return id_; }
+	std::string id() const;
 	void push_back(const char* value, size_t size);
 
 private:
+	bool append(const char* data, size_t size);
+	bool spill();
 	void flush();
-	void timeoutTTL(ev::timer&, int);
-	void timeoutIdle(ev::timer&, int);
+	ev_tstamp deadline() const;
+	void timeout(ev_tstamp now);
 }; // }}}
 
 class Writer : public x0::Actor<Bucket*> // {{{
 {
-private:
+protected:
 	ev::loop_ref loop_;
 	std::string storagePath_;
+	unsigned shard_;      // this writer's index within the server's writer pool
+	unsigned shardCount_; // number of writers in the pool, each writing its own chunk files
 	int currentChunkId_; // the current (e.g.) hour. re-open the output file once this unit differs to the current (e.g.) hour
 	size_t outputOffset_;
 	int fd_; // handle to the current open output file
+	Compactor* compactor_; // compacts the chunk files this writer is done with, if set
+
+	// group commit
+	enum { MaxVectors = 1024 }; // UIO_MAXIOV
+	size_t groupSize_;          // number of bytes to gather before committing, or 0 to write each bucket as it comes
+	double groupDelay_;         // max. time in seconds a gathered bucket may wait for its group to fill up
+	std::vector<Bucket*> group_;
+	size_t groupBytes_;
+	std::chrono::steady_clock::time_point groupStart_;
+	std::vector<iovec> vectors_;
+	x0::Histogram groupBuckets_; // number of buckets per group
+	x0::Histogram groupLatency_; // microseconds from a group's first bucket until it has been synced
+
+	x0::HdrHistogram dequeueLatency_; // nanoseconds from flushing a bucket until its writer picks it up
+	x0::HdrHistogram spliceDuration_; // nanoseconds to splice a bucket's pipe into the chunk file
 
 public:
-	explicit Writer(ev::loop_ref loop);
+	Writer(ev::loop_ref loop, const std::string& storagePath, unsigned shard, unsigned shardCount);
 	~Writer();
 
 	const std::string storagePath() const { return storagePath_; }
 	void setStoragePath(const std::string& path) { storagePath_ = path; }
+	unsigned shard() const { return shard_; }
+
+	void setGroupCommit(size_t bytes, double delay) { groupSize_ = bytes; groupDelay_ = delay; }
+	bool groupCommit() const { return groupSize_ != 0; }
+	const x0::Histogram& groupBuckets() const { return groupBuckets_; }
+	const x0::Histogram& groupLatency() const { return groupLatency_; }
+	const x0::HdrHistogram& dequeueLatency() const { return dequeueLatency_; }
+	const x0::HdrHistogram& spliceDuration() const { return spliceDuration_; }
+
+	void setCompactor(Compactor* compactor) { compactor_ = compactor; }
+
+	virtual void finish();
+
+	static void readStream(Bucket* bucket, std::string* output);
+	static void readSpill(const Bucket* bucket, std::string* output);
+	static int chunkId() { return std::time(nullptr) / (60 * 60); }
 
 protected:
 	virtual void process(Bucket* bucket);
+	virtual void processBatch(Bucket** buckets, size_t count);
 	bool checkOutput();
+	void rotated(int chunkId);
+	void dequeued(Bucket** buckets, size_t count);
+
+	static const char* header() { return "first_seen;key;values"; }
+	void chunkFileName(int chunkId, char* filename, size_t size, const char* extension = ".csv") const;
+
+private:
+	void commit();
+	void sendSpill(Bucket* bucket);
+	void spliceStream(Bucket* bucket);
+	void writeChunks(Bucket* bucket);
+	void gatherChunks(Bucket* bucket);
+	void writeGathered();
+}; // }}}
+
+/**
+ * Writer, submitting all of its I/O through io_uring rather than blocking on it.
+ *
+ * Arena-stored buckets are copied into registered buffers, which are written
+ * (IORING_OP_WRITE_FIXED) once full or once the batch is done. Pipe-stored
+ * buckets are spliced straight into the file. Every write has its own file
+ * offset reserved up front, so that any number of them may be in flight.
+ * The output file lives in the ring's registered file table, and is rotated
+ * by a linked close/open/header-write chain.
+ *
+ * Completions are reaped in between, and all of them once the writer's queue
+ * runs empty.
+ */
+class UringWriter : public Writer // {{{
+{
+private:
+	enum { QueueDepth = 256 };
+	enum { BufferCount = 64 };
+	enum { BufferSize = 256 * 1024 };
+	enum { FileSlot = 0 };
+
+	struct Operation {
+		enum Kind { Write, Splice, Rotate, Sync } kind;
+		unsigned buffer;   // Write: registered buffer index
+		Bucket* bucket;    // Splice: bucket to delete once spliced
+		size_t offset;     // Write, Splice: file offset
+		size_t size;       // Write, Splice: number of bytes
+		size_t done;       // Write, Splice: number of bytes written so far
+		size_t count;      // Sync: number of buckets synced
+		std::chrono::steady_clock::time_point start; // Splice, Sync: submission time
+	};
+
+	char* buffers_;                     // BufferCount * BufferSize, registered with ring_
+	x0::IoUring ring_;
+	std::vector<unsigned> freeBuffers_;
+	unsigned current_;                  // buffer being filled, or BufferCount if none
+	size_t currentSize_;
+	unsigned inflight_;                 // number of submitted operations not yet completed
+	bool fileOpen_;
+	bool rotateFailed_;
+	int error_;
+
+public:
+	UringWriter(ev::loop_ref loop, const std::string& storagePath, unsigned shard, unsigned shardCount);
+	~UringWriter();
+
+	bool ready() const { return error_ == 0; }
+	int error() const { return error_; }
+
+protected:
+	virtual void process(Bucket* bucket);
+	virtual void processBatch(Bucket** buckets, size_t count);
+
+private:
+	bool rotate();
+	void stage(Bucket* bucket);
+	void stage(const char* data, size_t size);
+	void submitBuffer();
+	void submitWrite(Operation* op);
+	void submitSplice(Operation* op);
+	void submitSync(size_t count);
+	io_uring_sqe* prepare(Operation* op);
+	void reap(unsigned waitFor);
+	void complete(Operation* op, int result);
+	void drain();
+}; // }}}
+
+/**
+ * Writer, bypassing the page cache via O_DIRECT.
+ *
+ * Buckets are copied (arena) or read (pipe) into one of two aligned buffers,
+ * which is handed over to a helper thread once full, to be written while the
+ * other one fills up. Whatever is left in the buffer being filled is written
+ * once the writer's queue runs empty, padded to the block size; its last
+ * block gets rewritten as more data arrives.
+ *
+ * Chunk files are preallocated in large extents (without changing their
+ * size), and truncated to their real length when closed, which also drops
+ * any padding and unused preallocation.
+ */
+class DirectWriter : public Writer // {{{
+{
+private:
+	enum { BlockSize = 4096 };                 // alignment of buffers, file offsets and lengths
+	enum { BufferSize = 1024 * 1024 };
+	enum { ExtentSize = 64 * 1024 * 1024 };    // fallocate() granularity
+
+	struct Job {
+		const char* data;
+		size_t size;
+		size_t offset;
+	};
+
+	char* buffers_[2];
+	unsigned fill_;      // index of the buffer being filled
+	size_t fillSize_;    // number of bytes in it
+	size_t fillSynced_;  // number of bytes of it already written (as padded tail)
+	size_t fillOffset_;  // file offset of its first byte, block-aligned
+	size_t allocated_;   // bytes preallocated in the current file
+	bool direct_;        // whether the current file could be opened with O_DIRECT
+	bool preallocate_;   // whether fallocate() is supported
+	int error_;
+
+	// helper thread, writing the buffer handed over
+	std::thread thread_;
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	Job job_;
+	bool busy_;
+	bool quit_;
+
+public:
+	DirectWriter(ev::loop_ref loop, const std::string& storagePath, unsigned shard, unsigned shardCount);
+	~DirectWriter();
+
+	bool ready() const { return error_ == 0; }
+	int error() const { return error_; }
+
+protected:
+	virtual void process(Bucket* bucket);
+	virtual void processBatch(Bucket** buckets, size_t count);
+
+private:
+	bool rotate();
+	void close();
+	void append(const char* data, size_t size);
+	void readStream(Bucket* bucket);
+	void handOver();
+	void writeTail();
+	void wait();
+	void preallocate(size_t end);
+	void writeAt(const char* data, size_t size, size_t offset);
+	void run();
+}; // }}}
+
+/**
+ * Buckets gathered by a CompressWriter, to be compressed into a single frame.
+ */
+struct Frame // {{{
+{
+	CompressWriter* writer;
+	std::string input;
+	std::string output;
+	size_t bucketCount;
+	std::chrono::steady_clock::time_point start;
+	bool done;          // guarded by the writer's mutex
+
+	explicit Frame(CompressWriter* w) :
+		writer(w), input(), output(), bucketCount(0), start(std::chrono::steady_clock::now()), done(false) {}
+}; // }}}
+
+/**
+ * Thread pool, compressing the frames of all compressing writers.
+ */
+class Compressor : public x0::Actor<Frame*> // {{{
+{
+private:
+	x0::Codec::Type codec_;
+	int level_;
+
+public:
+	Compressor(size_t threadCount, x0::Codec::Type codec, int level);
+
+	x0::Codec::Type codec() const { return codec_; }
+
+protected:
+	virtual void process(Frame* frame);
+}; // }}}
+
+/**
+ * Writer, emitting compressed frames into <chunk>.csv.zst (or .lz4).
+ *
+ * Buckets are gathered into a frame until it reaches FrameSize or its first
+ * bucket waited for FrameDelay, checked on every batch, including the empty
+ * ones (NULL) sent by the server's frame timer. The frame is then compressed
+ * by the shared Compressor pool, while the writer goes on gathering the next
+ * one. Up to MaxPending frames may be in flight; they are written in order as
+ * they complete, so that a file is just a concatenation of independent frames.
+ */
+class CompressWriter : public Writer // {{{
+{
+private:
+	enum { FrameSize = 1024 * 1024 };
+	enum { MaxPending = 4 };
+	static constexpr double FrameDelay = 1.0; // seconds
+
+	Compressor* compressor_;
+	Frame* current_;              // frame being gathered, if any
+	std::deque<Frame*> pending_;  // frames handed to the compressor, in file order
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	size_t syncedBuckets_;        // buckets written since the last fdatasync()
+	std::chrono::steady_clock::time_point syncStart_;
+
+	std::atomic<size_t> bytesIn_;
+	std::atomic<size_t> bytesOut_;
+
+	friend class Compressor;
+
+public:
+	CompressWriter(ev::loop_ref loop, const std::string& storagePath, unsigned shard, unsigned shardCount,
+		Compressor* compressor);
+	~CompressWriter();
+
+	size_t bytesIn() const { return bytesIn_.load(std::memory_order_relaxed); }
+	size_t bytesOut() const { return bytesOut_.load(std::memory_order_relaxed); }
+
+	virtual void finish();
+
+protected:
+	virtual void process(Bucket* bucket);
+	virtual void processBatch(Bucket** buckets, size_t count);
+
+private:
+	bool rotate();
+	Frame* frame();
+	void submit();
+	void writeCompleted(size_t keep);
+	void writeFrame(Frame* frame);
+	void sync();
+	void completed(Frame* frame);
+}; // }}}
+
+/**
+ * Writer, emitting the binary columnar format (see ColumnarChunk.h) into
+ * <chunk>.kcol files.
+ *
+ * Buckets are parsed back into rows, and gathered into a block until it holds
+ * BlockRows rows or about BlockSize bytes, or its first row waited for
+ * BlockDelay (checked on every batch, like CompressWriter's frames). The
+ * footer is written once the file is rotated, or the writer finishes. A file
+ * that gets continued has its footer read back and cut off first, or, if it
+ * has none, its blocks re-indexed.
+ */
+class ColumnarWriter : public Writer // {{{
+{
+private:
+	enum { BlockRows = 16384 };
+	enum { BlockSize = 1024 * 1024 };
+	static constexpr double BlockDelay = 1.0; // seconds
+
+	x0::ColumnarBlockBuilder block_;
+	x0::ColumnarIndex index_;
+	std::chrono::steady_clock::time_point blockStart_;
+	std::string text_;          // the bucket being parsed
+	std::string output_;        // the block or footer being written
+	size_t syncedBuckets_;      // rows written since the last fdatasync()
+	std::chrono::steady_clock::time_point syncStart_;
+
+public:
+	ColumnarWriter(ev::loop_ref loop, const std::string& storagePath, unsigned shard, unsigned shardCount);
+	~ColumnarWriter();
+
+	virtual void finish();
+
+protected:
+	virtual void process(Bucket* bucket);
+	virtual void processBatch(Bucket** buckets, size_t count);
+
+private:
+	bool rotate();
+	bool load(const char* filename, size_t size);
+	void close();
+	void add(Bucket* bucket);
+	void writeBlock();
+	bool writeAt(const char* data, size_t size, size_t offset);
+	void sync();
+}; // }}}
+
+/**
+ * Background thread, compacting the CSV chunk files writers rotated away from
+ * (see ChunkCompaction.h), one file at a time.
+ *
+ * Once aborted, the file being compacted is left as is, and so are all files
+ * handed over afterwards; they are collected in pending() instead.
+ */
+class Compactor : public x0::Actor<std::string*> // {{{
+{
+private:
+	size_t memoryLimit_; // bytes of records sorted in memory at a time
+	std::atomic<bool> abort_;
+	std::vector<std::string> pending_; // files left uncompacted since abort()
+
+	std::atomic<size_t> files_;
+	std::atomic<size_t> failures_;
+	std::atomic<size_t> recordsIn_;
+	std::atomic<size_t> recordsOut_;
+	std::atomic<size_t> bytesIn_;
+	std::atomic<size_t> bytesOut_;
+
+public:
+	explicit Compactor(size_t memoryLimit);
+
+	void abort() { abort_.store(true, std::memory_order_relaxed); }
+	const std::vector<std::string>& pending() const { return pending_; } // once joined
+
+	size_t files() const { return files_.load(std::memory_order_relaxed); }
+	size_t failures() const { return failures_.load(std::memory_order_relaxed); }
+	size_t recordsIn() const { return recordsIn_.load(std::memory_order_relaxed); }
+	size_t recordsOut() const { return recordsOut_.load(std::memory_order_relaxed); }
+	size_t bytesIn() const { return bytesIn_.load(std::memory_order_relaxed); }
+	size_t bytesOut() const { return bytesOut_.load(std::memory_order_relaxed); }
+
+protected:
+	virtual void process(std::string* filename);
+}; // }}}
+
+class Worker // {{{
+{
+private:
+	static constexpr double TickInterval = 0.1; // bucket timeout granularity, in seconds
+	enum { EvictionSamples = 8 };               // number of least recently touched buckets to pick a victim from
+	enum { MaxShortIdleFlushes = 64 };          // number of buckets flushed by the shortened idle timeout per tick
+
+	Server* server_;
+	unsigned id_;
+	std::unique_ptr<ev::dynamic_loop> ownLoop_; // only set if this worker runs in its own thread
+	ev::loop_ref loop_;
+	ev::async wakeup_;
+	std::thread thread_;
+	std::atomic<bool> shutdown_;
+	x0::SpscRing inbox_; // messages routed to this worker by the coordinator thread
+	bool pending_;       // inbox received messages since the last wakeup (coordinator-side only)
+	x0::FlatIndex<x0::Key128, Bucket> binaryBuckets_; // 32-hex-digit keys
+	x0::FlatIndex<x0::StringKey, Bucket> buckets_;    // any other key, pointing into Bucket::id_
+	x0::Arena arena_; // bucket storage, if Server::ArenaStorage is used
+	x0::SpillFile spill_; // bucket contents moved out of memory, if Server::spillSize_ is set
+	x0::TimingWheel timers_; // idle and TTL deadlines of all buckets
+	ev::timer tick_;         // drives timers_
+	ev_tstamp lastTick_;
+	std::atomic<uint64_t> maxLag_; // microseconds tick_ fired late at most, since the server last checked its load
+
+	// buckets by the time they have last been touched, most recent first
+	Bucket* lruHead_;
+	Bucket* lruTail_;
+
+	size_t memoryBudget_;               // this worker's share of Server::maxMemory_
+	size_t bucketBudget_;               // this worker's share of Server::maxBucketCount_, of the buckets it holds
+	std::atomic<size_t> bufferedBytes_; // held by this worker's buckets, not yet flushed
+
+	// shutdown, see shutdown(); the results are read by the server once joined
+	bool draining_;
+	std::chrono::steady_clock::time_point drainDeadline_;
+	size_t drainedBuckets_; // handed over to the writers
+	size_t drainedBytes_;
+	size_t lostBuckets_;    // given up on at the deadline
+	size_t lostBytes_;
+
+	// statistical
+	std::atomic<size_t> bucketCount_;
+	std::atomic<size_t> messagesProcessed_;
+	std::atomic<size_t> bucketsKilledMaxSize_;
+	std::atomic<size_t> bucketsKilledMaxAge_;
+	std::atomic<size_t> bucketsKilledMaxIdle_;
+	std::atomic<size_t> bucketsKilledSysError_;
+	std::atomic<size_t> bucketsEvicted_;
+	std::atomic<size_t> bucketsSpilled_;
+	std::atomic<size_t> bucketsKilledShortIdle_; // flushed by the idle timeout shortened under overload
+	std::atomic<size_t> droppedMessages_;
+	std::atomic<size_t> shedMessages_;           // of new keys not admitted under overload
+	x0::HdrHistogram receiveLatency_;            // nanoseconds from receiving a message until it got appended
+	x0::HdrHistogram bucketLifetime_;            // milliseconds from creating a bucket until it got flushed
+
+	friend class Bucket;
+	friend class Listener;
+	friend class Server;
+
+public:
+	Worker(Server* server, unsigned id, ev::loop_ref loop, bool threaded, size_t inboxSize = 0);
+	~Worker();
+
+	unsigned id() const { return id_; }
+	ev::loop_ref loop() const { return loop_; }
+	bool threaded() const { return ownLoop_.get() != nullptr; }
+
+	size_t memoryBudget() const { return memoryBudget_; }
+	void setMemoryBudget(size_t bytes) { memoryBudget_ = bytes; }
+
+	size_t bucketBudget() const { return bucketBudget_; }
+	void setBucketBudget(size_t count) { bucketBudget_ = std::max<size_t>(count, 1); }
+	size_t heldBuckets() const { return binaryBuckets_.size() + buckets_.size(); }
+
+	const x0::SpillFile& spillFile() const { return spill_; }
+
+	void start();
+	void stop();
+	void shutdown(const std::chrono::steady_clock::time_point& deadline);
+	void join();
+
+	bool post(const char* buf, size_t size, const std::chrono::steady_clock::time_point& receivedAt);
+	void notify();
+
+	bool process(char* buf, size_t size, time_t now, const std::chrono::steady_clock::time_point& receivedAt);
+	void flush(Bucket* bucket);
+	bool restore(const char* id, size_t idsize, ev_tstamp createdAt, ev_tstamp touchedAt, size_t itemCount,
+		const char* values, size_t valsize);
+
+private:
+	void main();
+	void onWakeup(ev::async& async, int revents);
+	void onTick(ev::timer& timer, int revents);
+
+	void account(ssize_t bytes);
+	void detach(Bucket* bucket);
+	void drain(const std::chrono::steady_clock::time_point& deadline);
+	void touch(Bucket* bucket);
+	void unlink(Bucket* bucket);
+	bool evict(bool spill = false);
+
+	template<typename Key>
+	bool push(x0::FlatIndex<Key, Bucket>& index, const Key& key,
+		const char* id, size_t idsize, const char* value, size_t valsize);
+	template<typename Key>
+	bool restore(x0::FlatIndex<Key, Bucket>& index, const Key& key, const char* id, size_t idsize,
+		ev_tstamp createdAt, ev_tstamp touchedAt, size_t itemCount, const char* values, size_t valsize);
+
+	static const x0::Key128* binaryId(const x0::Key128& key) { return &key; }
+	static const x0::Key128* binaryId(const x0::StringKey&) { return nullptr; }
+	static x0::Key128 indexKey(const Bucket* bucket, const x0::Key128&) { return bucket->binaryId_; }
+	static x0::StringKey indexKey(const Bucket* bucket, const x0::StringKey&) {
+		return x0::StringKey(bucket->id_.data(), bucket->id_.size());
+	}
+}; // }}}
+
+class Listener // {{{
+{
+private:
+	Server* server_;
+	Worker* worker_; // worker all messages go to, or NULL to route them across all the server's workers
+	ev::loop_ref loop_;
+	int fd_;
+	ev::io io_;
+
+	ino_t inode_; // of the socket, to find it in /proc/net/udp
+
+	// batched receive (recvmmsg), preallocated once in open()
+	size_t batchSize_;
+	std::vector<char> recvBuffer_;
+	std::vector<char> recvControl_; // a control message buffer per message, for SO_RXQ_OVFL
+	std::vector<iovec> recvVectors_;
+	std::vector<mmsghdr> recvMessages_;
+
+	unsigned shard_; // this listener's shard of the server's counters, only ever added to by the thread running loop_
+	std::atomic<uint32_t> kernelDrops_; // the socket's drop counter, as of the last datagram received (SO_RXQ_OVFL)
+	uint32_t sampledDrops_;             // kernelDrops_ as of the server's last sampleStats()
+
+	friend class Server;
+
+public:
+	enum { ControlSize = CMSG_SPACE(sizeof(uint32_t)) };
+
+	Listener(Server* server, ev::loop_ref loop, Worker* worker);
+	~Listener();
+
+	int handle() const { return fd_; }
+
+	void open(int fd, size_t batchSize);
+	void close();
+	int release();
+
+private:
+	void incoming(ev::io& io, int revents);
+	void incomingBatch(time_t now);
+	void readDrops(msghdr* msg);
+	void process(char* buf, size_t size, time_t now, const std::chrono::steady_clock::time_point& receivedAt);
+	void notifyWorkers();
+}; // }}}
+
+/**
+ * State a process hands over to its successor on a hot upgrade (see
+ * Server::upgrade()), in host byte order:
+ *
+ *   UpgradeHeader
+ *   UpgradeWorker[workerCount]
+ *   UpgradeListener[listenerCount]
+ *   (UpgradeBucket, key, values)[bucketCount]
+ *   (uint32_t size, path)...
+ *
+ * where a bucket's values are the bytes it buffered after its
+ * "\n<first_seen>;<key>" prefix, and the paths, up to the end of the file,
+ * are those of the chunk files still to be compacted.
+ */
+struct UpgradeHeader // {{{
+{
+	enum : uint32_t { Magic = 0x4750554b }; // "KUPG"
+	enum : uint32_t { CurrentVersion = 1 };
+
+	uint32_t magic;
+	uint32_t version;
+	uint32_t workerCount;
+	uint32_t listenerCount;
+	uint64_t bucketCount;
+}; // }}}
+
+struct UpgradeWorker // {{{
+{
+	uint64_t messagesProcessed;
+	uint64_t bucketsKilledMaxSize;
+	uint64_t bucketsKilledMaxAge;
+	uint64_t bucketsKilledMaxIdle;
+	uint64_t bucketsKilledSysError;
+	uint64_t bucketsEvicted;
+	uint64_t droppedMessages;
+}; // }}}
+
+struct UpgradeListener // {{{
+{
+	uint64_t bytesRead;
+	uint64_t bytesProcessed;
+	uint64_t messagesProcessed;
+	uint64_t receiveCalls;
+}; // }}}
+
+struct UpgradeBucket // {{{
+{
+	uint32_t worker;     // index of the worker it belonged to
+	uint32_t keySize;
+	double createdAt;
+	double touchedAt;
+	uint64_t itemCount;
+	uint64_t valuesSize;
 }; // }}}
 
 class Server // {{{
 {
+public:
+	enum { MaxMessageSize = 4096 };
+	enum { MaxBatchSize = 1024 }; // UIO_MAXIOV, the kernel's vlen limit for recvmmsg()
+	enum { WorkerInboxSize = 4 * 1024 * 1024 };
+	enum { SteeringPrefixSize = 16 }; // max. number of key bytes hashed by the SO_REUSEPORT steering filter
+	enum { MaxOverloadLevel = 6 };    // at which no more new keys are admitted at all
+	enum { ArenaChunkSize = 512 };    // bytes of a bucket's arena storage chunks
+	static constexpr double SampleInterval = 0.1;     // of the throughput rates, in seconds
+	static constexpr double LoadCheckInterval = 0.25;
+
+	enum StorageMode {
+		PipeStorage,  // a pipe per bucket, flushed via splice()
+		ArenaStorage, // userspace chunks from a per-worker arena, flushed via writev()
+	};
+
+	enum OutputMode {
+		SyncOutput,   // blocking writev()/splice() calls
+		UringOutput,  // asynchronous writes via io_uring
+		DirectOutput, // O_DIRECT writes from double buffers, bypassing the page cache
+	};
+
+	enum FileFormat {
+		CsvFormat,      // first_seen;key;values lines
+		ColumnarFormat, // binary blocks of columns, with a key index footer
+	};
+
 private:
 	std::string address_;
 	int port_;
+	char** argv_; // as passed to setup(), for re-executing on upgrade
+	bool notify_; // whether to report to the service manager (systemd's $NOTIFY_SOCKET)
 
 	ev::loop_ref loop_;
-	int fd_;
-	ev::io io_;
+	ev::timer statsTimer_;
+	ev::timer writerTimer_; // makes writers that gather frames or blocks check their age
+	ev::timer loadTimer_;   // drives the overload controller, see checkLoad()
 	ev::sig usr1Signal_;
+	ev::sig usr2Signal_;
 	ev::sig termSignal_;
 	ev::sig intSignal_;
-	std::unordered_map<std::string, Bucket*> buckets_;
-	Writer writer_;
-	x0::PerformanceCounter<8, size_t> bytesRead_;
-	x0::PerformanceCounter<8, size_t> bytesProcessed_;
-	x0::PerformanceCounter<8, size_t> messagesProcessed_;
+	std::vector<Listener*> listeners_;
+	std::vector<Worker*> workers_;
+	size_t listenerCount_;
+	size_t workerCount_;
+	size_t batchSize_;
+	StorageMode storage_;
+	std::string storagePath_;
+	size_t writerCount_;
+	OutputMode output_;
+	FileFormat format_;
+	size_t groupCommitSize_;  // bytes per group commit, or 0 to write buckets one by one
+	size_t groupCommitDelay_; // max. milliseconds a bucket may wait for its group to fill up
+	x0::Codec::Type compression_;
+	int compressionLevel_;
+	size_t compressionThreads_;
+	Compressor* compressor_;  // shared by all writers, if compressing
+	size_t compactMemory_;    // bytes of records sorted in memory when compacting a chunk file, or 0 to not compact
+	Compactor* compactor_;    // shared by all writers, if compacting
+	std::vector<Writer*> writers_;
+
+	// totals, sharded by listener, and their rates, sampled by statsTimer_
+	x0::ShardedPerformanceCounter<size_t> bytesRead_;
+	x0::ShardedPerformanceCounter<size_t> bytesProcessed_;
+	x0::ShardedPerformanceCounter<size_t> messagesProcessed_;
+	x0::ShardedPerformanceCounter<size_t> receiveCalls_;
+	x0::ShardedPerformanceCounter<size_t> datagramsReceived_; // whether processed or not, for m/recv
+	ev_tstamp lastStatus_; // of the per-second part of sampleStats()
+
+	// kernel-side drops of datagrams, as the sockets' receive queues were full
+	x0::MultiWindowCounter<size_t> kernelDrops_;
+	size_t totalKernelDrops_;  // summed up from the listeners' counters, across their wrap-arounds
+	size_t procDrops_;         // as sampled from /proc/net/udp by statsTimer_, once a second
+	size_t receiveBufferSize_; // SO_RCVBUF of the listener sockets, or 0 to keep the system's default
 
 	// resource limits
 	size_t maxBucketCount_;
 	size_t maxBucketSize_;
 	size_t maxBucketIdle_;
 	size_t maxBucketTTL_;
+	size_t maxMemory_; // bytes buffered by all buckets, before evicting some
+	size_t spillSize_; // bytes buffered by a bucket, before moving them to its worker's spill file, or 0 to not spill
 
-	std::atomic<size_t> bucketCount_;
+	// overload control
+	size_t overloadLag_;  // milliseconds of event loop lag considered overload, or 0 to not control load
+	std::atomic<unsigned> overloadLevel_; // 0 (normal) .. MaxOverloadLevel, see admit() and idleTimeout()
+	std::atomic<bool> writerBound_;       // whether a writer queue is overloaded, so the idle timeout is left as is
+	ev_tstamp lastLoadCheck_;
+	double loadLag_;      // as of the last check: max. loop lag (ms),
+	double loadQueue_;    // fill ratio of the fullest receive queue,
+	double loadBacklog_;  // and of the fullest writer queue
+	size_t overloadChecks_; // number of checks that found the server overloaded
+	unsigned calmChecks_;   // number of checks in a row that found the server back to normal
+	unsigned peakLevel_;    // highest overload level since the last time the load was normal
+	ev_tstamp overloadStart_;
 
-	// statistical
-	std::atomic<size_t> bucketsKilledMaxSize_;
-	std::atomic<size_t> bucketsKilledMaxAge_;
-	std::atomic<size_t> bucketsKilledMaxIdle_;
-	std::atomic<size_t> bucketsKilledSysError_;
-	std::atomic<size_t> droppedMessages_;
+	// shutdown
+	size_t drainTimeout_; // max. seconds to hand all buckets over to the writers and write them
+	bool draining_;       // whether stop() handed the buckets over, and join() is bound to drainDeadline_
+	std::chrono::steady_clock::time_point drainStart_;
+	std::chrono::steady_clock::time_point drainDeadline_;
+
+	std::atomic<size_t> bucketCount_;
+	std::atomic<size_t> pipeCount_;   // of buckets holding a pipe, including the ones handed over to the writers
+	std::atomic<size_t> queuedBytes_; // of the buckets handed over to the writers, not yet taken off their queues
 
 	friend class Bucket;
+	friend class Worker;
+	friend class Listener;
 
 public:
 	explicit Server(ev::loop_ref ev);
 	~Server();
 
 	bool setup(int argc, char* argv[]);
-	void flush(Bucket* bucket);
-	void join() { writer_.join(); }
+	void join();
 
 private:
 	bool start(int port, const char* address = "0.0.0.0");
+	int createSocket(int port, const char* address, bool reusePort);
+	bool attachSteeringFilter(int fd, unsigned count);
 	void stop();
+	void reportDrain(bool complete);
 	void printHelp(const char* program);
-	void incoming(ev::io& io, int revents);
+	static bool parseSize(const char* value, size_t* result);
+	void sampleStats(ev::timer& timer, int revents);
+	static size_t readProcDrops(const std::vector<ino_t>& inodes);
+	void tickWriters(ev::timer& timer, int revents);
+	void checkLoad(ev::timer& timer, int revents);
+	static double receiveQueueFill(int fd);
+	static bool admit(uint64_t hash, unsigned level);
+	ev_tstamp idleTimeout(unsigned level) const;
+	Writer* writer(const Bucket* bucket) const;
 	void sigterm(ev::sig& sig, int revents);
 	void logStats(ev::sig& sig, int revents);
+	void upgrade(ev::sig& sig, int revents);
+	bool saveState(int fd, size_t* bucketCount, size_t* bytes);
+	bool saveCompactions(int fd);
+	void restoreState();
+	void resumeCompactions();
+	static std::vector<int> inheritedSockets();
+	static std::vector<int> activatedSockets();
 }; // }}}
 
 // {{{ Bucket impl
-Bucket::Bucket(Server* server, const char* id, size_t idsize) :
-	server_(server),
-	loop_(server->loop_),
-	idleTimer_(server->loop_),
-	ttlTimer_(server->loop_),
-	id_(id, 0, idsize),
+/**
+ * Creates a bucket, and writes its "first_seen;key" prefix.
+ *
+ * @param createdAt the bucket's first_seen time, if other than now (i.e. when
+ *                  restoring a bucket of a previous process).
+ */
+Bucket::Bucket(Worker* worker, const char* id, size_t idsize, const x0::Key128* binaryId, ev_tstamp createdAt) :
+	worker_(worker),
+	createdAt_(createdAt ? createdAt : ev_now(worker->loop_)),
+	touchedAt_(createdAt_),
+	binary_(binaryId != nullptr),
+	binaryId_(),
+	id_(binaryId ? std::string() : std::string(id, idsize)),
+	hash_(0),
 	stream_(),
+	head_(nullptr),
+	tail_(nullptr),
 	streamSize_(0),
-	itemCount_(0)
+	spilled_(),
+	spilledSize_(0),
+	itemCount_(0),
+	queuedSize_(0),
+	flushedAt_(),
+	lruPrev_(nullptr),
+	lruNext_(nullptr)
 {
-	++server_->bucketCount_;
-	DEBUG("Bucket[%s].new (count=%lu)\n", id_.c_str(), server_->bucketCount_.load());
-	if (pipe(stream_) < 0) {
-		// pipe creation failed
-		stream_[0] = stream_[1] = -1;
-		perror("pipe");
-		// TODO error checking inside its caller
+	++worker_->bucketCount_;
+	++worker_->server_->bucketCount_;
+	if (binaryId)
+		binaryId_ = *binaryId;
+
+	DEBUG("Bucket[%s].new (count=%lu)\n", id().c_str(), worker_->server_->bucketCount_.load());
+
+	// pipes are bounded by the file descriptors, including those of the buckets the writers still
+	// have to write, so once they are all taken, the bucket is stored in the arena instead
+	Server* server = worker_->server_;
+	bool created;
+	if (server->storage_ == Server::PipeStorage && server->pipeCount_.fetch_add(1) < server->maxBucketCount_) {
+		if (!(created = pipe2(stream_, O_NONBLOCK) == 0)) {
+			// pipe creation failed
+			stream_[0] = stream_[1] = -1;
+			--server->pipeCount_;
+			perror("pipe");
+		}
 	} else {
-		char buf[64];
-		ssize_t buflen = snprintf(buf, sizeof(buf), "\n%f;", ev_now(loop_));
-		::write(stream_[1], buf, buflen);
-		::write(stream_[1], id, idsize);
-		streamSize_ += buflen + idsize;
+		if (server->storage_ == Server::PipeStorage)
+			--server->pipeCount_;
+
+		head_ = tail_ = worker_->arena_.allocate();
+		if (!(created = head_ != nullptr))
+			std::fprintf(stderr, "Could not allocate bucket storage.\n");
+		stream_[0] = stream_[1] = -1;
+	}
 
-		idleTimer_.set<Bucket, &Bucket::timeoutIdle>(this);
-		idleTimer_.start(server_->maxBucketIdle_, 0.0);
+	if (created) {
+		char buf[64];
+		ssize_t buflen = snprintf(buf, sizeof(buf), "\n%f;", createdAt_);
+		append(buf, buflen);
+		append(id, idsize);
 
-		ttlTimer_.set<Bucket, &Bucket::timeoutTTL>(this);
-		ttlTimer_.start(server_->maxBucketTTL_, 0.0);
+		worker_->timers_.schedule(this, deadline());
 	}
 }
 
 Bucket::~Bucket()
 {
-	DEBUG("Bucket[%s].destroy\n", id_.c_str());
+	DEBUG("Bucket[%s].destroy\n", id().c_str());
 
 	if (stream_[0] >= 0) {
 		::close(stream_[0]);
 		::close(stream_[1]);
+		--worker_->server_->pipeCount_;
 	}
 
-	--server_->bucketCount_;
+	worker_->arena_.release(head_);
+
+	for (const auto& extent: spilled_)
+		worker_->spill_.release(extent);
+
+	worker_->server_->queuedBytes_ -= queuedSize_;
+	--worker_->server_->bucketCount_;
+	--worker_->bucketCount_;
+}
+
+std::string Bucket::id() const
+{
+	return binary_ ? x0::KeyCodec<x0::Key128>::encode(binaryId_) : id_;
 }
 
 // value passed including the leading ';'
 void Bucket::push_back(const char* value, size_t size)
 {
-	DEBUG("Bucket[%s] << '%s'\n", id_.c_str(), value);
-	ssize_t rv = ::write(stream_[1], value, size);
+	DEBUG("Bucket[%s] << '%s'\n", id().c_str(), value);
 
-	if (rv < 0) {
-		perror("write");
-		++server_->bucketsKilledSysError_;
+	if (!append(value, size)) {
+		++worker_->bucketsKilledSysError_;
 		flush();
 		return;
 	}
 
-	streamSize_ += size;
 	++itemCount_;
 
-	if (itemCount_ == server_->maxBucketSize_) {
-		++server_->bucketsKilledMaxSize_;
+	if (itemCount_ == worker_->server_->maxBucketSize_) {
+		++worker_->bucketsKilledMaxSize_;
 		flush();
 		return;
 	}
 
-	if (idleTimer_.is_active())
-		idleTimer_.stop();
+	if (worker_->server_->spillSize_ && streamSize_ >= worker_->server_->spillSize_ && !spill()) {
+		++worker_->bucketsKilledSysError_;
+		flush();
+		return;
+	}
 
-	idleTimer_.start(server_->maxBucketIdle_, 0.0);
+	// the idle deadline is only checked once the bucket's timer expires
+	touchedAt_ = ev_now(worker_->loop_);
 }
 
-void Bucket::flush()
+bool Bucket::append(const char* data, size_t size)
+{
+	if (stream_[1] >= 0) {
+		while (size > 0) {
+			ssize_t rv = ::write(stream_[1], data, size);
+			if (rv < 0) {
+				if (errno == EINTR)
+					continue;
+
+				// the pipe is full, make room (rather than blocking until it gets flushed, which never happens)
+				if (errno == EAGAIN && worker_->server_->spillSize_ && streamSize_ > 0 && spill())
+					continue;
+
+				perror("write");
+				return false;
+			}
+
+			streamSize_ += rv;
+			worker_->account(rv);
+			data += rv;
+			size -= rv;
+		}
+		return true;
+	}
+
+	while (size > 0) {
+		if (tail_->size == tail_->capacity) {
+			x0::ArenaChunk* chunk = worker_->arena_.allocate();
+			if (!chunk) {
+				std::fprintf(stderr, "Could not allocate bucket storage.\n");
+				return false;
+			}
+			tail_->next = chunk;
+			tail_ = chunk;
+		}
+
+		size_t n = std::min<size_t>(size, tail_->capacity - tail_->size);
+		memcpy(tail_->data + tail_->size, data, n);
+		tail_->size += n;
+		streamSize_ += n;
+		worker_->account(n);
+		data += n;
+		size -= n;
+	}
+
+	return true;
+}
+
+/**
+ * Moves the bucket's buffered contents into its worker's spill file, ahead
+ * of what gets buffered later. Writers stitch both back together in order.
+ */
+bool Bucket::spill()
 {
-	if (idleTimer_.is_active())
-		idleTimer_.stop();
+	if (streamSize_ == 0)
+		return true;
+
+	x0::SpillFile& file = worker_->spill_;
+	if (!file.isOpen()) {
+		if (file.error())
+			return false; // failed before, and got reported then
+
+		if (!file.open(worker_->server_->storagePath_)) {
+			std::fprintf(stderr, "Could not create spill file in %s: %s\n",
+				worker_->server_->storagePath_.c_str(), strerror(file.error()));
+			return false;
+		}
+	}
+
+	x0::SpillFile::Extent extent;
+	bool complete;
+
+	if (stream_[0] >= 0) {
+		complete = file.splice(stream_[0], streamSize_, &extent);
+	} else {
+		std::vector<iovec> vec;
+		for (x0::ArenaChunk* chunk = head_; chunk; chunk = chunk->next) {
+			iovec v;
+			v.iov_base = chunk->data;
+			v.iov_len = chunk->size;
+			vec.push_back(v);
+		}
+
+		if ((complete = file.append(vec.data(), vec.size(), &extent))) {
+			// keep the head chunk to append to
+			worker_->arena_.release(head_->next);
+			head_->next = nullptr;
+			head_->size = 0;
+			tail_ = head_;
+		}
+	}
+
+	if (extent.size) {
+		spilled_.push_back(extent);
+		spilledSize_ += extent.size;
+		streamSize_ -= extent.size;
+		worker_->account(-static_cast<ssize_t>(extent.size));
+		++worker_->bucketsSpilled_;
+	}
 
-	if (ttlTimer_.is_active())
-		ttlTimer_.stop();
+	if (!complete)
+		std::fprintf(stderr, "Could not spill bucket %s: %s\n", id().c_str(), strerror(file.error()));
 
-	server_->flush(this);
+	return complete;
+}
+
+void Bucket::flush()
+{
+	worker_->timers_.cancel(this);
+	worker_->flush(this);
 }
 
-void Bucket::timeoutTTL(ev::timer&, int)
+// the earlier of the idle and the TTL deadline
+ev_tstamp Bucket::deadline() const
 {
-	DEBUG("Bucket[%s].timeoutTTL()\n", id_.c_str());
-	++server_->bucketsKilledMaxAge_;
-	flush();
+	return std::min(touchedAt_ + worker_->server_->maxBucketIdle_,
+		createdAt_ + worker_->server_->maxBucketTTL_);
 }
 
-void Bucket::timeoutIdle(ev::timer&, int)
+/**
+ * Invoked by the worker's timing wheel once deadline() has passed, as of the
+ * time the bucket has been scheduled. It may have been touched since, in
+ * which case the bucket gets rescheduled rather than flushed.
+ */
+void Bucket::timeout(ev_tstamp now)
 {
-	DEBUG("Bucket[%s].timeoutIdle()\n", id_.c_str());
-	++server_->bucketsKilledMaxIdle_;
-	flush();
+	if (now >= createdAt_ + worker_->server_->maxBucketTTL_) {
+		DEBUG("Bucket[%s].timeoutTTL()\n", id().c_str());
+		++worker_->bucketsKilledMaxAge_;
+		flush();
+	} else if (now >= touchedAt_ + worker_->server_->maxBucketIdle_) {
+		DEBUG("Bucket[%s].timeoutIdle()\n", id().c_str());
+		++worker_->bucketsKilledMaxIdle_;
+		flush();
+	} else {
+		worker_->timers_.schedule(this, deadline());
+	}
 }
 // }}}
 
 // {{{ Writer impl
-Writer::Writer(ev::loop_ref loop) :
-	Actor(1),
+/**
+ * Creates a bucket writer.
+ *
+ * @param shard      index of this writer within the writer pool.
+ * @param shardCount number of writers in the pool. With more than one, each
+ *                   writes to its own files, named "<chunk>.<shard>.csv".
+ */
+Writer::Writer(ev::loop_ref loop, const std::string& storagePath, unsigned shard, unsigned shardCount) :
+	Actor(1, 64 * 1024),
 	loop_(loop),
-	storagePath_("/var/tmp"),
+	storagePath_(storagePath),
+	shard_(shard),
+	shardCount_(shardCount),
 	currentChunkId_(0),
 	outputOffset_(1),
-	fd_(-1)
+	fd_(-1),
+	compactor_(nullptr),
+	groupSize_(0),
+	groupDelay_(0.0),
+	group_(),
+	groupBytes_(0),
+	groupStart_(),
+	vectors_(),
+	groupBuckets_(),
+	groupLatency_(),
+	dequeueLatency_(),
+	spliceDuration_()
 {
 }
 
@@ -247,17 +1140,83 @@ Writer::~Writer()
 {
 }
 
-bool Writer::checkOutput()
+void Writer::chunkFileName(int chunkId, char* filename, size_t size, const char* extension) const
 {
-	time_t now = std::time(nullptr);
-	int chunkId = static_cast<time_t>(now) / (60 * 60);
+	if (shardCount_ > 1)
+		snprintf(filename, size, "%s/%d.%u%s", storagePath_.c_str(), chunkId, shard_, extension);
+	else
+		snprintf(filename, size, "%s/%d%s", storagePath_.c_str(), chunkId, extension);
+}
 
-	if (fd_ < 0 || chunkId != currentChunkId_) {
-		if (fd_ >= 0)
+/**
+ * Hands the (CSV) chunk file of the given chunk over to the compactor, if
+ * any, once the writer closed it for good.
+ */
+void Writer::rotated(int chunkId)
+{
+	if (!compactor_)
+		return;
+
+	char filename[PATH_MAX];
+	chunkFileName(chunkId, filename, sizeof(filename));
+	compactor_->send(new std::string(filename));
+}
+
+/**
+ * Completes the current output file, once the writer's thread has been joined.
+ */
+void Writer::finish()
+{
+}
+
+// appends the contents of the bucket's pipe to the output
+void Writer::readStream(Bucket* bucket, std::string* output)
+{
+	while (bucket->streamSize_ > 0) {
+		size_t offset = output->size();
+		output->resize(offset + bucket->streamSize_);
+
+		ssize_t rv = ::read(bucket->stream_[0], &(*output)[offset], bucket->streamSize_);
+		if (rv <= 0) {
+			if (rv < 0 && errno == EINTR)
+				continue;
+
+			std::fprintf(stderr, "read failed: %s\n", rv ? strerror(errno) : "premature end of stream");
+			output->resize(offset);
+			break;
+		}
+
+		output->resize(offset + rv);
+		bucket->streamSize_ -= rv;
+	}
+}
+
+// appends the bucket's spilled contents to the output, which go ahead of its pipe or chunks
+void Writer::readSpill(const Bucket* bucket, std::string* output)
+{
+	for (const auto& extent: bucket->spilled_) {
+		size_t offset = output->size();
+		output->resize(offset + extent.size);
+
+		if (!bucket->worker_->spillFile().read(extent, &(*output)[offset])) {
+			std::fprintf(stderr, "Could not read back spilled bucket %s: %s\n", bucket->id().c_str(), strerror(errno));
+			output->resize(offset);
+		}
+	}
+}
+
+bool Writer::checkOutput()
+{
+	int chunkId = Writer::chunkId();
+
+	if (fd_ < 0 || chunkId != currentChunkId_) {
+		if (fd_ >= 0) {
 			::close(fd_);
+			rotated(currentChunkId_);
+		}
 
 		char filename[PATH_MAX];
-		snprintf(filename, sizeof(filename), "%s/%d.csv", storagePath_.c_str(), chunkId);
+		chunkFileName(chunkId, filename, sizeof(filename));
 
 		fd_ = ::open(filename, O_WRONLY | O_CREAT, 0664);
 		if (fd_ < 0) {
@@ -272,8 +1231,7 @@ bool Writer::checkOutput()
 			outputOffset_ = rv;
 
 		// write CSV header-line
-		static const char* header = "first_seen;key;values";
-		rv = ::write(fd_, header, strlen(header));
+		rv = ::write(fd_, header(), strlen(header()));
 		if (rv > 0)
 			outputOffset_ += rv;
 
@@ -286,313 +1244,3829 @@ bool Writer::checkOutput()
 void Writer::process(Bucket* bucket)
 {
 	if (checkOutput()) {
-		while (bucket->streamSize_ > 0) {
-			DEBUG(" splice(%d, nil, %d, nil, %ld, move|more)\n",
-					bucket->stream_[0], fd_, bucket->streamSize_);
-			ssize_t rv = splice(
-				bucket->stream_[0], NULL,
-				fd_, NULL,
-				bucket->streamSize_,
-				SPLICE_F_MOVE | SPLICE_F_MORE
-			);
-			switch (rv) {
-			case -1:
-				perror("splice");
-			case 0:
-				std::fprintf(stderr, "splice() failed.\n");
-				bucket->streamSize_ = 0;
-				break;
-			default:
-				bucket->streamSize_ -= rv;
-				outputOffset_ += rv;
-				break;
-			}
-		}
+		sendSpill(bucket);
+
+		if (bucket->head_)
+			writeChunks(bucket);
+		else
+			spliceStream(bucket);
 
 		delete bucket;
 	}
 }
-// }}}
 
-// {{{ Server impl
-Server::Server(ev::loop_ref loop) :
-	address_("0.0.0.0"),
-	port_(2323),
-	loop_(loop),
-	io_(loop),
-	usr1Signal_(loop),
-	termSignal_(loop),
-	intSignal_(loop),
-	writer_(loop),
-	bytesRead_(),
-	bytesProcessed_(),
-	messagesProcessed_(),
-	maxBucketCount_((1024 - 7) / 2),
-	maxBucketSize_(50),
-	maxBucketIdle_(10),
-	maxBucketTTL_(60),
-	bucketCount_(0),
-	bucketsKilledMaxSize_(0),
-	bucketsKilledMaxAge_(0),
-	bucketsKilledMaxIdle_(0),
-	bucketsKilledSysError_(0),
-	droppedMessages_(0)
+/**
+ * Gathers the buckets into the current group (if group commit is enabled),
+ * which gets committed once it holds groupSize_ bytes, its first bucket
+ * waited for groupDelay_, or no more buckets are ready to be written.
+ */
+void Writer::processBatch(Bucket** buckets, size_t count)
 {
-	usr1Signal_.set<Server, &Server::logStats>(this);
-	usr1Signal_.start(SIGUSR1);
-	loop_.unref();
-
-	termSignal_.set<Server, &Server::sigterm>(this);
-	termSignal_.start(SIGTERM);
-	loop_.unref();
-
-	intSignal_.set<Server, &Server::sigterm>(this);
-	intSignal_.start(SIGINT);
-	loop_.unref();
-}
+	dequeued(buckets, count);
 
-Server::~Server()
-{
-	if (intSignal_.is_active()) {
-		loop_.ref();
-		intSignal_.stop();
+	if (!groupCommit()) {
+		Actor::processBatch(buckets, count);
+		return;
 	}
 
-	if (termSignal_.is_active()) {
-		loop_.ref();
-		termSignal_.stop();
-	}
+	for (size_t i = 0; i < count; ++i) {
+		if (group_.empty())
+			groupStart_ = std::chrono::steady_clock::now();
 
-	if (usr1Signal_.is_active()) {
-		loop_.ref();
-		usr1Signal_.stop();
+		group_.push_back(buckets[i]);
+		groupBytes_ += buckets[i]->size();
+
+		if (groupBytes_ >= groupSize_)
+			commit();
 	}
 
-	if (fd_ >= 0) {
-		stop();
+	if (!group_.empty()) {
+		std::chrono::duration<double> age = std::chrono::steady_clock::now() - groupStart_;
+		if (empty() || age.count() >= groupDelay_) {
+			commit();
+		}
 	}
 }
 
-bool Server::setup(int argc, char* argv[])
+/**
+ * Writes all buckets of the current group, with as few writev() calls as
+ * possible, followed by a single fdatasync().
+ */
+void Writer::commit()
 {
-	static const struct option long_options[] = {
-		{ "help", no_argument, NULL, 'h' },
-		{ "port", required_argument, NULL, 'p' },
-		{ "address", required_argument, NULL, 'a' },
-		{ "storage-path", required_argument, NULL, 's' },
-		{ "max-bucket-count", required_argument, NULL, 'c' },
-		{ "max-bucket-size", required_argument, NULL, 'n' },
-		{ "max-bucket-idle", required_argument, NULL, 'i' },
-		{ "max-bucket-ttl", required_argument, NULL, 't' },
-		{ 0, 0, 0, 0 }
-	};
+	if (checkOutput()) {
+		for (auto bucket: group_) {
+			if (!bucket->spilled_.empty()) {
+				writeGathered(); // keeps the buckets in order
+				sendSpill(bucket);
+			}
 
-	for (;;) {
-		int long_index = 0;
-		switch (getopt_long(argc, argv, "?hp:a:s:c:n:i:t:", long_options, &long_index)) {
-			case '?':
-			case 'h':
-				printHelp(argv[0]);
-				return false;
-			case 'p':
-				port_ = std::atoi(optarg);
-				break;
-			case 'a':
-				address_ = optarg;
-				break;
-			case 's':
-				writer_.setStoragePath(optarg);
-				break;
-			case 'c':
-				maxBucketCount_ = atoi(optarg);
-				break;
-			case 'n':
-				maxBucketSize_ = atoi(optarg);
-				break;
-			case 'i':
-				maxBucketIdle_ = atoi(optarg);
-				break;
-			case 't':
-				maxBucketTTL_ = atoi(optarg);
-				break;
-			case 0:
-				// long option with (val != NULL && flag == 0)
-				break;
-			case -1:
-				// EOF - everything parsed
-				return start(port_, address_.c_str());
-				break;
-			default:
-				return false;
+			if (bucket->head_) {
+				gatherChunks(bucket);
+			} else {
+				writeGathered(); // keeps the buckets in order
+				spliceStream(bucket);
+			}
+		}
+
+		writeGathered();
+
+		if (::fdatasync(fd_) < 0) {
+			perror("fdatasync");
 		}
 	}
+
+	auto now = std::chrono::steady_clock::now();
+	groupBuckets_.record(group_.size());
+	groupLatency_.record(std::chrono::duration_cast<std::chrono::microseconds>(now - groupStart_).count());
+
+	for (auto bucket: group_)
+		delete bucket;
+
+	group_.clear();
+	groupBytes_ = 0;
 }
 
-void Server::flush(Bucket* bucket)
+// records how long the buckets waited in this writer's queue
+void Writer::dequeued(Bucket** buckets, size_t count)
 {
-	auto i = buckets_.find(bucket->id());
-	if (i != buckets_.end()) {
-		buckets_.erase(i);
-		writer_.push_back(bucket);
-	} else {
-		std::fprintf(stderr, "Requested a flush of a bucket that is not (anymore) in the server's bucket set.\n");
-		writer_.push_back(bucket);
+	auto now = std::chrono::steady_clock::now();
+
+	for (size_t i = 0; i < count; ++i) {
+		if (buckets[i]) {
+			dequeueLatency_.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				now - buckets[i]->flushedAt_).count());
+		}
 	}
 }
 
-bool Server::start(int port, const char* address)
+// writes the bucket's spilled contents straight from its worker's spill file
+void Writer::sendSpill(Bucket* bucket)
 {
-	// verify file descriptor limit
-	size_t required_fd_count = 7 + maxBucketCount_ * 2;
-	rlimit rlim;
-	rlim.rlim_cur = rlim.rlim_max = required_fd_count;
+	for (const auto& extent: bucket->spilled_) {
+		ssize_t rv = bucket->worker_->spillFile().send(extent, fd_);
+		outputOffset_ += rv;
 
-	if (setrlimit(RLIMIT_NOFILE, &rlim) < 0) {
-		perror("setrlimit");
+		if (static_cast<size_t>(rv) != extent.size) {
+			perror("sendfile");
+			break;
+		}
 	}
+}
 
-	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0) {
-		if (required_fd_count > rlim.rlim_cur) {
-			size_t adjusted_value = (rlim.rlim_cur - 7) / 2;
-			std::fprintf(stderr,
-				"Not enough file descriptors available to this process (%ld). "
-				"Would require %ld file descriptors for %ld buckets. Adjusting maximum bucket count to %ld.\n",
-				rlim.rlim_cur, required_fd_count, maxBucketCount_, adjusted_value);
-			maxBucketCount_ = adjusted_value;
+void Writer::spliceStream(Bucket* bucket)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	while (bucket->streamSize_ > 0) {
+		DEBUG(" splice(%d, nil, %d, nil, %ld, move|more)\n",
+				bucket->stream_[0], fd_, bucket->streamSize_);
+		ssize_t rv = splice(
+			bucket->stream_[0], NULL,
+			fd_, NULL,
+			bucket->streamSize_,
+			SPLICE_F_MOVE | SPLICE_F_MORE
+		);
+		switch (rv) {
+		case -1:
+			perror("splice");
+		case 0:
+			std::fprintf(stderr, "splice() failed.\n");
+			bucket->streamSize_ = 0;
+			break;
+		default:
+			bucket->streamSize_ -= rv;
+			outputOffset_ += rv;
+			break;
 		}
 	}
 
-	fd_ = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	if (fd_ < 0) {
-		perror("socket");
-		return false;
-	}
+	spliceDuration_.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - start).count());
+}
 
-	struct sockaddr_in sin;
-	memset(&sin, 0, sizeof(sin));
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(port);
+// writes the bucket's chain of arena chunks, up to MaxVectors chunks per writev()
+void Writer::writeChunks(Bucket* bucket)
+{
+	iovec vec[MaxVectors];
+	x0::ArenaChunk* chunk = bucket->head_;
+	size_t offset = 0; // number of bytes of the current chunk already written
 
-	int rv = inet_pton(AF_INET, address, &sin.sin_addr.s_addr);
-	if (rv == 0) {
-		std::cerr << "Listener address [" << address << "] not in representation format." << std::endl;
-		return false;
-	} else if (rv < 0) {
-		perror("inet_pton");
-		return false;
-	}
+	while (chunk) {
+		int count = 0;
+		for (x0::ArenaChunk* i = chunk; i && count < MaxVectors; i = i->next, ++count) {
+			size_t skip = i == chunk ? offset : 0;
+			vec[count].iov_base = i->data + skip;
+			vec[count].iov_len = i->size - skip;
+		}
 
-	if (bind(fd_, (sockaddr*)&sin, sizeof(sin)) < 0) {
-		perror("bind");
-		return false;
-	}
+		DEBUG(" writev(%d, %d chunks)\n", fd_, count);
+		ssize_t rv = ::writev(fd_, vec, count);
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
 
-	io_.set(fd_, ev::READ);
-	io_.set<Server, &Server::incoming>(this);
-	io_.start();
+			perror("writev");
+			break;
+		}
 
-	writer_.start();
+		bucket->streamSize_ -= rv;
+		outputOffset_ += rv;
 
-	return true;
+		// skip what has been written
+		size_t n = rv;
+		while (chunk && n >= chunk->size - offset) {
+			n -= chunk->size - offset;
+			offset = 0;
+			chunk = chunk->next;
+		}
+		offset += n;
+	}
 }
 
-void Server::incoming(ev::io& io, int)
+// appends the bucket's chain of arena chunks to the vectors to be written
+void Writer::gatherChunks(Bucket* bucket)
 {
-	struct sockaddr_in sin;
-	socklen_t slen = sizeof(sin);
-	char buf[4096];
+	for (x0::ArenaChunk* chunk = bucket->head_; chunk; chunk = chunk->next) {
+		iovec vec;
+		vec.iov_base = chunk->data;
+		vec.iov_len = chunk->size;
+		vectors_.push_back(vec);
+	}
+}
 
-	int rv = recvfrom(io.fd, buf, sizeof(buf), 0, (sockaddr*)&sin, &slen);
-	if (rv > 0) {
-		buf[rv] = '\0';
+// writes all gathered vectors, up to MaxVectors per writev()
+void Writer::writeGathered()
+{
+	size_t i = 0;
 
-		time_t now = ev_now(loop_);
-		bytesRead_.update(now, rv);
+	while (i < vectors_.size()) {
+		int count = std::min<size_t>(vectors_.size() - i, MaxVectors);
 
-		if (bucketCount_ + 1 == maxBucketCount_) {
-			++droppedMessages_;
-			return;
-		}
+		DEBUG(" writev(%d, %d chunks)\n", fd_, count);
+		ssize_t rv = ::writev(fd_, &vectors_[i], count);
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
 
-		bytesProcessed_.update(now, rv);
+			perror("writev");
+			break;
+		}
 
-		if (char *p = strchr(buf, ';')) {
-			size_t keysize = p - buf;
-			size_t valsize = rv - keysize;
+		outputOffset_ += rv;
 
-			*p = '\0';
-			auto i = buckets_.find(buf);
-			*p = ';';
+		// skip what has been written
+		size_t n = rv;
+		while (i < vectors_.size() && n >= vectors_[i].iov_len) {
+			n -= vectors_[i].iov_len;
+			++i;
+		}
 
-			if (i != buckets_.end()) {
-				// bucket found -> append value to existing bucket
-				i->second->push_back(p, valsize);
-				messagesProcessed_.update(now, 1);
-			} else {
-				// bucket doesn't exist yet -> create new bucket and push value into it
-				Bucket* bucket = new Bucket(this, buf, keysize);
-				if (bucket->healthy()) {
-					buckets_[bucket->id()] = bucket;
-					bucket->push_back(p, valsize);
-					messagesProcessed_.update(now, 1);
-				} else {
-					delete bucket;
-				}
-			}
+		if (n) {
+			vectors_[i].iov_base = static_cast<char*>(vectors_[i].iov_base) + n;
+			vectors_[i].iov_len -= n;
 		}
 	}
+
+	vectors_.clear();
 }
+// }}}
 
-void Server::sigterm(ev::sig&, int)
+// {{{ UringWriter impl
+UringWriter::UringWriter(ev::loop_ref loop, const std::string& storagePath, unsigned shard, unsigned shardCount) :
+	Writer(loop, storagePath, shard, shardCount),
+	buffers_(nullptr),
+	ring_(QueueDepth),
+	freeBuffers_(),
+	current_(BufferCount),
+	currentSize_(0),
+	inflight_(0),
+	fileOpen_(false),
+	rotateFailed_(false),
+	error_(0)
 {
-	std::printf("Shutting down\n");
-	stop();
+	if (!ring_.ready()) {
+		error_ = ring_.error();
+		return;
+	}
 
-	if (intSignal_.is_active()) {
-		loop_.ref();
-		intSignal_.stop();
+	void* buffers = nullptr;
+	if ((error_ = posix_memalign(&buffers, 4096, BufferCount * BufferSize)) != 0)
+		return;
+
+	buffers_ = static_cast<char*>(buffers);
+
+	iovec vec[BufferCount];
+	for (unsigned i = 0; i < BufferCount; ++i) {
+		vec[i].iov_base = buffers_ + i * BufferSize;
+		vec[i].iov_len = BufferSize;
+		freeBuffers_.push_back(BufferCount - i - 1);
 	}
 
-	if (termSignal_.is_active()) {
-		loop_.ref();
-		termSignal_.stop();
+	int rv = ring_.registerBuffers(vec, BufferCount);
+	if (rv < 0) {
+		error_ = -rv;
+		return;
+	}
+
+	const int files[1] = { -1 };
+	rv = ring_.registerFiles(files, 1);
+	if (rv < 0) {
+		error_ = -rv;
+		return;
 	}
 }
 
-void Server::logStats(ev::sig&, int)
+UringWriter::~UringWriter()
 {
-	time_t now = ev_now(loop_);
-	bytesRead_.update(now, 0);
-	bytesProcessed_.update(now, 0);
-	messagesProcessed_.update(now, 0);
+	if (ready())
+		drain();
 
-	std::printf(
-		"dropped: %ld, active: %ld, k/idle: %ld, k/ttl: %ld, k/size: %ld, k/syserr: %ld, "
-		"bt/s: %.2f, bp/s: %.2f, m/s: %lu\n",
-		droppedMessages_.load(),
-		bucketCount_.load(),
-		bucketsKilledMaxIdle_.load(),
-		bucketsKilledMaxAge_.load(),
-		bucketsKilledMaxSize_.load(),
-		bucketsKilledSysError_.load(),
-		bytesRead_.average() / (1024.0f * 1024.0f / 8.0f),
-		bytesProcessed_.average() / (1024.0f * 1024.0f / 8.0f),
-		messagesProcessed_.average()
-	);
+	free(buffers_);
 }
 
-void Server::stop()
+void UringWriter::process(Bucket* bucket)
 {
-	io_.stop();
-	::close(fd_);
-	fd_ = -1;
+	processBatch(&bucket, 1);
+}
 
-	writer_.stop();
+void UringWriter::processBatch(Bucket** buckets, size_t count)
+{
+	dequeued(buckets, count);
+
+	if (!rotate()) {
+		for (size_t i = 0; i < count; ++i)
+			delete buckets[i];
+		return;
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		Bucket* bucket = buckets[i];
+
+		if (!bucket->spilled_.empty()) {
+			std::string spilled;
+			readSpill(bucket, &spilled);
+			stage(spilled.data(), spilled.size());
+		}
+
+		if (bucket->head_) {
+			stage(bucket);
+			delete bucket;
+		} else {
+			submitBuffer(); // the spilled contents go ahead
+			Operation* op = new Operation();
+			op->kind = Operation::Splice;
+			op->bucket = bucket;
+			op->offset = outputOffset_;
+			op->size = bucket->streamSize_;
+			op->start = std::chrono::steady_clock::now();
+			outputOffset_ += op->size;
+			submitSplice(op);
+		}
+	}
+
+	submitBuffer();
+
+	if (groupCommit())
+		submitSync(count);
+
+	ring_.submit();
+	reap(0);
+
+	// nothing else to do, so see the writes through
+	if (empty())
+		drain();
 }
 
-void Server::printHelp(const char* program)
+/**
+ * Rotates the output file once the chunk changed, by closing the current one,
+ * opening the new one into the same file slot, and writing its header, all
+ * linked into a single chain.
+ */
+bool UringWriter::rotate()
 {
-	printf("usage: %s [-a ADDRESS] [-p PORT] [-s STORAGE_PATH] [resource options] | -h\n"
+	int chunkId = Writer::chunkId();
+	if (fileOpen_ && chunkId == currentChunkId_)
+		return true;
+
+	// in-flight operations refer to the current file and its offsets
+	drain();
+
+	char filename[PATH_MAX];
+	chunkFileName(chunkId, filename, sizeof(filename));
+
+	// manually determine the end of the file (may not use O_APPEND due to splice()-requirements)
+	struct stat st;
+	size_t offset = ::stat(filename, &st) == 0 ? st.st_size : 0;
+
+	if (fileOpen_) {
+		Operation* op = new Operation();
+		op->kind = Operation::Rotate;
+		io_uring_sqe* sqe = prepare(op);
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->file_index = FileSlot + 1;
+		sqe->flags = IOSQE_IO_LINK;
+	}
+
+	Operation* op = new Operation();
+	op->kind = Operation::Rotate;
+	io_uring_sqe* sqe = prepare(op);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = reinterpret_cast<uint64_t>(filename);
+	sqe->len = 0664;
+	sqe->open_flags = O_WRONLY | O_CREAT;
+	sqe->file_index = FileSlot + 1;
+	sqe->flags = IOSQE_IO_LINK;
+
+	op = new Operation();
+	op->kind = Operation::Rotate;
+	sqe = prepare(op);
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = FileSlot;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->addr = reinterpret_cast<uint64_t>(header());
+	sqe->len = strlen(header());
+	sqe->off = offset;
+
+	// the chain refers to filename, so it must complete before returning
+	bool wasOpen = fileOpen_;
+	rotateFailed_ = false;
+	drain();
+
+	if (wasOpen)
+		rotated(currentChunkId_);
+
+	fileOpen_ = !rotateFailed_;
+	if (!fileOpen_) {
+		std::fprintf(stderr, "Could not open log chunk file for writing: %s\n", filename);
+		return false;
+	}
+
+	currentChunkId_ = chunkId;
+	outputOffset_ = offset + strlen(header());
+
+	DEBUG("UringWriter.rotate: opened %s at offset %zu\n", filename, offset);
+
+	return true;
+}
+
+// copies the bucket's arena chunks into registered buffers
+void UringWriter::stage(Bucket* bucket)
+{
+	for (x0::ArenaChunk* chunk = bucket->head_; chunk; chunk = chunk->next)
+		stage(chunk->data, chunk->size);
+}
+
+void UringWriter::stage(const char* data, size_t size)
+{
+	while (size > 0) {
+		if (current_ == BufferCount) {
+			while (freeBuffers_.empty())
+				reap(1);
+
+			current_ = freeBuffers_.back();
+			freeBuffers_.pop_back();
+			currentSize_ = 0;
+		}
+
+		size_t n = std::min<size_t>(size, BufferSize - currentSize_);
+		memcpy(buffers_ + current_ * BufferSize + currentSize_, data, n);
+		currentSize_ += n;
+		data += n;
+		size -= n;
+
+		if (currentSize_ == BufferSize)
+			submitBuffer();
+	}
+}
+
+// submits the buffer being filled, if any
+void UringWriter::submitBuffer()
+{
+	if (current_ == BufferCount)
+		return;
+
+	Operation* op = new Operation();
+	op->kind = Operation::Write;
+	op->buffer = current_;
+	op->offset = outputOffset_;
+	op->size = currentSize_;
+	outputOffset_ += currentSize_;
+
+	current_ = BufferCount;
+	currentSize_ = 0;
+
+	submitWrite(op);
+}
+
+void UringWriter::submitWrite(Operation* op)
+{
+	io_uring_sqe* sqe = prepare(op);
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->fd = FileSlot;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->addr = reinterpret_cast<uint64_t>(buffers_ + op->buffer * BufferSize + op->done);
+	sqe->len = op->size - op->done;
+	sqe->off = op->offset + op->done;
+	sqe->buf_index = op->buffer;
+}
+
+void UringWriter::submitSplice(Operation* op)
+{
+	io_uring_sqe* sqe = prepare(op);
+	sqe->opcode = IORING_OP_SPLICE;
+	sqe->fd = FileSlot;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->splice_fd_in = op->bucket->stream_[0];
+	sqe->splice_off_in = static_cast<uint64_t>(-1);
+	sqe->len = op->size - op->done;
+	sqe->off = op->offset + op->done;
+	sqe->splice_flags = SPLICE_F_MOVE;
+}
+
+// syncs the file once all previously submitted writes have completed
+void UringWriter::submitSync(size_t count)
+{
+	Operation* op = new Operation();
+	op->kind = Operation::Sync;
+	op->count = count;
+	op->start = std::chrono::steady_clock::now();
+
+	io_uring_sqe* sqe = prepare(op);
+	sqe->opcode = IORING_OP_FSYNC;
+	sqe->fd = FileSlot;
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_DRAIN;
+	sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+}
+
+// retrieves an SQE for the given operation, waiting for completions if too many are in flight
+io_uring_sqe* UringWriter::prepare(Operation* op)
+{
+	while (inflight_ >= QueueDepth)
+		reap(1);
+
+	io_uring_sqe* sqe = ring_.prepare();
+	if (!sqe) {
+		ring_.submit();
+		sqe = ring_.prepare();
+	}
+
+	sqe->user_data = reinterpret_cast<uint64_t>(op);
+	++inflight_;
+
+	return sqe;
+}
+
+// submits what is pending, waits for at least waitFor completions, and processes all available ones
+void UringWriter::reap(unsigned waitFor)
+{
+	if (waitFor || ring_.pending()) {
+		int rv = ring_.submit(waitFor);
+		if (rv < 0 && rv != -EAGAIN && rv != -EBUSY) {
+			std::fprintf(stderr, "io_uring_enter: %s\n", strerror(-rv));
+		}
+	}
+
+	ring_.reap([this](const io_uring_cqe& cqe) {
+		--inflight_;
+		complete(reinterpret_cast<Operation*>(cqe.user_data), cqe.res);
+	});
+}
+
+void UringWriter::complete(Operation* op, int result)
+{
+	switch (op->kind) {
+	case Operation::Write:
+	case Operation::Splice:
+		if (result == -EINTR || result == -EAGAIN) {
+			result = 0; // retry
+		} else if (result < 0 || (result == 0 && op->kind == Operation::Splice)) {
+			std::fprintf(stderr, "%s failed: %s\n", op->kind == Operation::Write ? "write" : "splice",
+				result ? strerror(-result) : "premature end of stream");
+			op->done = op->size;
+		}
+
+		op->done += result;
+
+		if (op->done < op->size) {
+			// short write, submit the rest
+			if (op->kind == Operation::Write)
+				submitWrite(op);
+			else
+				submitSplice(op);
+			return;
+		}
+
+		if (op->kind == Operation::Write) {
+			freeBuffers_.push_back(op->buffer);
+		} else {
+			spliceDuration_.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - op->start).count());
+			delete op->bucket;
+		}
+		break;
+	case Operation::Rotate:
+		if (result < 0) {
+			std::fprintf(stderr, "Rotating the log chunk file failed: %s\n", strerror(-result));
+			rotateFailed_ = true;
+		}
+		break;
+	case Operation::Sync:
+		if (result < 0)
+			std::fprintf(stderr, "fdatasync failed: %s\n", strerror(-result));
+
+		groupBuckets_.record(op->count);
+		groupLatency_.record(std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - op->start).count());
+		break;
+	}
+
+	delete op;
+}
+
+// waits for all operations in flight to complete
+void UringWriter::drain()
+{
+	reap(0);
+
+	while (inflight_ > 0)
+		reap(1);
+}
+// }}}
+
+// {{{ DirectWriter impl
+DirectWriter::DirectWriter(ev::loop_ref loop, const std::string& storagePath, unsigned shard, unsigned shardCount) :
+	Writer(loop, storagePath, shard, shardCount),
+	buffers_{nullptr, nullptr},
+	fill_(0),
+	fillSize_(0),
+	fillSynced_(0),
+	fillOffset_(0),
+	allocated_(0),
+	direct_(false),
+	preallocate_(true),
+	error_(0),
+	thread_(),
+	mutex_(),
+	cond_(),
+	job_(),
+	busy_(false),
+	quit_(false)
+{
+	for (auto& buffer: buffers_) {
+		void* p = nullptr;
+		if ((error_ = posix_memalign(&p, BlockSize, BufferSize)) != 0)
+			return;
+
+		buffer = static_cast<char*>(p);
+	}
+
+	thread_ = std::thread(&DirectWriter::run, this);
+}
+
+DirectWriter::~DirectWriter()
+{
+	if (thread_.joinable()) {
+		close();
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		quit_ = true;
+		cond_.notify_all();
+		lock.unlock();
+
+		thread_.join();
+	}
+
+	for (auto buffer: buffers_)
+		free(buffer);
+}
+
+void DirectWriter::process(Bucket* bucket)
+{
+	processBatch(&bucket, 1);
+}
+
+void DirectWriter::processBatch(Bucket** buckets, size_t count)
+{
+	dequeued(buckets, count);
+
+	auto start = std::chrono::steady_clock::now();
+	bool open = rotate();
+
+	for (size_t i = 0; i < count; ++i) {
+		Bucket* bucket = buckets[i];
+
+		if (open) {
+			if (!bucket->spilled_.empty()) {
+				std::string spilled;
+				Writer::readSpill(bucket, &spilled);
+				append(spilled.data(), spilled.size());
+			}
+
+			if (bucket->head_) {
+				for (x0::ArenaChunk* chunk = bucket->head_; chunk; chunk = chunk->next)
+					append(chunk->data, chunk->size);
+			} else {
+				readStream(bucket);
+			}
+		}
+
+		delete bucket;
+	}
+
+	if (!open)
+		return;
+
+	if (groupCommit()) {
+		wait();
+		writeTail();
+
+		if (::fdatasync(fd_) < 0)
+			perror("fdatasync");
+
+		groupBuckets_.record(count);
+		groupLatency_.record(std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - start).count());
+	} else if (empty()) {
+		// nothing else to do, so get the rest onto disk
+		writeTail();
+	}
+}
+
+bool DirectWriter::rotate()
+{
+	int chunkId = Writer::chunkId();
+	if (fd_ >= 0 && chunkId == currentChunkId_)
+		return true;
+
+	if (fd_ >= 0) {
+		close();
+		rotated(currentChunkId_);
+	}
+
+	char filename[PATH_MAX];
+	chunkFileName(chunkId, filename, sizeof(filename));
+
+	// readable, too, as a file's last block gets read back when continuing it
+	direct_ = true;
+	fd_ = ::open(filename, O_RDWR | O_CREAT | O_DIRECT, 0664);
+	if (fd_ < 0 && errno == EINVAL) {
+		direct_ = false;
+		fd_ = ::open(filename, O_RDWR | O_CREAT, 0664);
+	}
+
+	if (fd_ < 0) {
+		std::fprintf(stderr, "Could not open log chunk file for writing: %s: %s\n", filename, strerror(errno));
+		return false;
+	}
+
+	if (!direct_)
+		std::fprintf(stderr, "O_DIRECT not supported for %s, writing through the page cache.\n", filename);
+
+	// continue at the end of the file, starting with its last (partial) block
+	struct stat st;
+	size_t size = ::fstat(fd_, &st) == 0 ? st.st_size : 0;
+
+	fillOffset_ = size & ~size_t(BlockSize - 1);
+	fillSize_ = size - fillOffset_;
+	fillSynced_ = fillSize_;
+	allocated_ = size;
+	outputOffset_ = size;
+
+	if (fillSize_ && ::pread(fd_, buffers_[fill_], BlockSize, fillOffset_) < static_cast<ssize_t>(fillSize_)) {
+		std::fprintf(stderr, "Could not read the last block of %s: %s\n", filename, strerror(errno));
+		::close(fd_);
+		fd_ = -1;
+		return false;
+	}
+
+	currentChunkId_ = chunkId;
+
+	append(header(), strlen(header()));
+
+	DEBUG("DirectWriter.rotate: opened %s at offset %zu\n", filename, size);
+
+	return true;
+}
+
+// writes what is left, and truncates the file to its real length, dropping the padding and unused preallocation
+void DirectWriter::close()
+{
+	if (fd_ < 0)
+		return;
+
+	wait();
+	writeTail();
+
+	if (::ftruncate(fd_, outputOffset_) < 0)
+		perror("ftruncate");
+
+	::close(fd_);
+	fd_ = -1;
+}
+
+void DirectWriter::append(const char* data, size_t size)
+{
+	while (size > 0) {
+		size_t n = std::min<size_t>(size, BufferSize - fillSize_);
+		memcpy(buffers_[fill_] + fillSize_, data, n);
+		fillSize_ += n;
+		outputOffset_ += n;
+		data += n;
+		size -= n;
+
+		if (fillSize_ == BufferSize)
+			handOver();
+	}
+}
+
+// reads the bucket's pipe into the buffers, as O_DIRECT files cannot be spliced into at arbitrary offsets
+void DirectWriter::readStream(Bucket* bucket)
+{
+	while (bucket->streamSize_ > 0) {
+		size_t n = std::min<size_t>(bucket->streamSize_, BufferSize - fillSize_);
+		ssize_t rv = ::read(bucket->stream_[0], buffers_[fill_] + fillSize_, n);
+		if (rv <= 0) {
+			if (rv < 0 && errno == EINTR)
+				continue;
+
+			std::fprintf(stderr, "read failed: %s\n", rv ? strerror(errno) : "premature end of stream");
+			break;
+		}
+
+		fillSize_ += rv;
+		outputOffset_ += rv;
+		bucket->streamSize_ -= rv;
+
+		if (fillSize_ == BufferSize)
+			handOver();
+	}
+}
+
+// hands the full buffer over to the helper thread, and continues with the other one
+void DirectWriter::handOver()
+{
+	size_t from = fillSynced_ & ~size_t(BlockSize - 1);
+	preallocate(fillOffset_ + BufferSize);
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	cond_.wait(lock, [this]() { return !busy_; }); // the other buffer is still being written
+
+	job_.data = buffers_[fill_] + from;
+	job_.size = BufferSize - from;
+	job_.offset = fillOffset_ + from;
+	busy_ = true;
+	cond_.notify_all();
+	lock.unlock();
+
+	fill_ ^= 1;
+	fillOffset_ += BufferSize;
+	fillSize_ = 0;
+	fillSynced_ = 0;
+}
+
+// writes the not yet written blocks of the buffer being filled, its last one padded with zeros
+void DirectWriter::writeTail()
+{
+	if (fillSize_ == fillSynced_)
+		return;
+
+	size_t from = fillSynced_ & ~size_t(BlockSize - 1);
+	size_t to = (fillSize_ + BlockSize - 1) & ~size_t(BlockSize - 1);
+	char* buffer = buffers_[fill_];
+
+	memset(buffer + fillSize_, 0, to - fillSize_);
+	preallocate(fillOffset_ + to);
+	writeAt(buffer + from, to - from, fillOffset_ + from);
+
+	fillSynced_ = fillSize_;
+}
+
+// waits for the helper thread to finish the buffer handed over
+void DirectWriter::wait()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	cond_.wait(lock, [this]() { return !busy_; });
+}
+
+// makes sure the file has space allocated up to the given offset, in steps of ExtentSize
+void DirectWriter::preallocate(size_t end)
+{
+	if (!preallocate_ || end <= allocated_)
+		return;
+
+	size_t size = (end - allocated_ + ExtentSize - 1) / ExtentSize * ExtentSize;
+
+	if (::fallocate(fd_, FALLOC_FL_KEEP_SIZE, allocated_, size) < 0) {
+		if (errno == EOPNOTSUPP)
+			preallocate_ = false;
+		else
+			perror("fallocate");
+	}
+
+	allocated_ += size;
+}
+
+void DirectWriter::writeAt(const char* data, size_t size, size_t offset)
+{
+	while (size > 0) {
+		ssize_t rv = ::pwrite(fd_, data, size, offset);
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
+
+			perror("pwrite");
+			break;
+		}
+
+		data += rv;
+		size -= rv;
+		offset += rv;
+	}
+}
+
+// helper thread, writing one buffer at a time
+void DirectWriter::run()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	for (;;) {
+		cond_.wait(lock, [this]() { return busy_ || quit_; });
+		if (!busy_)
+			break;
+
+		Job job = job_;
+		lock.unlock();
+
+		writeAt(job.data, job.size, job.offset);
+
+		lock.lock();
+		busy_ = false;
+		cond_.notify_all();
+	}
+}
+// }}}
+
+// {{{ Compressor impl
+Compressor::Compressor(size_t threadCount, x0::Codec::Type codec, int level) :
+	x0::Actor<Frame*>(threadCount, 1024),
+	codec_(codec),
+	level_(level)
+{
+}
+
+void Compressor::process(Frame* frame)
+{
+	if (!x0::Codec::compress(codec_, level_, frame->input.data(), frame->input.size(), &frame->output)) {
+		std::fprintf(stderr, "Could not compress a frame of %zu bytes (%s), dropping it.\n",
+			frame->input.size(), x0::Codec::name(codec_));
+	}
+
+	frame->writer->completed(frame);
+}
+// }}}
+
+// {{{ CompressWriter impl
+CompressWriter::CompressWriter(ev::loop_ref loop, const std::string& storagePath, unsigned shard, unsigned shardCount,
+		Compressor* compressor) :
+	Writer(loop, storagePath, shard, shardCount),
+	compressor_(compressor),
+	current_(nullptr),
+	pending_(),
+	mutex_(),
+	cond_(),
+	syncedBuckets_(0),
+	syncStart_(),
+	bytesIn_(0),
+	bytesOut_(0)
+{
+}
+
+CompressWriter::~CompressWriter()
+{
+	delete current_;
+}
+
+void CompressWriter::process(Bucket* bucket)
+{
+	processBatch(&bucket, 1);
+}
+
+void CompressWriter::processBatch(Bucket** buckets, size_t count)
+{
+	dequeued(buckets, count);
+
+	bool open = rotate();
+
+	for (size_t i = 0; i < count; ++i) {
+		Bucket* bucket = buckets[i];
+
+		if (open && bucket) {
+			Frame* frame = this->frame();
+
+			readSpill(bucket, &frame->input);
+
+			if (bucket->head_) {
+				for (x0::ArenaChunk* chunk = bucket->head_; chunk; chunk = chunk->next)
+					frame->input.append(chunk->data, chunk->size);
+			} else {
+				readStream(bucket, &frame->input);
+			}
+
+			++frame->bucketCount;
+
+			if (frame->input.size() >= FrameSize)
+				submit();
+		}
+
+		delete bucket;
+	}
+
+	if (!open)
+		return;
+
+	if (current_) {
+		std::chrono::duration<double> age = std::chrono::steady_clock::now() - current_->start;
+		if (age.count() >= FrameDelay)
+			submit();
+	}
+
+	if (empty()) {
+		// nothing else to do, so see the frames handed over through
+		writeCompleted(0);
+		sync();
+	} else {
+		writeCompleted(MaxPending);
+	}
+}
+
+/**
+ * Writes the frame being gathered, and all in flight, once the writer's
+ * thread has been joined.
+ */
+void CompressWriter::finish()
+{
+	if (fd_ < 0)
+		return;
+
+	submit();
+	writeCompleted(0);
+	sync();
+}
+
+bool CompressWriter::rotate()
+{
+	int chunkId = Writer::chunkId();
+	if (fd_ >= 0 && chunkId == currentChunkId_)
+		return true;
+
+	// frames gathered so far belong to the current file
+	if (fd_ >= 0) {
+		submit();
+		writeCompleted(0);
+		::close(fd_);
+	}
+
+	char filename[PATH_MAX];
+	chunkFileName(chunkId, filename, sizeof(filename), (std::string(".csv") + x0::Codec::extension(compressor_->codec())).c_str());
+
+	fd_ = ::open(filename, O_WRONLY | O_CREAT, 0664);
+	if (fd_ < 0) {
+		std::fprintf(stderr, "Could not open log chunk file for writing: %s: %s\n", filename, strerror(errno));
+		return false;
+	}
+	currentChunkId_ = chunkId;
+
+	// frames are appended to whatever the file holds already
+	ssize_t rv = lseek(fd_, 0, SEEK_END);
+	if (rv >= 0)
+		outputOffset_ = rv;
+
+	frame()->input.append(header());
+
+	DEBUG("CompressWriter.rotate: opened %s at offset %zu\n", filename, outputOffset_);
+
+	return true;
+}
+
+// retrieves the frame being gathered, starting a new one if needed
+Frame* CompressWriter::frame()
+{
+	if (!current_) {
+		current_ = new Frame(this);
+		current_->input.reserve(FrameSize + Server::MaxMessageSize);
+	}
+
+	return current_;
+}
+
+// hands the frame being gathered over to the compressor
+void CompressWriter::submit()
+{
+	if (!current_)
+		return;
+
+	pending_.push_back(current_);
+	compressor_->send(current_);
+	current_ = nullptr;
+}
+
+// writes the completed frames in order, waiting for the oldest ones until at most @p keep are left in flight
+void CompressWriter::writeCompleted(size_t keep)
+{
+	while (!pending_.empty()) {
+		Frame* frame = pending_.front();
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		if (pending_.size() > keep)
+			cond_.wait(lock, [frame]() { return frame->done; });
+		else if (!frame->done)
+			break;
+		lock.unlock();
+
+		pending_.pop_front();
+		writeFrame(frame);
+	}
+}
+
+void CompressWriter::writeFrame(Frame* frame)
+{
+	if (!syncedBuckets_)
+		syncStart_ = std::chrono::steady_clock::now();
+
+	const char* data = frame->output.data();
+	size_t size = frame->output.size();
+
+	while (size > 0) {
+		ssize_t rv = ::write(fd_, data, size);
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
+
+			perror("write");
+			break;
+		}
+
+		data += rv;
+		size -= rv;
+		outputOffset_ += rv;
+	}
+
+	bytesIn_.fetch_add(frame->input.size(), std::memory_order_relaxed);
+	bytesOut_.fetch_add(frame->output.size(), std::memory_order_relaxed);
+	syncedBuckets_ += frame->bucketCount;
+
+	delete frame;
+}
+
+// syncs the written frames, if group commit is enabled
+void CompressWriter::sync()
+{
+	if (!groupCommit() || !syncedBuckets_)
+		return;
+
+	if (::fdatasync(fd_) < 0)
+		perror("fdatasync");
+
+	groupBuckets_.record(syncedBuckets_);
+	groupLatency_.record(std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - syncStart_).count());
+	syncedBuckets_ = 0;
+}
+
+// invoked by the compressor's threads
+void CompressWriter::completed(Frame* frame)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	frame->done = true;
+	cond_.notify_all();
+}
+// }}}
+
+// {{{ ColumnarWriter impl
+ColumnarWriter::ColumnarWriter(ev::loop_ref loop, const std::string& storagePath, unsigned shard, unsigned shardCount) :
+	Writer(loop, storagePath, shard, shardCount),
+	block_(),
+	index_(),
+	blockStart_(),
+	text_(),
+	output_(),
+	syncedBuckets_(0),
+	syncStart_()
+{
+}
+
+ColumnarWriter::~ColumnarWriter()
+{
+}
+
+void ColumnarWriter::process(Bucket* bucket)
+{
+	processBatch(&bucket, 1);
+}
+
+void ColumnarWriter::processBatch(Bucket** buckets, size_t count)
+{
+	dequeued(buckets, count);
+
+	bool open = rotate();
+
+	for (size_t i = 0; i < count; ++i) {
+		if (open && buckets[i])
+			add(buckets[i]);
+
+		delete buckets[i];
+	}
+
+	if (!open)
+		return;
+
+	if (!block_.empty()) {
+		std::chrono::duration<double> age = std::chrono::steady_clock::now() - blockStart_;
+		if (age.count() >= BlockDelay)
+			writeBlock();
+	}
+
+	if (empty())
+		sync();
+}
+
+void ColumnarWriter::finish()
+{
+	close();
+}
+
+bool ColumnarWriter::rotate()
+{
+	int chunkId = Writer::chunkId();
+	if (fd_ >= 0 && chunkId == currentChunkId_)
+		return true;
+
+	close();
+
+	char filename[PATH_MAX];
+	chunkFileName(chunkId, filename, sizeof(filename), ".kcol");
+
+	fd_ = ::open(filename, O_RDWR | O_CREAT, 0664);
+	if (fd_ < 0) {
+		std::fprintf(stderr, "Could not open log chunk file for writing: %s: %s\n", filename, strerror(errno));
+		return false;
+	}
+
+	struct stat st;
+	size_t size = ::fstat(fd_, &st) == 0 ? st.st_size : 0;
+
+	if (!load(filename, size)) {
+		::close(fd_);
+		fd_ = -1;
+		return false;
+	}
+
+	currentChunkId_ = chunkId;
+
+	DEBUG("ColumnarWriter.rotate: opened %s with %zu blocks\n", filename, index_.blocks().size());
+
+	return true;
+}
+
+/**
+ * Prepares the file for appending blocks, loading its index.
+ */
+bool ColumnarWriter::load(const char* filename, size_t size)
+{
+	index_.clear();
+
+	if (size == 0) {
+		x0::ColumnarFileHeader header;
+		header.magic = x0::ColumnarFileMagic;
+		header.version = x0::ColumnarFileHeader::CurrentVersion;
+		outputOffset_ = 0;
+
+		if (!writeAt(reinterpret_cast<const char*>(&header), sizeof(header), 0))
+			return false;
+
+		outputOffset_ = sizeof(header);
+		return true;
+	}
+
+	x0::ColumnarFileHeader header;
+	if (::pread(fd_, &header, sizeof(header), 0) != sizeof(header) || header.magic != x0::ColumnarFileMagic) {
+		std::fprintf(stderr, "Not a columnar chunk file: %s\n", filename);
+		return false;
+	}
+
+	// the footer, if the file has been closed properly
+	x0::ColumnarTrailer trailer;
+	if (size >= sizeof(header) + sizeof(trailer)
+			&& ::pread(fd_, &trailer, sizeof(trailer), size - sizeof(trailer)) == sizeof(trailer)
+			&& trailer.magic == x0::ColumnarTrailerMagic
+			&& trailer.footerSize <= size - sizeof(header) - sizeof(trailer)
+			&& trailer.footerOffset == size - sizeof(trailer) - trailer.footerSize) {
+		output_.resize(trailer.footerSize);
+		if (::pread(fd_, &output_[0], output_.size(), trailer.footerOffset) == static_cast<ssize_t>(output_.size())
+				&& index_.parse(output_.data(), output_.size(), trailer.footerOffset)) {
+			outputOffset_ = trailer.footerOffset;
+			return ::ftruncate(fd_, outputOffset_) == 0;
+		}
+		index_.clear();
+	}
+
+	// otherwise, re-index its blocks, and cut off anything following the last complete one
+	size_t offset = sizeof(header);
+	std::vector<uint64_t> block; // 8-byte aligned
+
+	while (offset + sizeof(x0::ColumnarBlockHeader) <= size) {
+		x0::ColumnarBlockHeader blockHeader;
+		if (::pread(fd_, &blockHeader, sizeof(blockHeader), offset) != sizeof(blockHeader)
+				|| blockHeader.magic != x0::ColumnarBlockMagic
+				|| blockHeader.size % 8 || blockHeader.size > size - offset)
+			break;
+
+		block.resize(blockHeader.size / 8);
+		char* data = reinterpret_cast<char*>(block.data());
+		if (::pread(fd_, data, blockHeader.size, offset) != static_cast<ssize_t>(blockHeader.size)
+				|| !index_.addBlock(offset, data, blockHeader.size))
+			break;
+
+		offset += blockHeader.size;
+	}
+
+	std::fprintf(stderr, "Recovered %zu blocks of %s, discarding %zu trailing bytes.\n",
+		index_.blocks().size(), filename, size - offset);
+
+	outputOffset_ = offset;
+	return ::ftruncate(fd_, outputOffset_) == 0;
+}
+
+// writes the pending block and the footer
+void ColumnarWriter::close()
+{
+	if (fd_ < 0)
+		return;
+
+	writeBlock();
+
+	index_.serialize(&output_);
+
+	x0::ColumnarTrailer trailer;
+	std::memcpy(&trailer, &output_[output_.size() - sizeof(trailer)], sizeof(trailer));
+	trailer.footerOffset = outputOffset_;
+	std::memcpy(&output_[output_.size() - sizeof(trailer)], &trailer, sizeof(trailer));
+
+	writeAt(output_.data(), output_.size(), outputOffset_);
+	sync();
+
+	::close(fd_);
+	fd_ = -1;
+}
+
+// parses the bucket back into a row: "\n<first_seen>;<key>(;<value>)*"
+void ColumnarWriter::add(Bucket* bucket)
+{
+	text_.clear();
+	readSpill(bucket, &text_);
+
+	if (bucket->head_) {
+		for (x0::ArenaChunk* chunk = bucket->head_; chunk; chunk = chunk->next)
+			text_.append(chunk->data, chunk->size);
+	} else {
+		readStream(bucket, &text_);
+	}
+
+	size_t keySize = bucket->binary_ ? 32 : bucket->id_.size();
+	size_t pos = text_.find(';');
+	if (pos == std::string::npos || text_.size() < pos + 1 + keySize) {
+		std::fprintf(stderr, "Could not parse bucket %s, dropping it.\n", bucket->id().c_str());
+		return;
+	}
+
+	if (block_.empty())
+		blockStart_ = std::chrono::steady_clock::now();
+
+	if (bucket->binary_)
+		block_.add(bucket->createdAt_, &bucket->binaryId_, nullptr, 0);
+	else
+		block_.add(bucket->createdAt_, nullptr, bucket->id_.data(), bucket->id_.size());
+
+	// each value comes with its leading ';'
+	pos += 1 + keySize;
+	while (pos < text_.size()) {
+		size_t end = text_.find(';', pos + 1);
+		if (end == std::string::npos)
+			end = text_.size();
+
+		block_.addValue(text_.data() + pos + 1, end - pos - 1);
+		pos = end;
+	}
+
+	if (block_.rowCount() >= BlockRows || block_.byteSize() >= BlockSize)
+		writeBlock();
+}
+
+void ColumnarWriter::writeBlock()
+{
+	if (block_.empty())
+		return;
+
+	if (!syncedBuckets_)
+		syncStart_ = std::chrono::steady_clock::now();
+
+	x0::ColumnarBlockHeader header;
+	block_.build(&output_, &header);
+
+	if (writeAt(output_.data(), output_.size(), outputOffset_)) {
+		index_.addBlock(outputOffset_, header, block_);
+		outputOffset_ += output_.size();
+		syncedBuckets_ += block_.rowCount();
+	}
+
+	block_.clear();
+}
+
+bool ColumnarWriter::writeAt(const char* data, size_t size, size_t offset)
+{
+	while (size > 0) {
+		ssize_t rv = ::pwrite(fd_, data, size, offset);
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
+
+			perror("pwrite");
+			return false;
+		}
+
+		data += rv;
+		size -= rv;
+		offset += rv;
+	}
+
+	return true;
+}
+
+// syncs the written blocks, if group commit is enabled
+void ColumnarWriter::sync()
+{
+	if (!groupCommit() || !syncedBuckets_)
+		return;
+
+	if (::fdatasync(fd_) < 0)
+		perror("fdatasync");
+
+	groupBuckets_.record(syncedBuckets_);
+	groupLatency_.record(std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - syncStart_).count());
+	syncedBuckets_ = 0;
+}
+// }}}
+
+// {{{ Compactor impl
+Compactor::Compactor(size_t memoryLimit) :
+	x0::Actor<std::string*>(1, 1024),
+	memoryLimit_(memoryLimit),
+	abort_(false),
+	pending_(),
+	files_(0),
+	failures_(0),
+	recordsIn_(0),
+	recordsOut_(0),
+	bytesIn_(0),
+	bytesOut_(0)
+{
+}
+
+void Compactor::process(std::string* filename)
+{
+	if (abort_.load(std::memory_order_relaxed)) {
+		pending_.push_back(*filename);
+		delete filename;
+		return;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	x0::ChunkCompaction compaction(*filename, memoryLimit_, &abort_);
+
+	if (compaction.run()) {
+		std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+		std::printf("Compacted %s: %zu records into %zu, %.2f MiB -> %.2f MiB (%zu runs, %.1f s)\n",
+			filename->c_str(),
+			compaction.recordsIn(),
+			compaction.recordsOut(),
+			compaction.bytesIn() / (1024.0 * 1024.0),
+			compaction.bytesOut() / (1024.0 * 1024.0),
+			compaction.runCount(),
+			duration.count()
+		);
+
+		++files_;
+		recordsIn_ += compaction.recordsIn();
+		recordsOut_ += compaction.recordsOut();
+		bytesIn_ += compaction.bytesIn();
+		bytesOut_ += compaction.bytesOut();
+	} else if (compaction.aborted()) {
+		pending_.push_back(*filename);
+	} else {
+		std::fprintf(stderr, "Could not compact %s, leaving it as is: %s\n", filename->c_str(), compaction.error().c_str());
+		++failures_;
+	}
+
+	delete filename;
+}
+// }}}
+
+// {{{ Worker impl
+/**
+ * Creates a bucket worker.
+ *
+ * @param loop      the coordinator's event loop, used unless @p threaded is set.
+ * @param threaded  whether or not this worker runs its own event loop in its own thread.
+ * @param inboxSize size in bytes of the message ring this worker is fed through
+ *                  by the coordinator thread, if any.
+ */
+Worker::Worker(Server* server, unsigned id, ev::loop_ref loop, bool threaded, size_t inboxSize) :
+	server_(server),
+	id_(id),
+	ownLoop_(threaded ? new ev::dynamic_loop() : nullptr),
+	loop_(ownLoop_ ? static_cast<ev::loop_ref&>(*ownLoop_) : loop),
+	wakeup_(loop_),
+	thread_(),
+	shutdown_(false),
+	inbox_(inboxSize),
+	pending_(false),
+	binaryBuckets_(),
+	buckets_(),
+	arena_(Server::ArenaChunkSize),
+	spill_(),
+	timers_(TickInterval, std::max(server->maxBucketIdle_, server->maxBucketTTL_), ev_now(loop_)),
+	tick_(loop_),
+	lastTick_(0),
+	maxLag_(0),
+	lruHead_(nullptr),
+	lruTail_(nullptr),
+	memoryBudget_(server->maxMemory_),
+	bucketBudget_(std::max<size_t>(server->maxBucketCount_, 1)),
+	bufferedBytes_(0),
+	draining_(false),
+	drainDeadline_(),
+	drainedBuckets_(0),
+	drainedBytes_(0),
+	lostBuckets_(0),
+	lostBytes_(0),
+	bucketCount_(0),
+	messagesProcessed_(0),
+	bucketsKilledMaxSize_(0),
+	bucketsKilledMaxAge_(0),
+	bucketsKilledMaxIdle_(0),
+	bucketsKilledSysError_(0),
+	bucketsEvicted_(0),
+	bucketsSpilled_(0),
+	bucketsKilledShortIdle_(0),
+	droppedMessages_(0),
+	shedMessages_(0),
+	receiveLatency_(),
+	bucketLifetime_()
+{
+	wakeup_.set<Worker, &Worker::onWakeup>(this);
+	tick_.set<Worker, &Worker::onTick>(this);
+}
+
+Worker::~Worker()
+{
+	if (thread_.joinable()) {
+		stop();
+		join();
+	}
+}
+
+void Worker::start()
+{
+	tick_.start(TickInterval, TickInterval);
+
+	if (!threaded())
+		return;
+
+	shutdown_ = false;
+	wakeup_.start();
+	thread_ = std::thread(std::bind(&Worker::main, this));
+}
+
+void Worker::stop()
+{
+	if (!threaded()) {
+		tick_.stop();
+		return;
+	}
+
+	shutdown_ = true;
+	wakeup_.send();
+}
+
+/**
+ * Stops the worker once it handed all its buckets over to the writers, or
+ * the deadline passed, whichever comes first (see drain()).
+ *
+ * A threaded worker drains in its own thread, so that all workers drain in parallel.
+ */
+void Worker::shutdown(const std::chrono::steady_clock::time_point& deadline)
+{
+	if (!threaded()) {
+		tick_.stop();
+		drain(deadline);
+		return;
+	}
+
+	draining_ = true;
+	drainDeadline_ = deadline;
+	shutdown_ = true;
+	wakeup_.send();
+}
+
+void Worker::join()
+{
+	if (thread_.joinable())
+		thread_.join();
+}
+
+void Worker::main()
+{
+	loop_.run(0);
+}
+
+/**
+ * Hands a message over to this worker's thread (coordinator thread only),
+ * prefixed by the time it has been received.
+ *
+ * The worker is not woken up until notify() is invoked, so that a whole batch
+ * of messages costs at most one wakeup.
+ *
+ * @retval false the worker's inbox is full and the message has been dropped.
+ */
+bool Worker::post(const char* buf, size_t size, const std::chrono::steady_clock::time_point& receivedAt)
+{
+	std::chrono::steady_clock::rep stamp = receivedAt.time_since_epoch().count();
+
+	if (!inbox_.push(reinterpret_cast<const char*>(&stamp), sizeof(stamp), buf, size)) {
+		++droppedMessages_;
+		return false;
+	}
+
+	pending_ = true;
+	return true;
+}
+
+void Worker::notify()
+{
+	if (pending_) {
+		pending_ = false;
+		wakeup_.send();
+	}
+}
+
+void Worker::onWakeup(ev::async&, int)
+{
+	time_t now = ev_now(loop_);
+	size_t size;
+
+	while (char* buf = inbox_.front(&size)) {
+		std::chrono::steady_clock::rep stamp;
+		std::memcpy(&stamp, buf, sizeof(stamp));
+
+		process(buf + sizeof(stamp), size - sizeof(stamp), now,
+			std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(stamp)));
+		inbox_.pop();
+	}
+
+	if (shutdown_) {
+		if (draining_)
+			drain(drainDeadline_);
+
+		wakeup_.stop();
+		tick_.stop();
+		loop_.break_loop(ev::ALL);
+	}
+}
+
+// expires the buckets whose deadlines have passed
+void Worker::onTick(ev::timer&, int)
+{
+	ev_tstamp now = ev_now(loop_);
+
+	// how much later than due this tick fired, i.e. how long the loop has been kept busy
+	if (lastTick_) {
+		uint64_t lag = std::max(0.0, now - lastTick_ - TickInterval) * 1000000;
+		uint64_t max = maxLag_.load(std::memory_order_relaxed);
+		while (lag > max && !maxLag_.compare_exchange_weak(max, lag, std::memory_order_relaxed))
+			;
+	}
+	lastTick_ = now;
+
+	timers_.advance(now, [now](x0::TimingWheel::Node* node) {
+		static_cast<Bucket*>(node)->timeout(now);
+	});
+
+	// under overload, the least recently touched buckets are flushed by a shorter idle timeout,
+	// a few per tick, unless the writers are what is overloaded
+	unsigned level = server_->overloadLevel_.load(std::memory_order_relaxed);
+	if (level && !server_->writerBound_.load(std::memory_order_relaxed)) {
+		ev_tstamp idle = server_->idleTimeout(level);
+
+		for (int i = 0; i < MaxShortIdleFlushes && lruTail_ && lruTail_->touchedAt_ + idle <= now; ++i) {
+			++bucketsKilledShortIdle_;
+			lruTail_->flush();
+		}
+	}
+}
+
+/**
+ * Processes a single datagram of the form "KEY;VALUE", NUL-terminated at buf[size].
+ *
+ * @retval true  the value has been appended to its bucket.
+ * @retval false the message has been dropped or was malformed.
+ */
+bool Worker::process(char* buf, size_t size, time_t now, const std::chrono::steady_clock::time_point& receivedAt)
+{
+	char* p = strchr(buf, ';');
+	if (!p)
+		return false;
+
+	size_t keysize = p - buf;
+	size_t valsize = size - keysize;
+	x0::Key128 binaryId;
+
+	bool pushed = x0::KeyCodec<x0::Key128>::decode(buf, keysize, &binaryId)
+		? push(binaryBuckets_, binaryId, buf, keysize, p, valsize)
+		: push(buckets_, x0::StringKey(buf, keysize), buf, keysize, p, valsize);
+
+	if (!pushed)
+		return false;
+
+	++messagesProcessed_;
+	receiveLatency_.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - receivedAt).count());
+
+	while (bufferedBytes_.load(std::memory_order_relaxed) > memoryBudget_ && evict(server_->spillSize_ != 0))
+		;
+
+	return true;
+}
+
+template<typename Key>
+bool Worker::push(x0::FlatIndex<Key, Bucket>& index, const Key& key,
+	const char* id, size_t idsize, const char* value, size_t valsize)
+{
+	uint64_t hash = index.hash(key);
+
+	if (Bucket* bucket = index.find(key, hash)) {
+		// bucket found -> append value to existing bucket
+		touch(bucket);
+		bucket->push_back(value, valsize);
+		return true;
+	}
+
+	// Bucket doesn't exist yet -> shed it under overload, keeping the existing ones fed.
+	unsigned level = server_->overloadLevel_.load(std::memory_order_relaxed);
+	if (level && !Server::admit(hash, level)) {
+		++shedMessages_;
+		return false;
+	}
+
+	// make room for it among the buckets this worker holds, rather than dropping the
+	// message; the ones handed over to the writers do not count, see Bucket::Bucket()
+	while (heldBuckets() >= bucketBudget_ && evict())
+		;
+
+	// create new bucket and push value into it
+	Bucket* bucket = new Bucket(this, id, idsize, binaryId(key));
+	if (!bucket->healthy()) {
+		delete bucket;
+		++droppedMessages_;
+		return false;
+	}
+
+	bucket->hash_ = hash;
+	index.insert(indexKey(bucket, key), hash, bucket);
+	touch(bucket);
+	bucket->push_back(value, valsize);
+	return true;
+}
+
+void Worker::flush(Bucket* bucket)
+{
+	detach(bucket);
+	server_->writer(bucket)->push_back(bucket);
+}
+
+// removes the bucket from this worker's bookkeeping, right before handing it over to its writer
+void Worker::detach(Bucket* bucket)
+{
+	unlink(bucket);
+	account(-static_cast<ssize_t>(bucket->streamSize_));
+
+	Bucket* erased = bucket->binary_
+		? binaryBuckets_.erase(bucket->binaryId_, bucket->hash_)
+		: buckets_.erase(indexKey(bucket, x0::StringKey()), bucket->hash_);
+
+	if (!erased)
+		std::fprintf(stderr, "Requested a flush of a bucket that is not (anymore) in the worker's bucket set.\n");
+
+	bucket->queuedSize_ = bucket->size();
+	server_->queuedBytes_ += bucket->queuedSize_;
+
+	bucket->flushedAt_ = std::chrono::steady_clock::now();
+	bucketLifetime_.record(std::max(0.0, ev_now(loop_) - bucket->createdAt_) * 1000);
+}
+
+/**
+ * Hands all buckets over to their writers (on shutdown), least recently touched first.
+ *
+ * Rather than blocking on a full writer queue, waits for room no longer than
+ * until the deadline. The buckets left by then are given up on and counted as
+ * lost, as the process is about to exit anyway. This keeps shutdown bounded
+ * no matter how many buckets are live, at the cost of the most recent ones.
+ */
+void Worker::drain(const std::chrono::steady_clock::time_point& deadline)
+{
+	while (Bucket* bucket = lruTail_) {
+		size_t size = bucket->size();
+		Writer* writer = server_->writer(bucket);
+
+		timers_.cancel(bucket);
+		detach(bucket);
+
+		while (!writer->trySend(bucket)) {
+			if (std::chrono::steady_clock::now() >= deadline) {
+				server_->queuedBytes_ -= size;
+				++lostBuckets_;
+				lostBytes_ += size;
+
+				for (Bucket* left = lruTail_; left != nullptr; left = left->lruPrev_) {
+					++lostBuckets_;
+					lostBytes_ += left->size();
+				}
+				return;
+			}
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+
+		++drainedBuckets_;
+		drainedBytes_ += size;
+	}
+}
+
+/**
+ * Recreates a bucket of a previous process, from its key, timestamps and
+ * the values it had buffered (each including its leading ';').
+ *
+ * Must be invoked before the worker is started.
+ */
+bool Worker::restore(const char* id, size_t idsize, ev_tstamp createdAt, ev_tstamp touchedAt, size_t itemCount,
+	const char* values, size_t valsize)
+{
+	x0::Key128 binaryId;
+
+	return x0::KeyCodec<x0::Key128>::decode(id, idsize, &binaryId)
+		? restore(binaryBuckets_, binaryId, id, idsize, createdAt, touchedAt, itemCount, values, valsize)
+		: restore(buckets_, x0::StringKey(id, idsize), id, idsize, createdAt, touchedAt, itemCount, values, valsize);
+}
+
+template<typename Key>
+bool Worker::restore(x0::FlatIndex<Key, Bucket>& index, const Key& key, const char* id, size_t idsize,
+	ev_tstamp createdAt, ev_tstamp touchedAt, size_t itemCount, const char* values, size_t valsize)
+{
+	uint64_t hash = index.hash(key);
+
+	Bucket* bucket = new Bucket(this, id, idsize, binaryId(key), createdAt);
+	if (!bucket->healthy() || !bucket->append(values, valsize)) {
+		delete bucket;
+		return false;
+	}
+
+	bucket->itemCount_ = itemCount;
+	bucket->touchedAt_ = touchedAt;
+	bucket->hash_ = hash;
+	timers_.schedule(bucket, bucket->deadline()); // expires on the next tick, if overdue
+
+	index.insert(indexKey(bucket, key), hash, bucket);
+	touch(bucket);
+	return true;
+}
+
+// adjusts the number of bytes held by this worker's buckets (worker thread only)
+void Worker::account(ssize_t bytes)
+{
+	bufferedBytes_.store(bufferedBytes_.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+}
+
+// marks the bucket as the most recently touched one
+void Worker::touch(Bucket* bucket)
+{
+	if (bucket == lruHead_)
+		return;
+
+	unlink(bucket);
+
+	bucket->lruNext_ = lruHead_;
+	if (lruHead_)
+		lruHead_->lruPrev_ = bucket;
+	else
+		lruTail_ = bucket;
+
+	lruHead_ = bucket;
+}
+
+void Worker::unlink(Bucket* bucket)
+{
+	if (bucket->lruPrev_)
+		bucket->lruPrev_->lruNext_ = bucket->lruNext_;
+	else if (bucket == lruHead_)
+		lruHead_ = bucket->lruNext_;
+	else
+		return; // not linked
+
+	if (bucket->lruNext_)
+		bucket->lruNext_->lruPrev_ = bucket->lruPrev_;
+	else
+		lruTail_ = bucket->lruPrev_;
+
+	bucket->lruPrev_ = bucket->lruNext_ = nullptr;
+}
+
+/**
+ * Flushes a bucket ahead of its time to make room, namely the largest one of
+ * the EvictionSamples least recently touched buckets.
+ *
+ * @param spill whether to rather move the bucket's contents to the spill
+ *              file, keeping the bucket, as long as it holds any in memory.
+ *
+ * @retval false this worker has no bucket to evict.
+ */
+bool Worker::evict(bool spill)
+{
+	Bucket* victim = lruTail_;
+	if (!victim)
+		return false;
+
+	Bucket* bucket = victim->lruPrev_;
+	for (int i = 1; i < EvictionSamples && bucket; ++i, bucket = bucket->lruPrev_)
+		if (bucket->streamSize_ > victim->streamSize_)
+			victim = bucket;
+
+	if (spill && victim->streamSize_ > 0 && victim->spill())
+		return true;
+
+	DEBUG("Bucket[%s].evict (%zu bytes)\n", victim->id().c_str(), victim->streamSize_);
+	++bucketsEvicted_;
+	victim->flush();
+	return true;
+}
+// }}}
+
+// {{{ Listener impl
+Listener::Listener(Server* server, ev::loop_ref loop, Worker* worker) :
+	server_(server),
+	worker_(worker),
+	loop_(loop),
+	fd_(-1),
+	io_(loop),
+	inode_(0),
+	batchSize_(1),
+	recvBuffer_(),
+	recvControl_(),
+	recvVectors_(),
+	recvMessages_(),
+	shard_(server->listeners_.size()),
+	kernelDrops_(0),
+	sampledDrops_(0)
+{
+	io_.set<Listener, &Listener::incoming>(this);
+}
+
+Listener::~Listener()
+{
+	close();
+}
+
+/**
+ * Starts receiving datagrams from the given (bound) socket.
+ *
+ * Must be invoked before the thread running this listener's loop is started.
+ */
+void Listener::open(int fd, size_t batchSize)
+{
+	fd_ = fd;
+	batchSize_ = batchSize;
+
+	struct stat st;
+	if (fstat(fd_, &st) == 0)
+		inode_ = st.st_ino;
+
+	// an adopted socket may have dropped datagrams already
+	kernelDrops_ = Server::readProcDrops({inode_});
+	sampledDrops_ = kernelDrops_;
+
+	if (int size = server_->receiveBufferSize_) {
+		// beyond net.core.rmem_max only with CAP_NET_ADMIN
+		if (setsockopt(fd_, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0 &&
+				setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+			perror("setsockopt(SO_RCVBUF)");
+	}
+
+	// have the kernel's drop counter passed along with each datagram
+	int on = 1;
+	if (setsockopt(fd_, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0)
+		perror("setsockopt(SO_RXQ_OVFL)");
+
+	if (batchSize_ > 1) {
+		// one receive slot per message, +1 byte each for the terminating NUL
+		recvBuffer_.resize(batchSize_ * (Server::MaxMessageSize + 1));
+		recvControl_.resize(batchSize_ * ControlSize);
+		recvVectors_.resize(batchSize_);
+		recvMessages_.resize(batchSize_);
+
+		for (size_t i = 0; i < batchSize_; ++i) {
+			recvVectors_[i].iov_base = &recvBuffer_[i * (Server::MaxMessageSize + 1)];
+			recvVectors_[i].iov_len = Server::MaxMessageSize;
+
+			memset(&recvMessages_[i], 0, sizeof(recvMessages_[i]));
+			recvMessages_[i].msg_hdr.msg_iov = &recvVectors_[i];
+			recvMessages_[i].msg_hdr.msg_iovlen = 1;
+			recvMessages_[i].msg_hdr.msg_control = &recvControl_[i * ControlSize];
+			recvMessages_[i].msg_hdr.msg_controllen = ControlSize;
+		}
+	}
+
+	io_.set(fd_, ev::READ);
+	io_.start();
+}
+
+void Listener::close()
+{
+	if (fd_ < 0)
+		return;
+
+	io_.stop();
+	::close(fd_);
+	fd_ = -1;
+}
+
+/**
+ * Stops receiving, and hands over the socket rather than closing it.
+ */
+int Listener::release()
+{
+	int fd = fd_;
+
+	if (fd_ >= 0) {
+		io_.stop();
+		fd_ = -1;
+	}
+
+	return fd;
+}
+
+void Listener::incoming(ev::io& io, int)
+{
+	time_t now = ev_now(loop_);
+
+	if (batchSize_ > 1) {
+		incomingBatch(now);
+		return;
+	}
+
+	char buf[Server::MaxMessageSize + 1];
+	char control[ControlSize];
+
+	iovec vec;
+	vec.iov_base = buf;
+	vec.iov_len = Server::MaxMessageSize;
+
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &vec;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	int rv = recvmsg(io.fd, &msg, 0);
+	if (rv > 0) {
+		server_->receiveCalls_.add(shard_, 1);
+		server_->datagramsReceived_.add(shard_, 1);
+		readDrops(&msg);
+		buf[rv] = '\0';
+		process(buf, rv, now, std::chrono::steady_clock::now());
+		notifyWorkers();
+	}
+}
+
+/**
+ * Picks up the socket's drop counter, which the kernel only passes along
+ * once it has dropped anything.
+ */
+void Listener::readDrops(msghdr* msg)
+{
+	for (cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+			uint32_t drops;
+			memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+			kernelDrops_.store(drops, std::memory_order_relaxed);
+		}
+	}
+}
+
+/**
+ * Drains up to batchSize_ datagrams from the listener socket with a single
+ * recvmmsg() call, and keeps doing so until the socket would block.
+ */
+void Listener::incomingBatch(time_t now)
+{
+	for (;;) {
+		int count = recvmmsg(fd_, &recvMessages_[0], batchSize_, MSG_DONTWAIT, nullptr);
+		if (count <= 0) {
+			if (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				perror("recvmmsg");
+			return;
+		}
+
+		server_->receiveCalls_.add(shard_, 1);
+		server_->datagramsReceived_.add(shard_, count);
+		auto receivedAt = std::chrono::steady_clock::now();
+
+		// the counter is cumulative, so the last message tells it all
+		readDrops(&recvMessages_[count - 1].msg_hdr);
+
+		for (int i = 0; i < count; ++i) {
+			char* buf = static_cast<char*>(recvVectors_[i].iov_base);
+			size_t size = recvMessages_[i].msg_len;
+
+			// the kernel has shortened it to what it filled in
+			recvMessages_[i].msg_hdr.msg_controllen = ControlSize;
+
+			if (size > 0) {
+				buf[size] = '\0';
+				process(buf, size, now, receivedAt);
+			}
+		}
+
+		notifyWorkers();
+
+		if (static_cast<size_t>(count) < batchSize_)
+			return;
+	}
+}
+
+// FNV-1a, used to route keys to workers
+static inline size_t hashKey(const char* key, size_t size)
+{
+	uint64_t hash = 14695981039346656037ull;
+
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= static_cast<unsigned char>(key[i]);
+		hash *= 1099511628211ull;
+	}
+
+	return hash;
+}
+
+/**
+ * Passes a single datagram of the form "KEY;VALUE", NUL-terminated at buf[size],
+ * to this listener's worker, or routes it to the worker owning the key space of KEY.
+ */
+void Listener::process(char* buf, size_t size, time_t now, const std::chrono::steady_clock::time_point& receivedAt)
+{
+	server_->bytesRead_.add(shard_, size);
+
+	Worker* worker = worker_;
+	if (!worker) {
+		const std::vector<Worker*>& workers = server_->workers_;
+		worker = workers[0];
+		if (workers.size() > 1) {
+			const char* p = static_cast<const char*>(memchr(buf, ';', size));
+			if (p) {
+				worker = workers[hashKey(buf, p - buf) % workers.size()];
+			}
+		}
+	}
+
+	bool accepted = worker == worker_ || !worker->threaded()
+		? worker->process(buf, size, now, receivedAt)
+		: worker->post(buf, size, receivedAt);
+
+	if (accepted) {
+		server_->bytesProcessed_.add(shard_, size);
+		server_->messagesProcessed_.add(shard_, 1);
+	}
+}
+
+void Listener::notifyWorkers()
+{
+	if (worker_)
+		return;
+
+	for (auto worker: server_->workers_) {
+		worker->notify();
+	}
+}
+// }}}
+
+// {{{ Server impl
+Server::Server(ev::loop_ref loop) :
+	address_("0.0.0.0"),
+	port_(2323),
+	argv_(nullptr),
+	notify_(false),
+	loop_(loop),
+	statsTimer_(loop),
+	writerTimer_(loop),
+	loadTimer_(loop),
+	usr1Signal_(loop),
+	usr2Signal_(loop),
+	termSignal_(loop),
+	intSignal_(loop),
+	listeners_(),
+	workers_(),
+	listenerCount_(1),
+	workerCount_(0),
+	batchSize_(1),
+	storage_(PipeStorage),
+	storagePath_("/var/tmp"),
+	writerCount_(1),
+	output_(SyncOutput),
+	format_(CsvFormat),
+	groupCommitSize_(0),
+	groupCommitDelay_(10),
+	compression_(x0::Codec::None),
+	compressionLevel_(0),
+	compressionThreads_(2),
+	compressor_(nullptr),
+	compactMemory_(0),
+	compactor_(nullptr),
+	writers_(),
+	bytesRead_(),
+	bytesProcessed_(),
+	messagesProcessed_(),
+	receiveCalls_(),
+	datagramsReceived_(),
+	lastStatus_(0),
+	kernelDrops_(),
+	totalKernelDrops_(0),
+	procDrops_(0),
+	receiveBufferSize_(0),
+	maxBucketCount_((1024 - 7) / 2),
+	maxBucketSize_(50),
+	maxBucketIdle_(10),
+	maxBucketTTL_(60),
+	maxMemory_(256 * 1024 * 1024),
+	spillSize_(32 * 1024),
+	overloadLag_(100),
+	overloadLevel_(0),
+	writerBound_(false),
+	lastLoadCheck_(0),
+	loadLag_(0),
+	loadQueue_(0),
+	loadBacklog_(0),
+	overloadChecks_(0),
+	calmChecks_(0),
+	peakLevel_(0),
+	overloadStart_(0),
+	drainTimeout_(10),
+	draining_(false),
+	drainStart_(),
+	drainDeadline_(),
+	bucketCount_(0),
+	pipeCount_(0),
+	queuedBytes_(0)
+{
+	usr1Signal_.set<Server, &Server::logStats>(this);
+	usr1Signal_.start(SIGUSR1);
+	loop_.unref();
+
+	usr2Signal_.set<Server, &Server::upgrade>(this);
+	usr2Signal_.start(SIGUSR2);
+	loop_.unref();
+
+	termSignal_.set<Server, &Server::sigterm>(this);
+	termSignal_.start(SIGTERM);
+	loop_.unref();
+
+	intSignal_.set<Server, &Server::sigterm>(this);
+	intSignal_.start(SIGINT);
+	loop_.unref();
+}
+
+Server::~Server()
+{
+	if (intSignal_.is_active()) {
+		loop_.ref();
+		intSignal_.stop();
+	}
+
+	if (termSignal_.is_active()) {
+		loop_.ref();
+		termSignal_.stop();
+	}
+
+	if (usr1Signal_.is_active()) {
+		loop_.ref();
+		usr1Signal_.stop();
+	}
+
+	if (usr2Signal_.is_active()) {
+		loop_.ref();
+		usr2Signal_.stop();
+	}
+
+	if (!listeners_.empty()) {
+		stop();
+	}
+
+	for (auto worker: workers_)
+		delete worker;
+
+	for (auto writer: writers_)
+		delete writer;
+
+	delete compressor_;
+	delete compactor_;
+}
+
+/**
+ * Waits for the writers to write all buckets handed over to them.
+ *
+ * On shutdown (see stop()), waits no longer than until the drain deadline,
+ * and exits the process right away if it passes.
+ */
+void Server::join()
+{
+	for (auto writer: writers_) {
+		if (!draining_) {
+			writer->join();
+		} else if (!writer->join(drainDeadline_)) {
+			reportDrain(false);
+			std::fflush(nullptr);
+			std::_Exit(EXIT_FAILURE);
+		}
+	}
+
+	for (auto writer: writers_)
+		writer->finish();
+
+	// the writers are done, and so are all the frames they waited for
+	if (compressor_) {
+		compressor_->stop();
+		compressor_->join();
+	}
+
+	if (draining_)
+		reportDrain(true);
+
+	// compacts what the writers handed over until now, which may take a while,
+	// unless aborted on shutdown or upgrade
+	if (compactor_) {
+		compactor_->stop();
+		compactor_->join();
+
+		if (draining_) {
+			for (const std::string& filename: compactor_->pending())
+				std::printf("Not compacting %s, as shutting down.\n", filename.c_str());
+		}
+	}
+}
+
+bool Server::setup(int argc, char* argv[])
+{
+	argv_ = argv;
+	bool bucketCountSet = false;
+
+	static const struct option long_options[] = {
+		{ "help", no_argument, NULL, 'h' },
+		{ "port", required_argument, NULL, 'p' },
+		{ "address", required_argument, NULL, 'a' },
+		{ "storage-path", required_argument, NULL, 's' },
+		{ "max-bucket-count", required_argument, NULL, 'c' },
+		{ "max-bucket-size", required_argument, NULL, 'n' },
+		{ "max-bucket-idle", required_argument, NULL, 'i' },
+		{ "max-bucket-ttl", required_argument, NULL, 't' },
+		{ "batch-size", required_argument, NULL, 'b' },
+		{ "workers", required_argument, NULL, 'w' },
+		{ "listeners", required_argument, NULL, 'l' },
+		{ "storage", required_argument, NULL, 'm' },
+		{ "max-memory", required_argument, NULL, 'M' },
+		{ "writers", required_argument, NULL, 'W' },
+		{ "group-commit", required_argument, NULL, 'g' },
+		{ "group-commit-delay", required_argument, NULL, 'G' },
+		{ "output", required_argument, NULL, 'o' },
+		{ "compress", required_argument, NULL, 'z' },
+		{ "compress-threads", required_argument, NULL, 'Z' },
+		{ "format", required_argument, NULL, 'f' },
+		{ "compact", required_argument, NULL, 'C' },
+		{ "drain-timeout", required_argument, NULL, 'D' },
+		{ "spill", required_argument, NULL, 'S' },
+		{ "overload-lag", required_argument, NULL, 'O' },
+		{ "receive-buffer", required_argument, NULL, 'R' },
+		{ 0, 0, 0, 0 }
+	};
+
+	for (;;) {
+		int long_index = 0;
+		switch (getopt_long(argc, argv, "?hp:a:s:c:n:i:t:b:w:l:m:M:W:g:G:o:z:Z:f:C:D:S:O:R:", long_options, &long_index)) {
+			case '?':
+			case 'h':
+				printHelp(argv[0]);
+				return false;
+			case 'p':
+				port_ = std::atoi(optarg);
+				break;
+			case 'a':
+				address_ = optarg;
+				break;
+			case 's':
+				storagePath_ = optarg;
+				break;
+			case 'c':
+				maxBucketCount_ = atoi(optarg);
+				bucketCountSet = true;
+				break;
+			case 'n':
+				maxBucketSize_ = atoi(optarg);
+				break;
+			case 'i':
+				maxBucketIdle_ = atoi(optarg);
+				break;
+			case 't':
+				maxBucketTTL_ = atoi(optarg);
+				break;
+			case 'b':
+				batchSize_ = std::max(1, std::min(atoi(optarg), static_cast<int>(MaxBatchSize)));
+				break;
+			case 'w':
+				workerCount_ = std::max(0, atoi(optarg));
+				break;
+			case 'l':
+				listenerCount_ = std::max(1, atoi(optarg));
+				break;
+			case 'm':
+				if (strcmp(optarg, "pipe") == 0)
+					storage_ = PipeStorage;
+				else if (strcmp(optarg, "arena") == 0)
+					storage_ = ArenaStorage;
+				else {
+					std::fprintf(stderr, "Unknown storage mode: %s\n", optarg);
+					return false;
+				}
+				break;
+			case 'M':
+				if (!parseSize(optarg, &maxMemory_) || maxMemory_ == 0) {
+					std::fprintf(stderr, "Invalid memory limit: %s\n", optarg);
+					return false;
+				}
+				break;
+			case 'W':
+				writerCount_ = std::max(1, atoi(optarg));
+				break;
+			case 'g':
+				if (!parseSize(optarg, &groupCommitSize_)) {
+					std::fprintf(stderr, "Invalid group commit size: %s\n", optarg);
+					return false;
+				}
+				break;
+			case 'G':
+				groupCommitDelay_ = std::max(0, atoi(optarg));
+				break;
+			case 'o':
+				if (strcmp(optarg, "sync") == 0)
+					output_ = SyncOutput;
+				else if (strcmp(optarg, "uring") == 0)
+					output_ = UringOutput;
+				else if (strcmp(optarg, "direct") == 0)
+					output_ = DirectOutput;
+				else {
+					std::fprintf(stderr, "Unknown output mode: %s\n", optarg);
+					return false;
+				}
+				break;
+			case 'z':
+				if (!x0::Codec::parse(optarg, &compression_, &compressionLevel_)) {
+					std::fprintf(stderr, "Unknown compression: %s\n", optarg);
+					return false;
+				}
+				if (!x0::Codec::available(compression_)) {
+					std::fprintf(stderr, "Compression not available in this build: %s\n", x0::Codec::name(compression_));
+					return false;
+				}
+				break;
+			case 'Z':
+				compressionThreads_ = std::max(1, atoi(optarg));
+				break;
+			case 'f':
+				if (strcmp(optarg, "csv") == 0)
+					format_ = CsvFormat;
+				else if (strcmp(optarg, "columnar") == 0)
+					format_ = ColumnarFormat;
+				else {
+					std::fprintf(stderr, "Unknown file format: %s\n", optarg);
+					return false;
+				}
+				break;
+			case 'C':
+				if (!parseSize(optarg, &compactMemory_)) {
+					std::fprintf(stderr, "Invalid compaction memory: %s\n", optarg);
+					return false;
+				}
+				break;
+			case 'D':
+				drainTimeout_ = std::max(0, atoi(optarg));
+				break;
+			case 'S':
+				if (!parseSize(optarg, &spillSize_)) {
+					std::fprintf(stderr, "Invalid spill size: %s\n", optarg);
+					return false;
+				}
+				break;
+			case 'O':
+				overloadLag_ = std::max(0, atoi(optarg));
+				break;
+			case 'R':
+				if (!parseSize(optarg, &receiveBufferSize_)) {
+					std::fprintf(stderr, "Invalid receive buffer size: %s\n", optarg);
+					return false;
+				}
+				receiveBufferSize_ = std::min<size_t>(receiveBufferSize_, INT_MAX / 2);
+				break;
+			case 0:
+				// long option with (val != NULL && flag == 0)
+				break;
+			case -1:
+				// EOF - everything parsed
+				// arena-stored buckets take a chunk each at least, and no file descriptors
+				if (storage_ == ArenaStorage && !bucketCountSet)
+					maxBucketCount_ = maxMemory_ / ArenaChunkSize;
+
+				return start(port_, address_.c_str());
+				break;
+			default:
+				return false;
+		}
+	}
+}
+
+bool Server::start(int port, const char* address)
+{
+	// sockets handed over on upgrade, or else passed by systemd, rather than bound here
+	std::vector<int> adopted = inheritedSockets();
+	const bool upgraded = !adopted.empty();
+	if (!upgraded)
+		adopted = activatedSockets();
+
+	if (listenerCount_ > 1 && adopted.size() > listenerCount_) {
+		std::fprintf(stderr, "Starting %zu listeners, one per socket passed in.\n", adopted.size());
+		listenerCount_ = adopted.size();
+	}
+
+	const bool reusePort = listenerCount_ > 1;
+	const size_t threadCount = reusePort ? listenerCount_ : workerCount_;
+
+	// verify file descriptor limit
+	// each thread's event loop costs another two (epoll + eventfd), each extra listener its socket,
+	// each extra writer its output file, each pipe-stored bucket two (reader and writer),
+	// compaction the chunk file, its merged runs and the result, each worker its spill file
+	size_t core_fd_count = 7 + threadCount * 2 + (listenerCount_ - 1) + (writerCount_ - 1)
+		+ (compactMemory_ ? x0::ChunkCompaction::MaxFanIn + 2 : 0)
+		+ (spillSize_ ? std::max<size_t>(threadCount, 1) : 0);
+	size_t bucket_fd_count = storage_ == PipeStorage ? 2 : 0;
+	size_t required_fd_count = core_fd_count + maxBucketCount_ * bucket_fd_count;
+	rlimit rlim;
+	rlim.rlim_cur = rlim.rlim_max = required_fd_count;
+
+	if (setrlimit(RLIMIT_NOFILE, &rlim) < 0) {
+		perror("setrlimit");
+	}
+
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0) {
+		if (required_fd_count > rlim.rlim_cur && bucket_fd_count) {
+			size_t adjusted_value = (rlim.rlim_cur - core_fd_count) / bucket_fd_count;
+			std::fprintf(stderr,
+				"Not enough file descriptors available to this process (%ld). "
+				"Would require %ld file descriptors for %ld buckets. Adjusting maximum bucket count to %ld.\n",
+				rlim.rlim_cur, required_fd_count, maxBucketCount_, adjusted_value);
+			maxBucketCount_ = adjusted_value;
+		}
+	}
+
+	if (format_ == ColumnarFormat) {
+		if (output_ != SyncOutput || compression_ != x0::Codec::None) {
+			std::fprintf(stderr, "Ignoring --output and --compress, as columnar files are written with blocking writes.\n");
+			output_ = SyncOutput;
+			compression_ = x0::Codec::None;
+		}
+	}
+
+	if (compression_ != x0::Codec::None) {
+		if (output_ != SyncOutput) {
+			std::fprintf(stderr, "Ignoring --output, as compressed frames are written with blocking writes.\n");
+			output_ = SyncOutput;
+		}
+
+		compressor_ = new Compressor(compressionThreads_, compression_, compressionLevel_);
+		compressor_->start();
+	}
+
+	if (compactMemory_) {
+		if (format_ != CsvFormat || compressor_) {
+			std::fprintf(stderr, "Ignoring --compact, as only uncompressed CSV chunk files get compacted.\n");
+			compactMemory_ = 0;
+		} else {
+			compactor_ = new Compactor(compactMemory_);
+			compactor_->start();
+		}
+	}
+
+	resumeCompactions();
+
+	// writers go first, as workers start flushing right away
+	for (size_t i = 0; i < writerCount_; ++i) {
+		Writer* writer = nullptr;
+
+		if (format_ == ColumnarFormat) {
+			writer = new ColumnarWriter(loop_, storagePath_, i, writerCount_);
+		} else if (compressor_) {
+			writer = new CompressWriter(loop_, storagePath_, i, writerCount_, compressor_);
+		} else if (output_ == UringOutput) {
+			UringWriter* uring = new UringWriter(loop_, storagePath_, i, writerCount_);
+			if (uring->ready()) {
+				writer = uring;
+			} else {
+				std::fprintf(stderr, "Could not set up io_uring, falling back to blocking writes: %s\n",
+					strerror(uring->error()));
+				delete uring;
+				output_ = SyncOutput;
+			}
+		} else if (output_ == DirectOutput) {
+			DirectWriter* direct = new DirectWriter(loop_, storagePath_, i, writerCount_);
+			if (direct->ready()) {
+				writer = direct;
+			} else {
+				std::fprintf(stderr, "Could not allocate direct I/O buffers, falling back to blocking writes: %s\n",
+					strerror(direct->error()));
+				delete direct;
+				output_ = SyncOutput;
+			}
+		}
+
+		if (!writer)
+			writer = new Writer(loop_, storagePath_, i, writerCount_);
+
+		writers_.push_back(writer);
+		writers_.back()->setGroupCommit(groupCommitSize_, groupCommitDelay_ / 1000.0);
+		writers_.back()->setCompactor(compactor_);
+		writers_.back()->start();
+	}
+
+	if (!adopted.empty()) {
+		std::printf("Listening on %zu sockets %s, ignoring --address and --port.\n",
+			adopted.size(), upgraded ? "of the previous process" : "passed by systemd");
+	}
+
+	if (reusePort) {
+		if (workerCount_ > 0) {
+			std::fprintf(stderr, "Ignoring --workers, as each of the %zu listeners manages its own buckets.\n",
+				listenerCount_);
+		}
+
+		// the n-th bound socket is the n-th member of the SO_REUSEPORT group,
+		// which is the index the steering filter selects sockets by
+		// (sockets of the previous process have the filter attached already)
+		for (size_t i = 0; i < listenerCount_; ++i) {
+			int fd = i < adopted.size() ? adopted[i] : createSocket(port, address, true);
+			if (fd < 0)
+				return false;
+
+			if (i == 0 && !upgraded && !attachSteeringFilter(fd, listenerCount_)) {
+				::close(fd);
+				return false;
+			}
+
+			Worker* worker = new Worker(this, i, loop_, true);
+			worker->setMemoryBudget(maxMemory_ / listenerCount_);
+			worker->setBucketBudget(maxBucketCount_ / listenerCount_);
+			workers_.push_back(worker);
+
+			Listener* listener = new Listener(this, worker->loop(), worker);
+			listeners_.push_back(listener);
+			listener->open(fd, batchSize_);
+		}
+	} else {
+		if (adopted.empty()) {
+			int fd = createSocket(port, address, false);
+			if (fd < 0)
+				return false;
+			adopted.push_back(fd);
+		}
+
+		if (workerCount_ == 0) {
+			workers_.push_back(new Worker(this, 0, loop_, false));
+		} else {
+			for (size_t i = 0; i < workerCount_; ++i) {
+				workers_.push_back(new Worker(this, i, loop_, true, WorkerInboxSize));
+				workers_.back()->setMemoryBudget(maxMemory_ / workerCount_);
+				workers_.back()->setBucketBudget(maxBucketCount_ / workerCount_);
+			}
+		}
+
+		// one listener per socket, all of them routing to the same workers
+		for (int fd: adopted) {
+			Listener* listener = new Listener(this, loop_, nullptr);
+			listeners_.push_back(listener);
+			listener->open(fd, batchSize_);
+		}
+	}
+
+	// nothing is received before the event loops run
+	bytesRead_.resize(listeners_.size());
+	bytesProcessed_.resize(listeners_.size());
+	messagesProcessed_.resize(listeners_.size());
+	receiveCalls_.resize(listeners_.size());
+	datagramsReceived_.resize(listeners_.size());
+
+	for (auto listener: listeners_)
+		totalKernelDrops_ += listener->kernelDrops_.load();
+	procDrops_ = totalKernelDrops_;
+
+	int receiveBuffer = 0;
+	socklen_t optlen = sizeof(receiveBuffer);
+	if (getsockopt(listeners_.front()->handle(), SOL_SOCKET, SO_RCVBUF, &receiveBuffer, &optlen) == 0) {
+		// the kernel doubles what was asked for, to account for its bookkeeping
+		std::printf("Receive buffer: %.2f MiB per socket, %zu datagrams dropped so far\n",
+			receiveBuffer / (1024.0 * 1024.0), totalKernelDrops_);
+	}
+
+	// nothing gets received before the workers are started
+	restoreState();
+
+	for (auto worker: workers_) {
+		worker->start();
+	}
+
+	notify_ = getenv("NOTIFY_SOCKET") != nullptr;
+	if (notify_) {
+		// keeps the sockets, and what they receive, across restarts; passed back via sd_listen_fds()
+		std::vector<int> fds;
+		for (auto listener: listeners_)
+			fds.push_back(listener->handle());
+
+		int rv = sd_notify_with_fds(0, "FDSTORE=1\nFDNAME=udp", &fds[0], fds.size());
+		if (rv < 0)
+			std::fprintf(stderr, "Could not store the sockets with systemd: %s\n", strerror(-rv));
+
+		sd_notifyf(0, "READY=1\nSTATUS=Listening on %zu sockets", listeners_.size());
+	}
+
+	statsTimer_.set<Server, &Server::sampleStats>(this);
+	statsTimer_.start(SampleInterval, SampleInterval);
+
+	if (compressor_ || format_ == ColumnarFormat) {
+		writerTimer_.set<Server, &Server::tickWriters>(this);
+		writerTimer_.start(0.25, 0.25);
+	}
+
+	if (overloadLag_) {
+		loadTimer_.set<Server, &Server::checkLoad>(this);
+		loadTimer_.start(LoadCheckInterval, LoadCheckInterval);
+	}
+
+	return true;
+}
+
+// wakes up idle writers, so they get to write out frames or blocks that waited long enough
+void Server::tickWriters(ev::timer&, int)
+{
+	for (auto writer: writers_)
+		writer->trySend(nullptr);
+}
+
+/**
+ * Overload controller, raising the overload level by one step per check
+ * that finds the server overloaded, and lowering it by one step per second
+ * it has been back to normal.
+ *
+ * The server is considered overloaded once any event loop lags behind by
+ * overloadLag_, or any receive or writer queue is more than half full, and
+ * back to normal once all of them are at no more than half of that.
+ * Each level admits half as many new keys as the one before (see admit()),
+ * and halves the idle timeout (see idleTimeout()), so that the kernel does
+ * not have to drop datagrams at random. The idle timeout is left as is while
+ * a writer queue is more than half full, though.
+ */
+void Server::checkLoad(ev::timer&, int)
+{
+	ev_tstamp now = ev_now(loop_);
+
+	// the workers' ticks see their own loops, this timer the main loop
+	double lag = lastLoadCheck_ ? std::max(0.0, now - lastLoadCheck_ - LoadCheckInterval) * 1000 : 0;
+	lastLoadCheck_ = now;
+
+	for (auto worker: workers_)
+		lag = std::max(lag, worker->maxLag_.exchange(0, std::memory_order_relaxed) / 1000.0);
+
+	double queue = 0;
+	for (auto listener: listeners_)
+		queue = std::max(queue, receiveQueueFill(listener->handle()));
+
+	double backlog = 0;
+	for (auto writer: writers_)
+		backlog = std::max(backlog, static_cast<double>(writer->size()) / writer->capacity());
+
+	loadLag_ = lag;
+	loadQueue_ = queue;
+	loadBacklog_ = backlog;
+
+	// flushing buckets sooner would only add to what the writers are behind on
+	writerBound_.store(backlog > 0.5, std::memory_order_relaxed);
+
+	unsigned level = overloadLevel_.load(std::memory_order_relaxed);
+
+	if (lag >= overloadLag_ || queue > 0.5 || backlog > 0.5) {
+		++overloadChecks_;
+		calmChecks_ = 0;
+
+		if (level == 0) {
+			overloadStart_ = now;
+			std::printf("Overloaded (lag: %.1f ms, receive queue: %.0f%%, writer queue: %.0f%%), "
+				"shedding new keys%s\n",
+				lag, queue * 100, backlog * 100, backlog > 0.5 ? "" : " and shortening the idle timeout");
+		}
+
+		if (level < MaxOverloadLevel)
+			overloadLevel_.store(++level, std::memory_order_relaxed);
+
+		peakLevel_ = std::max(peakLevel_, level);
+	} else if (level > 0 && lag < overloadLag_ / 2.0 && queue <= 0.25 && backlog <= 0.25) {
+		if (++calmChecks_ < 1 / LoadCheckInterval)
+			return;
+
+		calmChecks_ = 0;
+		overloadLevel_.store(--level, std::memory_order_relaxed);
+
+		if (level == 0) {
+			std::printf("Load back to normal after %.1f s, at overload level %u at most\n",
+				now - overloadStart_, peakLevel_);
+			peakLevel_ = 0;
+		}
+	} else {
+		calmChecks_ = 0;
+	}
+}
+
+/**
+ * Retrieves how full the socket's receive queue is, from 0 to 1.
+ *
+ * SIOCINQ only tells the size of the next datagram for UDP sockets, so
+ * this compares the memory held by all of them against the buffer size.
+ */
+double Server::receiveQueueFill(int fd)
+{
+#ifdef SO_MEMINFO
+	uint32_t meminfo[SK_MEMINFO_VARS];
+	socklen_t size = sizeof(meminfo);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo, &size) == 0 && meminfo[SK_MEMINFO_RCVBUF])
+		return static_cast<double>(meminfo[SK_MEMINFO_RMEM_ALLOC]) / meminfo[SK_MEMINFO_RCVBUF];
+#endif
+
+	return 0;
+}
+
+/**
+ * Decides whether a new key gets a bucket at the given overload level.
+ *
+ * The decision depends on the key's hash only, so an admitted key stays
+ * admitted, and each level admits a subset of the keys of the one below.
+ */
+bool Server::admit(uint64_t hash, unsigned level)
+{
+	if (level >= MaxOverloadLevel)
+		return false;
+
+	// high bits, independent of the ones picking the slot in the bucket index
+	return ((hash >> 48) & ((1u << level) - 1)) == 0;
+}
+
+// the idle timeout, halved per overload level, but no less than a second
+ev_tstamp Server::idleTimeout(unsigned level) const
+{
+	return std::max(1.0, static_cast<double>(maxBucketIdle_) / (1u << level));
+}
+
+/**
+ * Retrieves the writer responsible for the given bucket.
+ *
+ * Buckets are assigned by their key's hash, so that all buckets of a key
+ * end up in the same files.
+ */
+Writer* Server::writer(const Bucket* bucket) const
+{
+	return writers_[(bucket->hash_ >> 32) % writers_.size()];
+}
+
+int Server::createSocket(int port, const char* address, bool reusePort)
+{
+	int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	if (reusePort) {
+		int on = 1;
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+			perror("setsockopt(SO_REUSEPORT)");
+			::close(fd);
+			return -1;
+		}
+	}
+
+	struct sockaddr_in sin;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+
+	int rv = inet_pton(AF_INET, address, &sin.sin_addr.s_addr);
+	if (rv == 0) {
+		std::cerr << "Listener address [" << address << "] not in representation format." << std::endl;
+		::close(fd);
+		return -1;
+	} else if (rv < 0) {
+		perror("inet_pton");
+		::close(fd);
+		return -1;
+	}
+
+	if (bind(fd, (sockaddr*)&sin, sizeof(sin)) < 0) {
+		perror("bind");
+		::close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * Attaches a classic BPF program to the SO_REUSEPORT group of the given socket
+ * that picks the group's socket by the FNV-1a hash of the key prefix (up to
+ * SteeringPrefixSize bytes, or up to the first ';'), so that all messages of
+ * one key always land on the same socket.
+ */
+bool Server::attachSteeringFilter(int fd, unsigned count)
+{
+#if defined(SO_ATTACH_REUSEPORT_CBPF)
+	std::vector<sock_filter> code;
+
+	// M[0] = FNV-1a offset basis
+	code.push_back((sock_filter) BPF_STMT(BPF_LD | BPF_IMM, 2166136261u));
+	code.push_back((sock_filter) BPF_STMT(BPF_ST, 0));
+
+	// unrolled, as classic BPF knows no backward jumps
+	for (unsigned i = 0; i < SteeringPrefixSize; ++i) {
+		const uint8_t skip = 5 + 7 * (SteeringPrefixSize - 1 - i); // jump target: "done" below
+
+		code.push_back((sock_filter) BPF_STMT(BPF_LD | BPF_B | BPF_ABS, i));       // A = payload[i]
+		code.push_back((sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ';', skip, 0));
+		code.push_back((sock_filter) BPF_STMT(BPF_MISC | BPF_TAX, 0));             // X = A
+		code.push_back((sock_filter) BPF_STMT(BPF_LD | BPF_MEM, 0));               // A = M[0]
+		code.push_back((sock_filter) BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0));      // A ^= X
+		code.push_back((sock_filter) BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 16777619)); // A *= FNV prime
+		code.push_back((sock_filter) BPF_STMT(BPF_ST, 0));                         // M[0] = A
+	}
+
+	// done: return M[0] % count
+	code.push_back((sock_filter) BPF_STMT(BPF_LD | BPF_MEM, 0));
+	code.push_back((sock_filter) BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count));
+	code.push_back((sock_filter) BPF_STMT(BPF_RET | BPF_A, 0));
+
+	struct sock_fprog prog;
+	prog.len = code.size();
+	prog.filter = &code[0];
+
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+		perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+		return false;
+	}
+
+	return true;
+#else
+	std::fprintf(stderr, "SO_ATTACH_REUSEPORT_CBPF is not supported, cannot steer keys across listeners.\n");
+	return false;
+#endif
+}
+
+// feeds the rates with what the listeners received since the last tick
+void Server::sampleStats(ev::timer&, int)
+{
+	ev_tstamp now = ev_now(loop_);
+
+	bytesRead_.sample(now);
+	bytesProcessed_.sample(now);
+	messagesProcessed_.sample(now);
+	receiveCalls_.sample(now);
+	datagramsReceived_.sample(now);
+
+	size_t kernelDrops = 0;
+	std::vector<ino_t> inodes;
+
+	// each socket's counter is 32 bits wide, and wraps around on its own
+	for (auto listener: listeners_) {
+		uint32_t drops = listener->kernelDrops_.load(std::memory_order_relaxed);
+		kernelDrops += static_cast<uint32_t>(drops - listener->sampledDrops_);
+		listener->sampledDrops_ = drops;
+		inodes.push_back(listener->inode_);
+	}
+
+	kernelDrops_.update(now, kernelDrops);
+	totalKernelDrops_ += kernelDrops;
+
+	if (now - lastStatus_ < 1.0)
+		return;
+
+	lastStatus_ = now;
+
+	// the kernel's view, which also covers the time since the last datagram received
+	procDrops_ = readProcDrops(inodes);
+
+	if (notify_) {
+		sd_notifyf(0, "STATUS=%zu msg/s, %.2f Mbit/s, %zu buckets",
+			messagesProcessed_.average(),
+			bytesRead_.average() / (1024.0 * 1024.0 / 8.0),
+			bucketCount_.load());
+	}
+}
+
+/**
+ * Sums up the drop counters of the given UDP sockets, as listed in
+ * /proc/net/udp and /proc/net/udp6.
+ */
+size_t Server::readProcDrops(const std::vector<ino_t>& inodes)
+{
+	size_t drops = 0;
+
+	for (const char* path: {"/proc/net/udp", "/proc/net/udp6"}) {
+		FILE* fp = fopen(path, "re");
+		if (!fp)
+			continue;
+
+		char line[512];
+		if (!fgets(line, sizeof(line), fp)) { // header
+			fclose(fp);
+			continue;
+		}
+
+		while (fgets(line, sizeof(line), fp)) {
+			// sl local rem st tx:rx tr:when retrnsmt uid timeout inode ref pointer drops
+			unsigned long inode = 0;
+			unsigned long count = 0;
+			if (sscanf(line, "%*s %*s %*s %*s %*s %*s %*s %*s %*s %lu %*s %*s %lu", &inode, &count) != 2)
+				continue;
+
+			if (std::find(inodes.begin(), inodes.end(), static_cast<ino_t>(inode)) != inodes.end())
+				drops += count;
+		}
+
+		fclose(fp);
+	}
+
+	return drops;
+}
+
+void Server::sigterm(ev::sig&, int)
+{
+	std::printf("Shutting down\n");
+
+	if (notify_)
+		sd_notify(0, "STOPPING=1");
+
+	stop();
+
+	if (intSignal_.is_active()) {
+		loop_.ref();
+		intSignal_.stop();
+	}
+
+	if (termSignal_.is_active()) {
+		loop_.ref();
+		termSignal_.stop();
+	}
+}
+
+void Server::logStats(ev::sig&, int)
+{
+	ev_tstamp now = ev_now(loop_);
+	bytesRead_.sample(now);
+	bytesProcessed_.sample(now);
+	messagesProcessed_.sample(now);
+	receiveCalls_.sample(now);
+	datagramsReceived_.sample(now);
+	kernelDrops_.update(now, 0);
+
+	size_t calls = receiveCalls_.average();
+	size_t dropped = 0;
+	size_t killedMaxIdle = 0;
+	size_t killedMaxAge = 0;
+	size_t killedMaxSize = 0;
+	size_t killedSysError = 0;
+	size_t evicted = 0;
+	size_t spilled = 0;
+	size_t spillHeld = 0;
+	size_t shed = 0;
+	size_t killedShortIdle = 0;
+	size_t buffered = 0;
+	size_t arenaInUse = 0;
+	size_t arenaReserved = 0;
+
+	for (auto worker: workers_) {
+		arenaInUse += worker->arena_.bytesInUse();
+		arenaReserved += worker->arena_.bytesReserved();
+		dropped += worker->droppedMessages_;
+		killedMaxIdle += worker->bucketsKilledMaxIdle_;
+		killedMaxAge += worker->bucketsKilledMaxAge_;
+		killedMaxSize += worker->bucketsKilledMaxSize_;
+		killedSysError += worker->bucketsKilledSysError_;
+		evicted += worker->bucketsEvicted_;
+		spilled += worker->bucketsSpilled_;
+		spillHeld += worker->spill_.bytesHeld();
+		shed += worker->shedMessages_;
+		killedShortIdle += worker->bucketsKilledShortIdle_;
+		buffered += worker->bufferedBytes_;
+	}
+
+	std::printf(
+		"dropped: %ld, active: %ld, k/idle: %ld, k/ttl: %ld, k/size: %ld, k/syserr: %ld, k/evict: %ld, "
+		"buffered: %.2f MiB, bt/s: %.2f, bp/s: %.2f, m/s: %lu, batch: %zu, m/recv: %.2f",
+		dropped,
+		bucketCount_.load(),
+		killedMaxIdle,
+		killedMaxAge,
+		killedMaxSize,
+		killedSysError,
+		evicted,
+		buffered / (1024.0 * 1024.0),
+		bytesRead_.average() / (1024.0f * 1024.0f / 8.0f),
+		bytesProcessed_.average() / (1024.0f * 1024.0f / 8.0f),
+		messagesProcessed_.average(),
+		batchSize_,
+		calls ? static_cast<double>(datagramsReceived_.average()) / calls : 0.0
+	);
+
+	std::printf(", kd/s: %zu, k/drops: %zu (proc: %zu)",
+		kernelDrops_.average(),
+		totalKernelDrops_,
+		procDrops_);
+
+	// pipe-stored buckets fall back to the arena once all pipes are taken
+	if (storage_ == ArenaStorage || arenaReserved) {
+		std::printf(", arena: %.2f/%.2f MiB",
+			arenaInUse / (1024.0 * 1024.0),
+			arenaReserved / (1024.0 * 1024.0));
+	}
+
+	if (spillSize_) {
+		std::printf(", spills: %zu, spilled: %.2f MiB", spilled, spillHeld / (1024.0 * 1024.0));
+	}
+
+	if (overloadLag_) {
+		std::printf(", load: %u (lag: %.1f ms, rq: %.0f%%, wq: %.0f%%, overloaded: %zu), shed: %zu, k/shortidle: %zu",
+			overloadLevel_.load(),
+			loadLag_,
+			loadQueue_ * 100,
+			loadBacklog_ * 100,
+			overloadChecks_,
+			shed,
+			killedShortIdle);
+	}
+
+	std::printf("\n");
+
+	typedef x0::MultiWindowCounter<size_t> Rates;
+	std::printf("  rates: m/s: %zu/%zu/%zu/%zu, bt/s: %.2f/%.2f/%.2f/%.2f, kd/s: %zu/%zu/%zu/%zu (1s/10s/1m/15m)\n",
+		messagesProcessed_.average(Rates::OneSecond),
+		messagesProcessed_.average(Rates::TenSeconds),
+		messagesProcessed_.average(Rates::OneMinute),
+		messagesProcessed_.average(Rates::FifteenMinutes),
+		bytesRead_.average(Rates::OneSecond) / (1024.0 * 1024.0 / 8.0),
+		bytesRead_.average(Rates::TenSeconds) / (1024.0 * 1024.0 / 8.0),
+		bytesRead_.average(Rates::OneMinute) / (1024.0 * 1024.0 / 8.0),
+		bytesRead_.average(Rates::FifteenMinutes) / (1024.0 * 1024.0 / 8.0),
+		kernelDrops_.average(Rates::OneSecond),
+		kernelDrops_.average(Rates::TenSeconds),
+		kernelDrops_.average(Rates::OneMinute),
+		kernelDrops_.average(Rates::FifteenMinutes));
+
+	// each thread records its own, so they are combined here
+	x0::HdrHistogram receiveLatency;
+	x0::HdrHistogram dequeueLatency;
+	x0::HdrHistogram spliceDuration;
+	x0::HdrHistogram bucketLifetime;
+
+	for (auto worker: workers_) {
+		receiveLatency.merge(worker->receiveLatency_);
+		bucketLifetime.merge(worker->bucketLifetime_);
+	}
+
+	for (auto writer: writers_) {
+		dequeueLatency.merge(writer->dequeueLatency());
+		spliceDuration.merge(writer->spliceDuration());
+	}
+
+	std::printf("  latency: receive->push: %.1f/%.1f/%.1f/%.1f us, flush->dequeue: %.1f/%.1f/%.1f/%.1f us",
+		receiveLatency.percentile(50) / 1000.0,
+		receiveLatency.percentile(99) / 1000.0,
+		receiveLatency.percentile(99.9) / 1000.0,
+		receiveLatency.max() / 1000.0,
+		dequeueLatency.percentile(50) / 1000.0,
+		dequeueLatency.percentile(99) / 1000.0,
+		dequeueLatency.percentile(99.9) / 1000.0,
+		dequeueLatency.max() / 1000.0
+	);
+
+	if (spliceDuration.count()) {
+		std::printf(", splice: %.1f/%.1f/%.1f/%.1f us",
+			spliceDuration.percentile(50) / 1000.0,
+			spliceDuration.percentile(99) / 1000.0,
+			spliceDuration.percentile(99.9) / 1000.0,
+			spliceDuration.max() / 1000.0
+		);
+	}
+
+	std::printf(" (p50/p99/p999/max)\n");
+
+	std::printf("  bucket lifetime: %.3f/%.3f/%.3f/%.3f s (p50/p99/p999/max), buckets: %lu\n",
+		bucketLifetime.percentile(50) / 1000.0,
+		bucketLifetime.percentile(99) / 1000.0,
+		bucketLifetime.percentile(99.9) / 1000.0,
+		bucketLifetime.max() / 1000.0,
+		bucketLifetime.count()
+	);
+
+	for (auto writer: writers_) {
+		x0::ActorStats stats = writer->stats();
+		std::printf("  writer %u: queued: %zu, batches: %zu, enqueue: %.2f/%.2f us (avg/max), wakeups: %zu, stalls: %zu\n",
+			writer->shard(),
+			stats.depth,
+			stats.batches,
+			stats.enqueued ? stats.enqueueNanos / 1000.0 / stats.enqueued : 0.0,
+			stats.maxEnqueueNanos / 1000.0,
+			stats.wakeups,
+			stats.stalls
+		);
+
+		if (compressor_) {
+			const CompressWriter* compressing = static_cast<const CompressWriter*>(writer);
+			size_t in = compressing->bytesIn();
+			size_t out = compressing->bytesOut();
+			std::printf("    compressed: %.2f MiB -> %.2f MiB (%.1fx)\n",
+				in / (1024.0 * 1024.0),
+				out / (1024.0 * 1024.0),
+				out ? static_cast<double>(in) / out : 0.0
+			);
+		}
+
+		if (writer->groupCommit()) {
+			const x0::Histogram& buckets = writer->groupBuckets();
+			const x0::Histogram& latency = writer->groupLatency();
+			std::printf("    groups: %lu, buckets: %.1f/%lu/%lu/%lu, latency: %.0f/%lu/%lu/%lu us (avg/p50/p99/max)\n",
+				buckets.count(),
+				buckets.mean(),
+				buckets.percentile(50),
+				buckets.percentile(99),
+				buckets.max(),
+				latency.mean(),
+				latency.percentile(50),
+				latency.percentile(99),
+				latency.max()
+			);
+		}
+	}
+
+	if (compactor_) {
+		std::printf("  compaction: queued: %zu, files: %zu, failed: %zu, records: %zu -> %zu, %.2f MiB -> %.2f MiB\n",
+			compactor_->stats().depth,
+			compactor_->files(),
+			compactor_->failures(),
+			compactor_->recordsIn(),
+			compactor_->recordsOut(),
+			compactor_->bytesIn() / (1024.0 * 1024.0),
+			compactor_->bytesOut() / (1024.0 * 1024.0)
+		);
+	}
+
+	if (workers_.size() > 1 || workers_[0]->threaded()) {
+		for (auto worker: workers_) {
+			std::printf(
+				"  worker %u: dropped: %ld, active: %ld, queued: %zu, messages: %zu, "
+				"k/idle: %ld, k/ttl: %ld, k/size: %ld, k/syserr: %ld, k/evict: %ld\n",
+				worker->id(),
+				worker->droppedMessages_.load(),
+				worker->bucketCount_.load(),
+				worker->inbox_.size(),
+				worker->messagesProcessed_.load(),
+				worker->bucketsKilledMaxIdle_.load(),
+				worker->bucketsKilledMaxAge_.load(),
+				worker->bucketsKilledMaxSize_.load(),
+				worker->bucketsKilledSysError_.load(),
+				worker->bucketsEvicted_.load()
+			);
+		}
+	}
+}
+
+/**
+ * Replaces this process by a (new) kollektd binary, without losing data.
+ *
+ * Receiving stops, all live buckets and the counters get serialized into a
+ * memfd, and the writers finish everything flushed before. The UDP sockets
+ * and the memfd are then passed across execve() (see inheritedSockets() and
+ * restoreState()), while datagrams queue up in the sockets' receive buffers.
+ *
+ * The binary executed is the one at the path this process was started from,
+ * i.e. a new one installed in its place, or else the running one.
+ */
+void Server::upgrade(ev::sig&, int)
+{
+	if (listeners_.empty())
+		return;
+
+	// a replaced binary reads as "<path> (deleted)"
+	char executable[PATH_MAX];
+	const char* deleted = " (deleted)";
+	ssize_t n = readlink("/proc/self/exe", executable, sizeof(executable) - 1);
+	executable[n > 0 ? n : 0] = '\0';
+	if (n > static_cast<ssize_t>(strlen(deleted)) && strcmp(executable + n - strlen(deleted), deleted) == 0)
+		executable[n - strlen(deleted)] = '\0';
+
+	if (n <= 0 || access(executable, X_OK) < 0)
+		strcpy(executable, "/proc/self/exe");
+
+	int state = memfd_create("kollektd-state", 0);
+	if (state < 0) {
+		perror("memfd_create");
+		std::fprintf(stderr, "Not upgrading.\n");
+		return;
+	}
+
+	std::printf("Upgrading to %s\n", executable);
+
+	// the new process reports READY=1 once it took over
+	if (notify_)
+		sd_notifyf(0, "RELOADING=1\nSTATUS=Upgrading to %s", executable);
+	auto start = std::chrono::steady_clock::now();
+
+	statsTimer_.stop();
+	writerTimer_.stop();
+	loadTimer_.stop();
+
+	for (auto worker: workers_)
+		worker->stop();
+
+	for (auto worker: workers_)
+		worker->join();
+
+	// the listeners' counters are saved along with the buckets
+	std::vector<int> sockets;
+	for (auto listener: listeners_)
+		sockets.push_back(listener->release());
+
+	size_t bucketCount = 0;
+	size_t bytes = 0;
+	if (!saveState(state, &bucketCount, &bytes)) {
+		std::fprintf(stderr, "Could not save the buckets, dropping %zu of them: %s\n",
+			bucketCount_.load(), strerror(errno));
+		::close(state);
+		state = -1;
+	}
+
+	for (auto listener: listeners_)
+		delete listener;
+
+	listeners_.clear();
+
+	for (auto writer: writers_)
+		writer->stop();
+
+	// the new process takes over what is left to compact
+	if (compactor_)
+		compactor_->abort();
+
+	join();
+
+	if (compactor_ && state >= 0 && !saveCompactions(state)) {
+		std::fprintf(stderr, "Could not hand over the chunk files to compact, leaving them as they are: %s\n",
+			strerror(errno));
+	}
+
+	std::chrono::duration<double, std::milli> duration = std::chrono::steady_clock::now() - start;
+	std::printf("Handing over %zu buckets (%.2f MiB) and %zu sockets, after %.1f ms\n",
+		bucketCount, bytes / (1024.0 * 1024.0), sockets.size(), duration.count());
+
+	// everything but the sockets and the state gets closed by execve()
+	if (DIR* dir = opendir("/proc/self/fd")) {
+		while (dirent* entry = readdir(dir)) {
+			int fd = std::atoi(entry->d_name);
+			if (fd > 2 && fd != dirfd(dir) && fd != state && std::find(sockets.begin(), sockets.end(), fd) == sockets.end())
+				fcntl(fd, F_SETFD, FD_CLOEXEC);
+		}
+		closedir(dir);
+	}
+
+	std::string fds;
+	for (int fd: sockets) {
+		fcntl(fd, F_SETFD, 0);
+		fds += (fds.empty() ? "" : ",") + std::to_string(fd);
+	}
+
+	setenv("KOLLEKTD_UPGRADE_SOCKETS", fds.c_str(), 1);
+	if (state >= 0)
+		setenv("KOLLEKTD_UPGRADE_STATE", std::to_string(state).c_str(), 1);
+	else
+		unsetenv("KOLLEKTD_UPGRADE_STATE");
+
+	// the signal mask survives execve(), too
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigprocmask(SIG_SETMASK, &signals, nullptr);
+
+	std::fflush(nullptr);
+
+	execv(executable, argv_);
+	perror("execv");
+	execv("/proc/self/exe", argv_);
+	perror("execv");
+
+	std::fprintf(stderr, "Could not upgrade, exiting.\n");
+	std::exit(EXIT_FAILURE);
+}
+
+// writes all of the data, or fails with errno set
+static bool writeAll(int fd, const char* data, size_t size)
+{
+	while (size > 0) {
+		ssize_t rv = ::write(fd, data, size);
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += rv;
+		size -= rv;
+	}
+
+	return true;
+}
+
+/**
+ * Serializes all live buckets and the counters into the given file (see
+ * UpgradeHeader), once the workers and listeners have been stopped.
+ *
+ * The buckets themselves are left as they are; a pipe-stored bucket's
+ * contents are consumed, though.
+ */
+bool Server::saveState(int fd, size_t* bucketCount, size_t* bytes)
+{
+	std::string buffer;
+	std::string contents;
+
+	UpgradeHeader header;
+	header.magic = UpgradeHeader::Magic;
+	header.version = UpgradeHeader::CurrentVersion;
+	header.workerCount = workers_.size();
+	header.listenerCount = listeners_.size();
+	header.bucketCount = bucketCount_.load();
+	buffer.append(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	for (auto worker: workers_) {
+		UpgradeWorker w;
+		w.messagesProcessed = worker->messagesProcessed_;
+		w.bucketsKilledMaxSize = worker->bucketsKilledMaxSize_;
+		w.bucketsKilledMaxAge = worker->bucketsKilledMaxAge_;
+		w.bucketsKilledMaxIdle = worker->bucketsKilledMaxIdle_;
+		w.bucketsKilledSysError = worker->bucketsKilledSysError_;
+		w.bucketsEvicted = worker->bucketsEvicted_;
+		w.droppedMessages = worker->droppedMessages_;
+		buffer.append(reinterpret_cast<const char*>(&w), sizeof(w));
+	}
+
+	for (auto listener: listeners_) {
+		UpgradeListener l;
+		l.bytesRead = bytesRead_.value(listener->shard_);
+		l.bytesProcessed = bytesProcessed_.value(listener->shard_);
+		l.messagesProcessed = messagesProcessed_.value(listener->shard_);
+		l.receiveCalls = receiveCalls_.value(listener->shard_);
+		buffer.append(reinterpret_cast<const char*>(&l), sizeof(l));
+	}
+
+	*bucketCount = 0;
+	*bytes = 0;
+
+	for (auto worker: workers_) {
+		// least recently touched first, so that restoring them rebuilds the LRU order
+		for (Bucket* bucket = worker->lruTail_; bucket; bucket = bucket->lruPrev_) {
+			contents.clear();
+			Writer::readSpill(bucket, &contents);
+
+			if (bucket->head_) {
+				for (x0::ArenaChunk* chunk = bucket->head_; chunk; chunk = chunk->next)
+					contents.append(chunk->data, chunk->size);
+			} else {
+				Writer::readStream(bucket, &contents);
+			}
+
+			// skip the "\n<first_seen>;<key>" prefix, recreated on restore
+			std::string key = bucket->id();
+			char prefix[64];
+			size_t prefixSize = snprintf(prefix, sizeof(prefix), "\n%f;", bucket->createdAt_) + key.size();
+			if (contents.size() < prefixSize)
+				continue;
+
+			UpgradeBucket b;
+			b.worker = worker->id();
+			b.keySize = key.size();
+			b.createdAt = bucket->createdAt_;
+			b.touchedAt = bucket->touchedAt_;
+			b.itemCount = bucket->itemCount_;
+			b.valuesSize = contents.size() - prefixSize;
+
+			buffer.append(reinterpret_cast<const char*>(&b), sizeof(b));
+			buffer.append(key);
+			buffer.append(contents, prefixSize, std::string::npos);
+
+			++*bucketCount;
+			*bytes += b.valuesSize;
+
+			if (buffer.size() >= 1024 * 1024) {
+				if (!writeAll(fd, buffer.data(), buffer.size()))
+					return false;
+				buffer.clear();
+			}
+		}
+	}
+
+	if (!writeAll(fd, buffer.data(), buffer.size()))
+		return false;
+
+	// the actual number of buckets, as some may have been unreadable
+	header.bucketCount = *bucketCount;
+	return pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+}
+
+/**
+ * Appends the chunk files the compactor has been aborted on to the state
+ * saved by saveState(), once the compactor has been joined.
+ */
+bool Server::saveCompactions(int fd)
+{
+	std::string buffer;
+
+	for (const std::string& filename: compactor_->pending()) {
+		uint32_t size = filename.size();
+		buffer.append(reinterpret_cast<const char*>(&size), sizeof(size));
+		buffer.append(filename);
+	}
+
+	return lseek(fd, 0, SEEK_END) >= 0 && writeAll(fd, buffer.data(), buffer.size());
+}
+
+/**
+ * Recreates the buckets and counters handed over by the previous process on
+ * upgrade, if any.
+ *
+ * Must be invoked once the workers and listeners have been created, but
+ * before the workers are started.
+ */
+void Server::restoreState()
+{
+	const char* value = getenv("KOLLEKTD_UPGRADE_STATE");
+	if (!value)
+		return;
+
+	int fd = std::atoi(value);
+	unsetenv("KOLLEKTD_UPGRADE_STATE");
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < static_cast<off_t>(sizeof(UpgradeHeader))) {
+		std::fprintf(stderr, "Could not read the state handed over on upgrade.\n");
+		::close(fd);
+		return;
+	}
+
+	size_t size = st.st_size;
+	void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (data == MAP_FAILED) {
+		perror("mmap");
+		return;
+	}
+
+	const char* p = static_cast<const char*>(data);
+	const char* end = p + size;
+
+	UpgradeHeader header;
+	std::memcpy(&header, p, sizeof(header));
+	p += sizeof(header);
+
+	if (header.magic != UpgradeHeader::Magic || header.version != UpgradeHeader::CurrentVersion ||
+			static_cast<size_t>(end - p) < header.workerCount * sizeof(UpgradeWorker) + header.listenerCount * sizeof(UpgradeListener)) {
+		std::fprintf(stderr, "Ignoring the state handed over on upgrade, as its format is unknown.\n");
+		munmap(data, size);
+		return;
+	}
+
+	for (size_t i = 0; i < header.workerCount; ++i, p += sizeof(UpgradeWorker)) {
+		UpgradeWorker w;
+		std::memcpy(&w, p, sizeof(w));
+
+		Worker* worker = workers_[i % workers_.size()];
+		worker->messagesProcessed_ += w.messagesProcessed;
+		worker->bucketsKilledMaxSize_ += w.bucketsKilledMaxSize;
+		worker->bucketsKilledMaxAge_ += w.bucketsKilledMaxAge;
+		worker->bucketsKilledMaxIdle_ += w.bucketsKilledMaxIdle;
+		worker->bucketsKilledSysError_ += w.bucketsKilledSysError;
+		worker->bucketsEvicted_ += w.bucketsEvicted;
+		worker->droppedMessages_ += w.droppedMessages;
+	}
+
+	for (size_t i = 0; i < header.listenerCount; ++i, p += sizeof(UpgradeListener)) {
+		UpgradeListener l;
+		std::memcpy(&l, p, sizeof(l));
+
+		// carried over, rather than counted as received within the first second
+		unsigned shard = listeners_[i % listeners_.size()]->shard_;
+		bytesRead_.carry(shard, l.bytesRead);
+		bytesProcessed_.carry(shard, l.bytesProcessed);
+		messagesProcessed_.carry(shard, l.messagesProcessed);
+		receiveCalls_.carry(shard, l.receiveCalls);
+	}
+
+	size_t restored = 0;
+	size_t bytes = 0;
+	uint64_t i = 0;
+
+	for (; i < header.bucketCount; ++i) {
+		UpgradeBucket b;
+		if (static_cast<size_t>(end - p) < sizeof(b))
+			break;
+		std::memcpy(&b, p, sizeof(b));
+		p += sizeof(b);
+
+		if (static_cast<size_t>(end - p) < b.keySize + b.valuesSize)
+			break;
+
+		const char* key = p;
+		const char* values = key + b.keySize;
+		p = values + b.valuesSize;
+
+		// keys are routed by their hash unless each listener has its own worker
+		Worker* worker = listenerCount_ > 1
+			? workers_[b.worker % workers_.size()]
+			: workers_[hashKey(key, b.keySize) % workers_.size()];
+
+		if (worker->restore(key, b.keySize, b.createdAt, b.touchedAt, b.itemCount, values, b.valuesSize)) {
+			++restored;
+			bytes += b.valuesSize;
+		}
+	}
+
+	// the chunk files still to be compacted follow the buckets, if all of them were there
+	size_t compactions = 0;
+	while (i == header.bucketCount && static_cast<size_t>(end - p) >= sizeof(uint32_t)) {
+		uint32_t n;
+		std::memcpy(&n, p, sizeof(n));
+		p += sizeof(n);
+
+		if (static_cast<size_t>(end - p) < n)
+			break;
+
+		if (compactor_) {
+			compactor_->send(new std::string(p, n));
+			++compactions;
+		}
+		p += n;
+	}
+
+	munmap(data, size);
+
+	if (compactions)
+		std::printf("Resuming the compaction of %zu chunk files of the previous process\n", compactions);
+
+	std::printf("Resumed %zu buckets (%.2f MiB) of the previous process", restored, bytes / (1024.0 * 1024.0));
+	if (restored < header.bucketCount)
+		std::printf(", lost %zu", static_cast<size_t>(header.bucketCount - restored));
+	std::printf("\n");
+}
+
+/**
+ * Removes the temporary files of compactions that got interrupted, e.g. by a
+ * crash, and compacts their chunk files over again, if compacting at all.
+ *
+ * The current chunk's file is left to its writer, which appends to it.
+ */
+void Server::resumeCompactions()
+{
+	DIR* dir = opendir(storagePath_.c_str());
+	if (!dir)
+		return;
+
+	std::vector<std::string> chunks;
+	std::string chunk;
+
+	while (dirent* entry = readdir(dir)) {
+		if (!std::isdigit(static_cast<unsigned char>(entry->d_name[0])))
+			continue;
+
+		std::string path = storagePath_ + "/" + entry->d_name;
+		if (!x0::ChunkCompaction::isTemporary(path, &chunk))
+			continue;
+
+		std::printf("Removing %s, left over from an interrupted compaction.\n", path.c_str());
+		::unlink(path.c_str());
+
+		if (compactor_ && std::atoi(entry->d_name) != Writer::chunkId() && access(chunk.c_str(), F_OK) == 0 &&
+				std::find(chunks.begin(), chunks.end(), chunk) == chunks.end())
+			chunks.push_back(chunk);
+	}
+
+	closedir(dir);
+
+	for (const std::string& path: chunks) {
+		std::printf("Compacting %s over again.\n", path.c_str());
+		compactor_->send(new std::string(path));
+	}
+}
+
+/**
+ * Retrieves the UDP sockets handed over by the previous process on upgrade,
+ * in the order of its listeners.
+ */
+std::vector<int> Server::inheritedSockets()
+{
+	std::vector<int> sockets;
+
+	const char* value = getenv("KOLLEKTD_UPGRADE_SOCKETS");
+	if (!value)
+		return sockets;
+
+	for (const char* p = value; *p; ) {
+		char* end = nullptr;
+		long fd = std::strtol(p, &end, 10);
+		if (end == p)
+			break;
+		sockets.push_back(fd);
+		p = *end == ',' ? end + 1 : end;
+	}
+
+	unsetenv("KOLLEKTD_UPGRADE_SOCKETS");
+	return sockets;
+}
+
+/**
+ * Retrieves the UDP sockets passed by systemd, by socket activation or from
+ * its file descriptor store.
+ */
+std::vector<int> Server::activatedSockets()
+{
+	std::vector<int> sockets;
+	std::vector<std::pair<dev_t, ino_t>> seen;
+
+	int count = sd_listen_fds(1);
+	if (count < 0) {
+		std::fprintf(stderr, "Could not retrieve the sockets passed by systemd: %s\n", strerror(-count));
+		return sockets;
+	}
+
+	for (int fd = SD_LISTEN_FDS_START; fd < SD_LISTEN_FDS_START + count; ++fd) {
+		struct stat st;
+		if (sd_is_socket(fd, AF_UNSPEC, SOCK_DGRAM, -1) <= 0 || fstat(fd, &st) < 0) {
+			std::fprintf(stderr, "Ignoring file descriptor %d passed by systemd, as it is no datagram socket.\n", fd);
+			continue;
+		}
+
+		// a socket unit's socket also comes back from the store, once stored
+		std::pair<dev_t, ino_t> id(st.st_dev, st.st_ino);
+		if (std::find(seen.begin(), seen.end(), id) != seen.end()) {
+			::close(fd);
+			continue;
+		}
+
+		seen.push_back(id);
+		sockets.push_back(fd);
+	}
+
+	return sockets;
+}
+
+/**
+ * Stops receiving, and hands all buckets over to the writers, which then
+ * get stopped as soon as they wrote them (see join()).
+ *
+ * All of this is bound to the drain timeout, counted from here.
+ */
+void Server::stop()
+{
+	statsTimer_.stop();
+	writerTimer_.stop();
+	loadTimer_.stop();
+
+	draining_ = true;
+	drainStart_ = std::chrono::steady_clock::now();
+	drainDeadline_ = drainStart_ + std::chrono::seconds(drainTimeout_);
+
+	for (auto worker: workers_)
+		worker->shutdown(drainDeadline_);
+
+	for (auto worker: workers_)
+		worker->join();
+
+	// the worker threads are gone now, so their loops' watchers may be touched again
+	for (auto listener: listeners_)
+		delete listener;
+
+	listeners_.clear();
+
+	for (auto writer: writers_)
+		writer->stop();
+
+	// rather than holding up the exit, or racing the drain deadline
+	if (compactor_)
+		compactor_->abort();
+}
+
+/**
+ * Prints how much of the data buffered at shutdown made it to the writers.
+ *
+ * @param complete whether the writers wrote everything handed over to them,
+ *                 or the deadline passed with some of it still queued.
+ */
+void Server::reportDrain(bool complete)
+{
+	size_t buckets = 0, bytes = 0, lostBuckets = 0, lostBytes = 0;
+
+	for (auto worker: workers_) {
+		buckets += worker->drainedBuckets_;
+		bytes += worker->drainedBytes_;
+		lostBuckets += worker->lostBuckets_;
+		lostBytes += worker->lostBytes_;
+	}
+
+	// what the writers did not get to (what they buffered themselves is not accounted)
+	size_t queued = complete ? 0 : std::min(queuedBytes_.load(), bytes);
+
+	std::printf("Drained %zu buckets in %.3f s: %.2f MiB saved, %.2f MiB lost (%zu buckets%s)\n",
+		buckets,
+		std::chrono::duration<double>(std::chrono::steady_clock::now() - drainStart_).count(),
+		(bytes - queued) / 1024.0 / 1024.0,
+		(lostBytes + queued) / 1024.0 / 1024.0,
+		lostBuckets,
+		complete ? "" : ", plus those still queued at the deadline");
+}
+
+void Server::printHelp(const char* program)
+{
+	printf("usage: %s [-a ADDRESS] [-p PORT] [-s STORAGE_PATH] [resource options] | -h\n"
 		   "\n"
 		   "  -h, -?, --help               print this help\n"
 		   "  -a, --address=ADDR           binds to this UDP address for listening [%s]\n"
@@ -602,12 +5076,121 @@ void Server::printHelp(const char* program)
 		   "  -n, --max-bucket-size=VALUE  sets the limit of items per bucket [%zu]\n"
 		   "  -i, --max-bucket-idle=VALUE  sets the maximum bucket idle time in seconds [%zu]\n"
 		   "  -t, --max-bucket-ttl=VALUE   sets the bucket TTL (time to life) in seconds [%zu]\n"
+		   "  -b, --batch-size=VALUE       number of datagrams to receive per recvmmsg() call [%zu]\n"
+		   "                               (a value of 1 uses plain recvfrom())\n"
+		   "  -w, --workers=VALUE          number of bucket worker threads, each owning a distinct\n"
+		   "                               share of the key space [%zu]\n"
+		   "                               (a value of 0 manages all buckets in the main thread)\n"
+		   "  -l, --listeners=VALUE        number of SO_REUSEPORT listener threads, each with its own\n"
+		   "                               socket and buckets; the kernel steers all messages of\n"
+		   "                               one key to the same socket (overrides --workers) [%zu]\n"
+		   "  -m, --storage=MODE           bucket storage, one of: [%s]\n"
+		   "                                 pipe   a pipe per bucket, flushed via splice()\n"
+		   "                                 arena  userspace memory chunks, flushed via writev()\n"
+		   "  -M, --max-memory=BYTES       limit of bytes buffered by all buckets (K, M, G suffixes),\n"
+		   "                               beyond which the least recently used are flushed [%zu]\n"
+		   "  -W, --writers=VALUE          number of writer threads, each writing its own chunk files\n"
+		   "                               (<chunk>.<writer>.csv), buckets assigned by key [%zu]\n"
+		   "  -g, --group-commit=BYTES     gather flushed buckets into groups of up to BYTES (K, M, G\n"
+		   "                               suffixes), each written at once and followed by a single\n"
+		   "                               fdatasync() (a value of 0 writes buckets one by one) [%zu]\n"
+		   "  -G, --group-commit-delay=MS  max. time a bucket waits for its group to fill up [%zu]\n"
+		   "  -o, --output=MODE            how writers perform their I/O, one of: [%s]\n"
+		   "                                 sync   blocking writev() and splice() calls\n"
+		   "                                 uring  many writes in flight via io_uring, with registered\n"
+		   "                                        buffers and files (group commit: one sync per batch)\n"
+		   "                                 direct O_DIRECT writes from double buffers, bypassing the page\n"
+		   "                                        cache, files preallocated (group commit: one sync per batch)\n"
+		   "  -z, --compress=CODEC[:LEVEL] write chunk files as independent compressed frames, each of\n"
+		   "                               up to 1 MiB or 1 s of buckets, into <chunk>.csv.zst or .lz4;\n"
+		   "                               one of: none, zstd, lz4 [%s]\n"
+		   "  -Z, --compress-threads=VALUE number of threads compressing the frames of all writers [%zu]\n"
+		   "  -f, --format=FORMAT          chunk file format, one of: [%s]\n"
+		   "                                 csv       first_seen;key;values lines, into <chunk>.csv\n"
+		   "                                 columnar  binary blocks of timestamp, key and value columns,\n"
+		   "                                           with a sorted key index and per-block time ranges\n"
+		   "                                           in the footer, into <chunk>.kcol\n"
+		   "  -C, --compact=BYTES          once a writer moved on to the next chunk, rewrite the previous\n"
+		   "                               CSV chunk file with each key's records merged into one, sorted\n"
+		   "                               by key, using up to BYTES of memory (K, M, G suffixes) for\n"
+		   "                               sorting (a value of 0 does not compact) [%zu]\n"
+		   "  -D, --drain-timeout=SECONDS  on SIGTERM or SIGINT, max. time to hand all buckets over to\n"
+		   "                               the writers and write them, before exiting anyway [%zu]\n"
+		   "  -S, --spill=BYTES            once a bucket buffers BYTES (K, M, G suffixes), its pipe is\n"
+		   "                               full, or its worker exceeds its share of --max-memory, move\n"
+		   "                               the bucket's contents into a per-worker spill file within the\n"
+		   "                               storage path, to be written from there (a value of 0 does\n"
+		   "                               not spill) [%zu]\n"
+		   "  -O, --overload-lag=MS        event loop lag considered overload, as is a receive or writer\n"
+		   "                               queue more than half full; under overload, fewer new keys get\n"
+		   "                               a bucket and the idle timeout shortens, step by step (a value\n"
+		   "                               of 0 does not control load) [%zu]\n"
+		   "  -R, --receive-buffer=BYTES   receive buffer size of the UDP sockets (K, M, G suffixes), also\n"
+		   "                               beyond net.core.rmem_max with CAP_NET_ADMIN (a value of 0\n"
+		   "                               keeps the system's default) [%zu]\n"
 		   "\n",
 		   program,
-		   address_.c_str(), port_, writer_.storagePath().c_str(),
-		   maxBucketCount_, maxBucketSize_, maxBucketIdle_, maxBucketTTL_
+		   address_.c_str(), port_, storagePath_.c_str(),
+		   maxBucketCount_, maxBucketSize_, maxBucketIdle_, maxBucketTTL_,
+		   batchSize_, workerCount_, listenerCount_,
+		   storage_ == PipeStorage ? "pipe" : "arena",
+		   maxMemory_,
+		   writerCount_,
+		   groupCommitSize_,
+		   groupCommitDelay_,
+		   output_ == SyncOutput ? "sync" : output_ == UringOutput ? "uring" : "direct",
+		   x0::Codec::name(compression_),
+		   compressionThreads_,
+		   format_ == CsvFormat ? "csv" : "columnar",
+		   compactMemory_,
+		   drainTimeout_,
+		   spillSize_,
+		   overloadLag_,
+		   receiveBufferSize_
 	);
 }
+
+/**
+ * Parses a number of bytes, optionally suffixed by K, M or G (powers of 1024).
+ *
+ * @retval false the value is not a number, has an unknown suffix, or overflows.
+ */
+bool Server::parseSize(const char* value, size_t* result)
+{
+	if (!isdigit(static_cast<unsigned char>(*value)))
+		return false;
+
+	char* end = nullptr;
+	errno = 0;
+	unsigned long long size = std::strtoull(value, &end, 10);
+	if (errno == ERANGE)
+		return false;
+
+	unsigned shift = 0;
+	switch (*end) {
+		case 'G':
+		case 'g':
+			shift += 10;
+			// fall through
+		case 'M':
+		case 'm':
+			shift += 10;
+			// fall through
+		case 'K':
+		case 'k':
+			shift += 10;
+			++end;
+			break;
+		default:
+			break;
+	}
+
+	if (*end != '\0' || size > (SIZE_MAX >> shift))
+		return false;
+
+	*result = static_cast<size_t>(size) << shift;
+	return true;
+}
 // }}}
 
 int main(int argc, char* argv[])
@@ -0,0 +1,539 @@
+#include "ColumnarChunk.h"
+#include <algorithm>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cfloat>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#	include <immintrin.h>
+#endif
+
+/*
+ * kollekt-query - scans kollektd chunk files (<chunk>.csv, <chunk>.kcol),
+ * filtering their records by key, key prefix, and time range, and either
+ * printing or aggregating them.
+ *
+ * Files are memory-mapped and split across threads: CSV files at record
+ * boundaries, columnar files by block, where the footer's index is used to
+ * skip blocks that cannot match.
+ */
+
+enum Mode {
+	PrintRecords,  // the matching records, as CSV
+	CountKeys,     // number of records per key
+	CountValues,   // number of occurrences per value
+	Summary,       // totals only
+};
+
+struct Filter // {{{
+{
+	std::string key;
+	bool prefix;
+	double from;
+	double to;
+
+	Filter() : key(), prefix(false), from(-DBL_MAX), to(DBL_MAX) {}
+
+	bool hasKey() const { return !key.empty(); }
+
+	bool matchTime(double time) const { return time >= from && time < to; }
+
+	bool matchKey(const char* data, size_t size) const
+	{
+		if (key.empty())
+			return true;
+
+		if (prefix)
+			return size >= key.size() && std::memcmp(data, key.data(), key.size()) == 0;
+
+		return size == key.size() && std::memcmp(data, key.data(), size) == 0;
+	}
+}; // }}}
+
+struct Result // {{{
+{
+	std::string output;
+	std::unordered_map<std::string, size_t> counts;
+	size_t records;
+	size_t values;
+	double minTime;
+	double maxTime;
+
+	Result() : output(), counts(), records(0), values(0), minTime(DBL_MAX), maxTime(-DBL_MAX) {}
+
+	void record(double time)
+	{
+		++records;
+		minTime = std::min(minTime, time);
+		maxTime = std::max(maxTime, time);
+	}
+
+	void merge(const Result& other)
+	{
+		output += other.output;
+		for (const auto& i: other.counts)
+			counts[i.first] += i.second;
+		records += other.records;
+		values += other.values;
+		minTime = std::min(minTime, other.minTime);
+		maxTime = std::max(maxTime, other.maxTime);
+	}
+}; // }}}
+
+// {{{ delimiter search
+/**
+ * Finds the first occurrence of @p c within [p, end), or returns end.
+ *
+ * Compares 32 (AVX2) or 16 (SSE2) bytes at a time.
+ */
+static inline const char* findByte(const char* p, const char* end, char c)
+{
+#if defined(__AVX2__)
+	const __m256i needle = _mm256_set1_epi8(c);
+	for (; end - p >= 32; p += 32) {
+		__m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+		unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+#endif
+#if defined(__SSE2__)
+	const __m128i needle16 = _mm_set1_epi8(c);
+	for (; end - p >= 16; p += 16) {
+		__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle16));
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+#endif
+	for (; p != end; ++p)
+		if (*p == c)
+			return p;
+
+	return end;
+}
+// }}}
+
+// {{{ CSV
+static const char CsvHeader[] = "first_seen;key;values";
+
+/**
+ * Processes a single record (without its leading newline) of a CSV chunk.
+ */
+static void scanRecord(const char* line, const char* end, const Filter& filter, Mode mode, Result* result)
+{
+	const size_t headerSize = sizeof(CsvHeader) - 1;
+
+	// a restarted kollektd appends its header line right after the last record
+	if (static_cast<size_t>(end - line) >= headerSize && std::memcmp(end - headerSize, CsvHeader, headerSize) == 0)
+		end -= headerSize;
+
+	const char* timeEnd = findByte(line, end, ';');
+	if (timeEnd == end)
+		return;
+
+	const char* key = timeEnd + 1;
+	const char* keyEnd = findByte(key, end, ';');
+
+	if (!filter.matchKey(key, keyEnd - key))
+		return;
+
+	char* parsed = nullptr;
+	double time = std::strtod(line, &parsed);
+	if (parsed != timeEnd || !filter.matchTime(time))
+		return;
+
+	result->record(time);
+
+	switch (mode) {
+	case PrintRecords:
+		result->output.append(line, end);
+		result->output.push_back('\n');
+		break;
+	case CountKeys:
+		++result->counts[std::string(key, keyEnd)];
+		break;
+	case CountValues:
+	case Summary:
+		if (mode == Summary)
+			++result->counts[std::string(key, keyEnd)];
+
+		for (const char* value = keyEnd; value != end; ) {
+			const char* valueEnd = findByte(value + 1, end, ';');
+			if (mode == CountValues)
+				++result->counts[std::string(value + 1, valueEnd)];
+			++result->values;
+			value = valueEnd;
+		}
+		break;
+	}
+}
+
+// scans all records starting within [begin, end), each introduced by a newline
+static void scanCsv(const char* begin, const char* end, const char* fileEnd, const Filter& filter, Mode mode, Result* result)
+{
+	const char* p = findByte(begin, end, '\n');
+
+	while (p != end) {
+		const char* line = p + 1;
+		const char* lineEnd = findByte(line, fileEnd, '\n');
+		scanRecord(line, lineEnd, filter, mode, result);
+		p = lineEnd < end ? lineEnd : end;
+	}
+}
+
+static bool queryCsv(const char* data, size_t size, const Filter& filter, Mode mode, unsigned threadCount, Result* result)
+{
+	const char* end = data + size;
+	std::vector<Result> results(threadCount);
+	std::vector<std::thread> threads;
+
+	// thread i handles all records whose newline lies within its share of the file
+	for (unsigned i = 0; i < threadCount; ++i) {
+		const char* begin = data + size / threadCount * i;
+		const char* until = i + 1 == threadCount ? end : data + size / threadCount * (i + 1);
+		threads.push_back(std::thread(scanCsv, begin, until, end, std::cref(filter), mode, &results[i]));
+	}
+
+	for (unsigned i = 0; i < threadCount; ++i) {
+		threads[i].join();
+		result->merge(results[i]);
+	}
+
+	return true;
+}
+// }}}
+
+// {{{ columnar
+static void scanBlocks(const char* data, size_t size, const x0::ColumnarIndex* index, const uint32_t* blocks, size_t count,
+	const Filter& filter, Mode mode, Result* result)
+{
+	char buf[64];
+
+	for (size_t b = 0; b < count; ++b) {
+		if (blocks[b] >= index->blocks().size()) {
+			std::fprintf(stderr, "Skipping unknown block %u.\n", blocks[b]);
+			continue;
+		}
+
+		const x0::ColumnarBlockEntry& entry = index->blocks()[blocks[b]];
+
+		// the file may have been truncated behind the index's back
+		x0::ColumnarBlockReader block;
+		if (entry.offset > size || entry.size > size - entry.offset || !block.parse(data + entry.offset, entry.size)) {
+			std::fprintf(stderr, "Skipping corrupt block at offset %llu.\n", static_cast<unsigned long long>(entry.offset));
+			continue;
+		}
+
+		const uint32_t* counts = block.counts();
+		const uint32_t* lengths = block.lengths();
+		const char* values = block.values();
+
+		for (size_t row = 0; row < block.rowCount(); ++row) {
+			const uint32_t* rowLengths = lengths;
+			const char* rowValues = values;
+
+			// advance to the next row's values
+			for (uint32_t i = 0; i < counts[row]; ++i)
+				values += *lengths++;
+
+			double time = block.time(row);
+			if (!filter.matchTime(time))
+				continue;
+
+			std::string key = block.key(row);
+			if (!filter.matchKey(key.data(), key.size()))
+				continue;
+
+			result->record(time);
+
+			switch (mode) {
+			case PrintRecords:
+				result->output.append(buf, snprintf(buf, sizeof(buf), "%f;", time));
+				result->output += key;
+				for (uint32_t i = 0; i < counts[row]; ++i) {
+					result->output.push_back(';');
+					result->output.append(rowValues, rowLengths[i]);
+					rowValues += rowLengths[i];
+				}
+				result->output.push_back('\n');
+				break;
+			case CountKeys:
+				++result->counts[key];
+				break;
+			case CountValues:
+				for (uint32_t i = 0; i < counts[row]; ++i) {
+					++result->counts[std::string(rowValues, rowLengths[i])];
+					rowValues += rowLengths[i];
+				}
+				result->values += counts[row];
+				break;
+			case Summary:
+				++result->counts[key];
+				result->values += counts[row];
+				break;
+			}
+		}
+	}
+}
+
+static bool queryColumnar(const char* data, size_t size, const Filter& filter, Mode mode, unsigned threadCount, Result* result)
+{
+	x0::ColumnarFileHeader header;
+	if (size < sizeof(header) || (std::memcpy(&header, data, sizeof(header)), header.magic != x0::ColumnarFileMagic)) {
+		std::fprintf(stderr, "Not a columnar chunk file.\n");
+		return false;
+	}
+
+	x0::ColumnarIndex index;
+	x0::ColumnarTrailer trailer;
+	bool indexed = false;
+
+	if (size >= sizeof(header) + sizeof(trailer)) {
+		std::memcpy(&trailer, data + size - sizeof(trailer), sizeof(trailer));
+		indexed = trailer.magic == x0::ColumnarTrailerMagic
+			&& trailer.footerSize <= size - sizeof(header) - sizeof(trailer)
+			&& trailer.footerOffset == size - sizeof(trailer) - trailer.footerSize
+			&& index.parse(data + trailer.footerOffset, trailer.footerSize, trailer.footerOffset);
+	}
+
+	if (!indexed) {
+		// still being written (or crashed), so index it block by block
+		std::fprintf(stderr, "No footer found, scanning all blocks.\n");
+		index.clear();
+		size_t offset = sizeof(header);
+		while (index.addBlock(offset, data + offset, size - offset))
+			offset += index.blocks().back().size;
+	}
+
+	std::vector<uint32_t> blocks;
+	if (filter.hasKey() && indexed) {
+		blocks = index.findBlocks(filter.key, filter.prefix);
+	} else {
+		for (uint32_t i = 0; i < index.blocks().size(); ++i)
+			blocks.push_back(i);
+	}
+
+	// skip blocks outside the time range
+	blocks.erase(std::remove_if(blocks.begin(), blocks.end(), [&](uint32_t i) {
+		const x0::ColumnarBlockEntry& entry = index.blocks()[i];
+		return entry.maxTime < filter.from || entry.minTime >= filter.to;
+	}), blocks.end());
+
+	threadCount = std::max<size_t>(1, std::min<size_t>(threadCount, blocks.size()));
+	std::vector<Result> results(threadCount);
+	std::vector<std::thread> threads;
+
+	for (unsigned i = 0; i < threadCount; ++i) {
+		size_t first = blocks.size() * i / threadCount;
+		size_t last = blocks.size() * (i + 1) / threadCount;
+		threads.push_back(std::thread(scanBlocks, data, size, &index, blocks.data() + first, last - first,
+			std::cref(filter), mode, &results[i]));
+	}
+
+	for (unsigned i = 0; i < threadCount; ++i) {
+		threads[i].join();
+		result->merge(results[i]);
+	}
+
+	return true;
+}
+// }}}
+
+static bool query(const char* filename, const Filter& filter, Mode mode, unsigned threadCount, Result* result)
+{
+	int fd = ::open(filename, O_RDONLY);
+	if (fd < 0) {
+		std::fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		std::fprintf(stderr, "Could not stat %s: %s\n", filename, strerror(errno));
+		::close(fd);
+		return false;
+	}
+
+	if (st.st_size == 0) {
+		::close(fd);
+		return true;
+	}
+
+	void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+
+	if (data == MAP_FAILED) {
+		std::fprintf(stderr, "Could not map %s: %s\n", filename, strerror(errno));
+		return false;
+	}
+
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	size_t length = strlen(filename);
+	bool columnar = length > 5 && strcmp(filename + length - 5, ".kcol") == 0;
+
+	bool rv = columnar
+		? queryColumnar(static_cast<const char*>(data), st.st_size, filter, mode, threadCount, result)
+		: queryCsv(static_cast<const char*>(data), st.st_size, filter, mode, threadCount, result);
+
+	munmap(data, st.st_size);
+
+	return rv;
+}
+
+static void printCounts(const Result& result, size_t limit)
+{
+	std::vector<std::pair<std::string, size_t>> counts(result.counts.begin(), result.counts.end());
+	std::sort(counts.begin(), counts.end(), [](const std::pair<std::string, size_t>& a, const std::pair<std::string, size_t>& b) {
+		return a.second > b.second || (a.second == b.second && a.first < b.first);
+	});
+
+	if (limit && counts.size() > limit)
+		counts.resize(limit);
+
+	for (const auto& i: counts)
+		std::printf("%zu\t%s\n", i.second, i.first.c_str());
+}
+
+static void printHelp(const char* program, unsigned threadCount)
+{
+	std::printf(
+		"usage: %s [options] FILE...\n"
+		"\n"
+		"  -h, --help               print this help\n"
+		"  -k, --key=KEY            only records of this key\n"
+		"  -p, --prefix=PREFIX      only records whose key starts with PREFIX\n"
+		"  -f, --from=TIME          only records first seen at or after TIME (UNIX seconds)\n"
+		"  -t, --to=TIME            only records first seen before TIME (UNIX seconds)\n"
+		"  -a, --aggregate=MODE     what to output, one of: [records]\n"
+		"                             records  the matching records, as CSV\n"
+		"                             keys     number of records per key\n"
+		"                             values   number of occurrences per value\n"
+		"                             summary  number of records and values, and their time range\n"
+		"  -n, --limit=COUNT        print the COUNT most frequent keys or values only [0 = all]\n"
+		"  -j, --threads=COUNT      number of scanning threads [%u]\n"
+		"\n"
+		"  Reads <chunk>.csv and <chunk>.kcol files, as written by kollektd. Columnar files\n"
+		"  are only scanned where their footer's key index and time ranges may match.\n"
+		"\n",
+		program, threadCount);
+}
+
+int main(int argc, char* argv[])
+{
+	static const struct option long_options[] = {
+		{ "help", no_argument, NULL, 'h' },
+		{ "key", required_argument, NULL, 'k' },
+		{ "prefix", required_argument, NULL, 'p' },
+		{ "from", required_argument, NULL, 'f' },
+		{ "to", required_argument, NULL, 't' },
+		{ "aggregate", required_argument, NULL, 'a' },
+		{ "limit", required_argument, NULL, 'n' },
+		{ "threads", required_argument, NULL, 'j' },
+		{ 0, 0, 0, 0 }
+	};
+
+	Filter filter;
+	Mode mode = PrintRecords;
+	size_t limit = 0;
+	unsigned threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+	for (bool args_parsed = false; !args_parsed; ) {
+		int long_index = 0;
+		switch (getopt_long(argc, argv, "?hk:p:f:t:a:n:j:", long_options, &long_index)) {
+			case '?':
+			case 'h':
+				printHelp(argv[0], threadCount);
+				return 0;
+			case 'k':
+				filter.key = optarg;
+				filter.prefix = false;
+				break;
+			case 'p':
+				filter.key = optarg;
+				filter.prefix = true;
+				break;
+			case 'f':
+				filter.from = std::strtod(optarg, nullptr);
+				break;
+			case 't':
+				filter.to = std::strtod(optarg, nullptr);
+				break;
+			case 'a':
+				if (strcmp(optarg, "records") == 0)
+					mode = PrintRecords;
+				else if (strcmp(optarg, "keys") == 0)
+					mode = CountKeys;
+				else if (strcmp(optarg, "values") == 0)
+					mode = CountValues;
+				else if (strcmp(optarg, "summary") == 0)
+					mode = Summary;
+				else {
+					std::fprintf(stderr, "Unknown aggregation: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'n':
+				limit = std::strtoul(optarg, nullptr, 10);
+				break;
+			case 'j':
+				threadCount = std::max(1, std::atoi(optarg));
+				break;
+			case -1:
+				args_parsed = true;
+				break;
+			default:
+				return 1;
+		}
+	}
+
+	if (optind == argc) {
+		printHelp(argv[0], threadCount);
+		return 1;
+	}
+
+	int status = 0;
+	Result total;
+
+	// aggregations span all files, while records are printed file by file
+	for (int i = optind; i < argc; ++i) {
+		Result result;
+		if (!query(argv[i], filter, mode, threadCount, &result)) {
+			status = 1;
+			continue;
+		}
+
+		std::fwrite(result.output.data(), 1, result.output.size(), stdout);
+		result.output.clear();
+		total.merge(result);
+	}
+
+	switch (mode) {
+	case PrintRecords:
+		break;
+	case CountKeys:
+	case CountValues:
+		printCounts(total, limit);
+		break;
+	case Summary:
+		std::printf("records: %zu, values: %zu, keys: %zu, first_seen: %f .. %f\n",
+			total.records, total.values, total.counts.size(),
+			total.records ? total.minTime : 0.0,
+			total.records ? total.maxTime : 0.0);
+		break;
+	}
+
+	return status;
+}
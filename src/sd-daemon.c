@@ -326,6 +326,10 @@ int sd_is_socket_unix(int fd, int type, int listening, const char *path, size_t
 }
 
 int sd_notify(int unset_environment, const char *state) {
+        return sd_notify_with_fds(unset_environment, state, NULL, 0);
+}
+
+int sd_notify_with_fds(int unset_environment, const char *state, const int *fds, unsigned n_fds) {
 #if defined(DISABLE_SYSTEMD) || !defined(__linux__) || !defined(SOCK_CLOEXEC)
         return 0;
 #else
@@ -333,9 +337,11 @@ int sd_notify(int unset_environment, const char *state) {
         struct msghdr msghdr;
         struct iovec iovec;
         union sockaddr_union sockaddr;
+        struct cmsghdr *cmsg;
+        char *control = NULL;
         const char *e;
 
-        if (!state) {
+        if (!state || (n_fds > 0 && !fds)) {
                 r = -EINVAL;
                 goto finish;
         }
@@ -375,6 +381,21 @@ int sd_notify(int unset_environment, const char *state) {
         msghdr.msg_iov = &iovec;
         msghdr.msg_iovlen = 1;
 
+        if (n_fds > 0) {
+                msghdr.msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+                if (!(control = calloc(1, msghdr.msg_controllen))) {
+                        r = -ENOMEM;
+                        goto finish;
+                }
+                msghdr.msg_control = control;
+
+                cmsg = CMSG_FIRSTHDR(&msghdr);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+                memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n_fds);
+        }
+
         if (sendmsg(fd, &msghdr, MSG_NOSIGNAL) < 0) {
                 r = -errno;
                 goto finish;
@@ -389,6 +410,8 @@ finish:
         if (fd >= 0)
                 close(fd);
 
+        free(control);
+
         return r;
 #endif
 }
@@ -223,6 +223,24 @@ int sd_is_socket_unix(int fd, int type, int listening, const char *path, size_t
 */
 int sd_notify(int unset_environment, const char *state) _sd_hidden_;
 
+/*
+  Similar to sd_notify() but passes the given file descriptors along
+  (SCM_RIGHTS), as needed for storing them in the service manager's
+  file descriptor store:
+
+     FDSTORE=1    Stores the passed file descriptors, to be passed back
+                  (via sd_listen_fds()) when the service is restarted.
+                  Requires FileDescriptorStoreMax= to be set.
+
+     FDNAME=...   Names the passed file descriptors, as reported in
+                  $LISTEN_FDNAMES.
+
+  Example: A daemon could stash its listening socket before exiting:
+
+     sd_notify_with_fds(0, "FDSTORE=1\nFDNAME=listen", &fd, 1);
+*/
+int sd_notify_with_fds(int unset_environment, const char *state, const int *fds, unsigned n_fds) _sd_hidden_;
+
 /*
   Similar to sd_notify() but takes a format string.
 